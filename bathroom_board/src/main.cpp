@@ -4,12 +4,16 @@
 #include <string.h>
 #include <Qth.h>
 
+#include "rtc_memory.h"
+
 // The control pin for the servo will be attached to this pin
 #define SERVO_PIN D4
 #define SERVO_MIN_PULSE_US 450
 #define SERVO_MAX_PULSE_US 2450
 
 // The pin for the LDR
+//
+// NB: Must be A0 since the LDR is sampled via the ADC service.
 #define LDR_PIN A0
 
 // LDR low/high water mark (LDR reading)
@@ -22,29 +26,82 @@
 // Sample period of the LDR (ms)
 #define LDR_SAMPLE_PERIOD 100
 
+// Each LDR sample is the mean of this many ADC readings, evenly spaced across
+// the sample period (i.e. the decimation factor).
+#define LDR_OVERSAMPLE 4
+
+// Samples are passed through an exponential filter with weight
+// 1/2^LDR_FILTER_SHIFT (0 disables the filter). To avoid the filter delaying
+// detection of real state changes, any sample differing from the filtered
+// value by more than LDR_FILTER_SNAP is taken as-is. Noise near the water marks
+// is therefore filtered while a change in the boiler's indicator is detected
+// within one sample period.
+#define LDR_FILTER_SHIFT 2
+#define LDR_FILTER_SNAP 150
+
 // Servo angles while the button is being pressed and released
 #define SERVO_PRESSED_ANGLE 70
 #define SERVO_RELEASED_ANGLE 0
 #define SERVO_PRESS_DURATION 500
 
+// The press duration is adapted based on the measured time for the boiler to
+// respond to a press. It is set to the mean plus two standard deviations of
+// the response time (less the time taken for the servo to move), plus
+// SERVO_PRESS_MARGIN, within the bounds below. Each failed press lengthens
+// the press duration by half.
+#define SERVO_MIN_PRESS_DURATION 200
+#define SERVO_MAX_PRESS_DURATION 2000
+#define SERVO_PRESS_MARGIN 100
+
+// Minimum number of responses to measure before adapting the press duration
+#define SERVO_PRESS_ADAPT_MIN_SAMPLES 3
+
+// Time (ms) allowed for the servo to move into position and time to wait after
+// releasing the button before detaching the servo.
+#define SERVO_MOVE_DURATION 500
+#define SERVO_DETACH_DURATION 100
+
+// Time budget (ms) for each call to the controller's loop before a watchdog
+// report is produced.
+#define CONTROLLER_LOOP_BUDGET 200
+
 // Rate limit for changes (ms)
 #define RATE_LIMIT (30 * 1000)
 
 // Allow n changes in this many ms
 #define N_CHANGES 10
-#define N_CHANGE_RATE_LIMIT (10 * 60 * 60 * 1000)
+#define N_CHANGE_RATE_LIMIT (10l * 60l * 60l * 1000l)
 
 // Allow re-trying pressing the button this many times
 #define N_RETRIES 5
 
+// The controller's rate limiting and fault state is persisted across resets
+// in RTC memory and, to survive power loss, in flash storage at this address.
+// Both are updated whenever the state changes: each button press (which uses
+// up one of the N_CHANGES), fault and commanded state change, and the
+// N_CHANGE_RATE_LIMIT window restarting. Flash is therefore never written in
+// steady state. Presses and faults are committed to flash immediately, other
+// changes within STORAGE_QUIET_PERIOD.
+#define PERSISTENT_STATE_EEPROM_ADDR 0
+
 #define QTH_PREFIX "heating/hot_water"
 
 const char *qth_client_id = "nodemcu_bathroom_board";
 const char *qth_client_description = "Heating and bathroom stuff";
 #include "common.inc"
 
+WatchdogSection controller_loop_section("hot_water", CONTROLLER_LOOP_BUDGET);
+
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * The clock (ms) used by the hot water controller, its timeouts and the LDR
+ * monitor. Only the low 32 bits are used (as returned by millis() on the
+ * ESP8266) and all comparisons are wraparound-safe. Replaceable so that the
+ * controller can be driven from a test clock.
+ */
+unsigned long (*controller_millis)() = millis;
+
 
 /**
  * Simple timeout timer.
@@ -64,7 +121,7 @@ class Timeout {
 		 * around may occur).
 		 */
 		void reset(long new_duration) {
-			end = millis() + new_duration;
+			end = controller_millis() + new_duration;
 			has_expired = false;
 		}
 		
@@ -77,8 +134,8 @@ class Timeout {
 		 */
 		bool expired() {
 			if (!has_expired) {
-				long now = millis();
-				has_expired = (now - end) >= 0l;
+				uint32_t now = controller_millis();
+				has_expired = (int32_t)(now - end) >= 0;
 			}
 			
 			return has_expired;
@@ -86,50 +143,78 @@ class Timeout {
 	
 	private:
 		bool has_expired;
-		long end;
+		uint32_t end;
 };
 
 /** 
- * Monitor the state of the LDR
+ * Monitor the state of the LDR (sampled via the ADC service).
  */
 class LDRMonitor {
 	public:
-		LDRMonitor(int pin, int low_threshold, int high_threshold, bool inverted, long sample_interval)
-			: pin(pin)
-			, low_threshold(low_threshold)
+		LDRMonitor(int low_threshold, int high_threshold, bool inverted, long sample_interval,
+		           int oversample, int filter_shift, int filter_snap)
+			: low_threshold(low_threshold)
 			, high_threshold(high_threshold)
 			, inverted(inverted)
 			, sample_interval(sample_interval)
-			, is_initialised(false)
+			, oversample(oversample)
+			, filter_shift(filter_shift)
+			, filter_snap(filter_snap)
+			, accumulator(0)
+			, n_accumulated(0)
+			, filtered(0)
+			, initialised(false)
 			, state(false)
+			, last_change_time(0)
 		{
+			adc_service.add_consumer(sample_interval / oversample, on_adc_sample, this);
 		}
 		
 		/**
-		 * Scan the LDR for state changes. Run regularly, or before reading
-		 * get_state.
+		 * Process a new LDR reading, checking for state changes.
 		 */
-		void loop() {
-			if (sample_timer.expired()) {
-				const int adc = analogRead(pin);
-				
-				if (!is_initialised) {
-					// Not initialised, set up state based on reality
-					state = adc >= high_threshold;
-					is_initialised = true;
+		void add_sample(int reading) {
+			accumulator += reading;
+			if (++n_accumulated < oversample) {
+				return;
+			}
+			const int adc = accumulator / n_accumulated;
+			accumulator = 0;
+			n_accumulated = 0;
+			
+			if (!initialised) {
+				// Not initialised, set up state based on reality
+				filtered = adc << FRAC_BITS;
+				state = adc >= high_threshold;
+				initialised = true;
+			} else {
+				if (abs(adc - (filtered >> FRAC_BITS)) > filter_snap) {
+					filtered = adc << FRAC_BITS;
 				} else {
-					// Already initialised, change state only if past a high/low water mark
-					if (adc >= high_threshold) {
-						state = true;
-					} else if (adc <= low_threshold) {
-						state = false;
-					}
+					filtered += ((adc << FRAC_BITS) - filtered) >> filter_shift;
 				}
 				
-				sample_timer.reset(sample_interval);
+				// Already initialised, change state only if past a high/low water mark
+				bool last_state = state;
+				if ((filtered >> FRAC_BITS) >= high_threshold) {
+					state = true;
+				} else if ((filtered >> FRAC_BITS) <= low_threshold) {
+					state = false;
+				}
+				if (state != last_state) {
+					last_change_time = controller_millis();
+				}
 			}
 		}
 		
+		/**
+		 * Has a (full, oversampled) reading been taken yet? Until then
+		 * get_state() is meaningless.
+		 */
+		bool is_initialised() const {
+			return initialised;
+		}
+		
 		/**
 		 * Get the current LDR state.
 		 */
@@ -137,10 +222,17 @@ class LDRMonitor {
 			// NB: != is boolean XOR
 			return state != inverted;
 		}
+		
+		/**
+		 * Get the time (controller_millis()) when the state last changed.
+		 */
+		uint32_t get_last_change_time() {
+			return last_change_time;
+		}
 	
 	private:
-		// The Analogue pin to read
-		const int pin;
+		// Fractional bits used by the (fixed point) filtered value
+		static const int FRAC_BITS = 4;
 		
 		// The low and high water thresholds for the LDR ADC value
 		const int low_threshold;
@@ -149,28 +241,49 @@ class LDRMonitor {
 		// Should the reported state be inverted?
 		const bool inverted;
 		
-		// Limit how frequently should the timer be polled to being polled no more
-		// often than sample_interval ms.
+		// Interval (ms) between (decimated) samples.
 		const long sample_interval;
-		Timeout sample_timer;
 		
-		// Has 'loop' been called before? If not, initialisation must take place
-		bool is_initialised;
+		// Oversampling (decimation) factor and filter parameters
+		const int oversample;
+		const int filter_shift;
+		const int filter_snap;
+		
+		// Sum and count of readings taken so far during the current sample
+		// period.
+		long accumulator;
+		int n_accumulated;
+		
+		// Filtered reading (fixed point)
+		long filtered;
+		
+		// Has a reading been taken? If not, initialisation must take place
+		bool initialised;
 		
 		// The current state
 		bool state;
+		uint32_t last_change_time;
+		
+		static void on_adc_sample(int reading, void *data) {
+			((LDRMonitor *)data)->add_sample(reading);
+		}
 };
 
 
 /**
  * Drive the servo.
+ *
+ * All movements are carried out asynchronously by a state machine driven by
+ * loop() so the servo never blocks the main loop.
  */
 class ServoControl {
 	public:
-		ServoControl(int pin, int up_position, int down_position, long press_duration)
+		ServoControl(int pin, int up_position, int down_position,
+		             long move_duration, long press_duration)
 			: pin(pin)
 			, up_position(up_position)
 			, down_position(down_position)
+			, move_duration(move_duration)
 			, press_duration(press_duration)
 			, state(State::idle)
 			, servo()
@@ -188,6 +301,11 @@ class ServoControl {
 						break;
 					
 					case State::release:
+					case State::move:
+						enter_detach_state();
+						break;
+					
+					case State::detach:
 						enter_idle_state();
 						break;
 					
@@ -207,12 +325,45 @@ class ServoControl {
 			}
 		}
 		
+		/**
+		 * Move the servo to an arbitrary position (for calibration purposes)
+		 * and then detach it. Does nothing (and returns false) if the servo is
+		 * already moving.
+		 */
+		bool move_to(int position) {
+			if (state != State::idle) {
+				return false;
+			}
+			servo.attach(pin, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+			servo.write(position);
+			Serial.print("Moving servo to ");
+			Serial.println(position);
+			state = State::move;
+			timeout.reset(move_duration);
+			return true;
+		}
+		
 		/**
 		 * Is the servo currently actuating?
 		 */
 		bool idle() {
 			return state == State::idle;
 		}
+		
+		long get_move_duration() const {
+			return move_duration;
+		}
+		
+		long get_press_duration() const {
+			return press_duration;
+		}
+		
+		/**
+		 * Change the press duration used by subsequent calls to actuate().
+		 */
+		void set_press_duration(long new_press_duration) {
+			press_duration = new_press_duration;
+		}
 	
 	private:
 		// Servo pin number
@@ -223,12 +374,27 @@ class ServoControl {
 		const int up_position;
 		const int down_position;
 		
+		// Time (msec) to allow for the servo to move into position.
+		const long move_duration;
+		
 		// Time (msec) to hold down the button (or hold it up) to allow time for
-		// the servo to move and the button press to register.
-		const long press_duration;
+		// the button press to register (after the servo has moved).
+		long press_duration;
 		
 		// Current state of the servo
-		enum struct State {idle, press, release} state;
+		enum struct State {
+			idle,
+			
+			// Moving to and holding the down or up positions during actuate()
+			press,
+			release,
+			
+			// Moving to a position for move_to()
+			move,
+			
+			// Waiting before detaching the servo
+			detach,
+		} state;
 		
 		// Timeout used by state machine
 		Timeout timeout;
@@ -239,61 +405,191 @@ class ServoControl {
 		void enter_press_state() {
 			servo.attach(pin, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
 			servo.write(down_position);
-			delay(SERVO_PRESS_DURATION); // XXX
 			Serial.print("Moving servo to ");
 			Serial.println(down_position);
 			state = State::press;
-			timeout.reset(press_duration);
+			timeout.reset(move_duration + press_duration);
 		}
 		
 		void enter_release_state() {
 			servo.write(up_position);
-			delay(SERVO_PRESS_DURATION); // XXX
 			Serial.print("Moving servo to ");
 			Serial.println(up_position);
 			state = State::release;
-			timeout.reset(press_duration);
+			timeout.reset(move_duration + press_duration);
+		}
+		
+		void enter_detach_state() {
+			state = State::detach;
+			timeout.reset(SERVO_DETACH_DURATION);
 		}
 		
 		void enter_idle_state() {
 			servo.detach();
-			delay(100); // XXX
-			//digitalWrite(pin, LOW);
+			digitalWrite(pin, LOW);
 			state = State::idle;
 		}
 };
 
 
 
+/**
+ * Running mean, variance, minimum and maximum of a series of values (using
+ * Welford's algorithm).
+ */
+class RunningStats {
+	public:
+		RunningStats()
+			: n(0)
+			, mean(0)
+			, m2(0)
+			, min_value(0)
+			, max_value(0)
+		{
+		}
+		
+		void add(float x) {
+			n++;
+			float delta = x - mean;
+			mean += delta / n;
+			m2 += delta * (x - mean);
+			
+			if (n == 1 || x < min_value) {
+				min_value = x;
+			}
+			if (n == 1 || x > max_value) {
+				max_value = x;
+			}
+		}
+		
+		long get_n() const {
+			return n;
+		}
+		
+		float get_mean() const {
+			return mean;
+		}
+		
+		float get_stddev() const {
+			return n > 1 ? sqrt(m2 / (n - 1)) : 0;
+		}
+		
+		float get_min() const {
+			return min_value;
+		}
+		
+		float get_max() const {
+			return max_value;
+		}
+	
+	private:
+		long n;
+		float mean;
+		float m2;
+		float min_value;
+		float max_value;
+};
+
+
 class HotWaterController {
 	public:
 		typedef void (*state_change_callback_t)(bool new_state);
 		typedef void (*fault_callback_t)(const char *message);
+		typedef void (*response_callback_t)(long response_ms);
 		
-		HotWaterController(int servo_pin, int ldr_pin,
-		                   int up_position, int down_position, long press_duration,
+		HotWaterController(int servo_pin,
+		                   int up_position, int down_position,
+		                   long move_duration, long press_duration,
 		                   int ldr_low_threshold, int ldr_high_threshold, int ldr_inverted, long ldr_sample_period,
+		                   int ldr_oversample, int ldr_filter_shift, int ldr_filter_snap,
 		                   long rate_limit, int n_changes, long n_change_rate_limit,
-		                   long n_retries,
+		                   int n_retries,
 		                   state_change_callback_t state_changed_callback,
-		                   fault_callback_t fault_callback)
-			: servo(servo_pin, up_position, down_position, press_duration)
-			, ldr(ldr_pin, ldr_low_threshold, ldr_high_threshold, ldr_inverted, ldr_sample_period)
+		                   fault_callback_t fault_callback,
+		                   response_callback_t response_callback)
+			: servo(servo_pin, up_position, down_position, move_duration, press_duration)
+			, ldr(ldr_low_threshold, ldr_high_threshold, ldr_inverted, ldr_sample_period,
+			      ldr_oversample, ldr_filter_shift, ldr_filter_snap)
 			, rate_limit(rate_limit)
 			, n_changes(n_changes)
 			, n_change_rate_limit(n_change_rate_limit)
 			, n_retries(n_retries)
+			, n_retries_remaining(0)
 			, state_changed_callback(state_changed_callback)
 			, fault_callback(fault_callback)
+			, response_callback(response_callback)
+			, press_time(0)
+			, n_failed_presses(0)
 			, state(State::idle)
 			, next_state(false)
 			, set_state_called(false)
+			, n_changes_remaining(n_changes)
+			, last_ldr_state(false)
+			, ldr_state_reported(false)
+			, last_commanded_state(-1)
 		{
 			pinMode(servo_pin, OUTPUT);
 			digitalWrite(servo_pin, LOW);
+		}
+		
+		/**
+		 * Restore any persisted rate limit and fault state. Call once during
+		 * startup.
+		 *
+		 * After a reset the rate limit window is restarted and (if any changes
+		 * were used in the previous window) the rate_limit period is waited
+		 * before any change may be made. This errs on the side of caution since
+		 * the time spent resetting is unknown.
+		 */
+		void begin() {
+			// Mark the persisted copies as unknown (forcing them to be written if
+			// not successfully loaded).
+			rtc_state.fault = eeprom_state.fault = 0xFF;
+			bool rtc_valid = rtc_memory_load(RTC_MEMORY_BOARD_OFFSET, rtc_state);
+			bool eeprom_valid = eeprom_load(eeprom_state);
+			
+			PersistentState restored;
+			if (rtc_valid) {
+				Serial.println("Restored controller state from RTC memory.");
+				restored = rtc_state;
+			} else if (eeprom_valid) {
+				Serial.println("Restored controller state from EEPROM.");
+				restored = eeprom_state;
+			} else {
+				Serial.println("No controller state to restore.");
+				persist();
+				return;
+			}
 			
-			// Force a state change report on startup
-			last_ldr_state = !ldr.get_state();
+			if (restored.n_changes_remaining < n_changes) {
+				n_changes_remaining = restored.n_changes_remaining;
+				state = State::waiting;
+				rate_limit_timeout.reset(rate_limit);
+			}
+			n_change_rate_limit_timeout.reset(n_change_rate_limit);
+			
+			last_commanded_state = restored.last_commanded_state;
+			if (last_commanded_state >= 0) {
+				next_state = last_commanded_state;
+				set_state_called = true;
+			}
+			
+			switch (restored.fault) {
+				case FAULT_RATE_LIMIT_REACHED:
+					state = State::fault_rate_limit_reached;
+					fault_callback("FATAL: Rate limit reached (before reset).");
+					break;
+				
+				case FAULT_BUTTON_PRESS_FAILED:
+					state = State::fault_button_press_failed;
+					fault_callback("FATAL: Button press failed to change boiler state (before reset).");
+					break;
+				
+				default:
+					break;
+			}
+			
+			persist();
 		}
 		
 		/**
@@ -301,7 +597,8 @@ class HotWaterController {
 		 */
 		void loop() {
 			servo.loop();
-			ldr.loop();
+			
+			persist();
 			
 			// Reset n_change rate limit as required
 			if (n_change_rate_limit_timeout.expired()) {
@@ -309,11 +606,18 @@ class HotWaterController {
 				n_change_rate_limit_timeout.reset(n_change_rate_limit);
 			}
 			
-			// Report LDR changes
+			// Until the LDR has been read the boiler's state is unknown so
+			// nothing may be reported or acted on (e.g. a restored command).
+			if (!ldr.is_initialised()) {
+				return;
+			}
+			
+			// Report LDR changes (and the initial state)
 			bool new_ldr_state = ldr.get_state();
 			digitalWrite(LED_BUILTIN, !new_ldr_state);
-			if (new_ldr_state != last_ldr_state) {
+			if (!ldr_state_reported || new_ldr_state != last_ldr_state) {
 				last_ldr_state = new_ldr_state;
+				ldr_state_reported = true;
 				state_changed_callback(new_ldr_state);
 			}
 			
@@ -322,14 +626,16 @@ class HotWaterController {
 				case State::idle:
 					if (set_state_called) {
 						if (next_state != ldr.get_state()) {
-							if (!--n_changes_remaining) {
+							if (n_changes_remaining <= 0) {
 								// State change rate limit hit, stop!
 								state = State::fault_rate_limit_reached;
 								fault_callback("FATAL: Rate limit reached.");
 							} else {
 								// Press the button
+								n_changes_remaining--;
 								state = next_state ? State::pressing_on : State::pressing_off;
 								servo.actuate();
+								press_time = controller_millis();
 								rate_limit_timeout.reset(rate_limit);
 								n_retries_remaining = n_retries;
 							}
@@ -347,12 +653,22 @@ class HotWaterController {
 							// n_retries!
 							if (n_retries_remaining) {
 								n_retries_remaining--;
+								n_failed_presses++;
+								metrics.increment(METRIC_SERVO_RETRIES);
+								lengthen_press();
 								servo.actuate();
+								press_time = controller_millis();
 							} else {
 								state = State::fault_button_press_failed;
 								fault_callback("FATAL: Button press failed to change boiler state.");
 							}
 						} else {
+							// Report time from (the last) press to the state change
+							// being detected.
+							long response_ms = (int32_t)(ldr.get_last_change_time() - press_time);
+							response_stats.add(response_ms);
+							adapt_press();
+							response_callback(response_ms);
 							state = State::waiting;
 						}
 					}
@@ -381,6 +697,52 @@ class HotWaterController {
 		void set_state(bool new_state) {
 			set_state_called = true;
 			next_state = new_state;
+			last_commanded_state = new_state;
+		}
+		
+		/**
+		 * Clear any fault condition (and the n_changes rate limit). Faults
+		 * otherwise persist across resets.
+		 */
+		void clear_fault() {
+			if (state == State::fault_rate_limit_reached ||
+			    state == State::fault_button_press_failed) {
+				state = State::idle;
+			}
+			n_changes_remaining = n_changes;
+			n_change_rate_limit_timeout.reset(n_change_rate_limit);
+		}
+		
+		/**
+		 * Get statistics on the time taken for the boiler to respond to a press.
+		 */
+		const RunningStats &get_response_stats() const {
+			return response_stats;
+		}
+		
+		/**
+		 * Get the current (adapted) press duration.
+		 */
+		long get_press_duration() const {
+			return servo.get_press_duration();
+		}
+		
+		/**
+		 * Get the total number of presses which failed to change the boiler
+		 * state (and were retried).
+		 */
+		long get_n_failed_presses() const {
+			return n_failed_presses;
+		}
+		
+		/**
+		 * Move the servo to a given position, for calibration purposes. Ignored
+		 * if the servo is already moving.
+		 */
+		void move_servo(int position) {
+			if (!servo.move_to(position)) {
+				Serial.println("Servo busy, ignoring move.");
+			}
 		}
 	
 	private:
@@ -393,7 +755,7 @@ class HotWaterController {
 		
 		// The number of changes allowed within n_change_rate_limit milliseconds
 		const int n_changes;
-		const int n_change_rate_limit;
+		const long n_change_rate_limit;
 		
 		// Number of times to re-try pressing the button before giving up
 		const int n_retries;
@@ -401,6 +763,44 @@ class HotWaterController {
 		
 		state_change_callback_t state_changed_callback;
 		fault_callback_t fault_callback;
+		response_callback_t response_callback;
+		
+		// The time (controller_millis()) the servo last started pressing the
+		// button
+		uint32_t press_time;
+		
+		// Statistics of the time from a press starting to the boiler's response
+		// being detected and the number of failed presses.
+		RunningStats response_stats;
+		long n_failed_presses;
+		
+		/**
+		 * Set the press duration based on the measured response times.
+		 */
+		void adapt_press() {
+			if (response_stats.get_n() < SERVO_PRESS_ADAPT_MIN_SAMPLES) {
+				return;
+			}
+			long duration = (long)(response_stats.get_mean() + 2 * response_stats.get_stddev())
+			                - servo.get_move_duration() + SERVO_PRESS_MARGIN;
+			set_press_duration(duration);
+		}
+		
+		/**
+		 * Lengthen the press duration following a failed press.
+		 */
+		void lengthen_press() {
+			set_press_duration(servo.get_press_duration() * 3 / 2);
+		}
+		
+		void set_press_duration(long duration) {
+			if (duration < SERVO_MIN_PRESS_DURATION) {
+				duration = SERVO_MIN_PRESS_DURATION;
+			} else if (duration > SERVO_MAX_PRESS_DURATION) {
+				duration = SERVO_MAX_PRESS_DURATION;
+			}
+			servo.set_press_duration(duration);
+		}
 		
 		enum struct State {
 			// Idle state: waiting for either the LDR to report a change or set_state
@@ -431,22 +831,197 @@ class HotWaterController {
 		// Timer and counter for the n_changes per n_change_rate_limit rate-limit.
 		int n_changes_remaining;
 		
-		// The previously observed LDR state
+		// The previously observed (and reported) LDR state
 		bool last_ldr_state;
+		bool ldr_state_reported;
 		Timeout n_change_rate_limit_timeout;
+		
+		// The most recent state passed to set_state (or -1 if never called).
+		int8_t last_commanded_state;
+		
+		// Fault codes used in PersistentState
+		static const uint8_t FAULT_NONE = 0;
+		static const uint8_t FAULT_RATE_LIMIT_REACHED = 1;
+		static const uint8_t FAULT_BUTTON_PRESS_FAILED = 2;
+		
+		// The state persisted across resets.
+		struct PersistentState {
+			uint8_t fault;
+			int8_t last_commanded_state;
+			int16_t n_changes_remaining;
+			
+			bool operator!=(const PersistentState &other) const {
+				return fault != other.fault ||
+				       last_commanded_state != other.last_commanded_state ||
+				       n_changes_remaining != other.n_changes_remaining;
+			}
+		};
+		
+		// The state most recently persisted in RTC memory and EEPROM.
+		PersistentState rtc_state;
+		PersistentState eeprom_state;
+		
+		PersistentState get_persistent_state() const {
+			PersistentState persistent;
+			if (state == State::fault_rate_limit_reached) {
+				persistent.fault = FAULT_RATE_LIMIT_REACHED;
+			} else if (state == State::fault_button_press_failed) {
+				persistent.fault = FAULT_BUTTON_PRESS_FAILED;
+			} else {
+				persistent.fault = FAULT_NONE;
+			}
+			persistent.last_commanded_state = last_commanded_state;
+			persistent.n_changes_remaining = n_changes_remaining;
+			return persistent;
+		}
+		
+		/**
+		 * Persist the current state wherever it has changed.
+		 */
+		void persist() {
+			PersistentState persistent = get_persistent_state();
+			
+			if (persistent != rtc_state) {
+				rtc_memory_store(RTC_MEMORY_BOARD_OFFSET, persistent);
+				rtc_state = persistent;
+			}
+			
+			if (persistent != eeprom_state) {
+				eeprom_store(persistent);
+				// Using up a change and entering a fault must survive even an
+				// immediate power loss (rather than waiting for storage.loop() to
+				// commit them) or the rate limits could be exceeded after it.
+				if (persistent.n_changes_remaining < eeprom_state.n_changes_remaining ||
+				    (persistent.fault != FAULT_NONE && persistent.fault != eeprom_state.fault)) {
+					WatchdogScope scope(storage_commit_section);
+					storage.flush();
+				}
+				eeprom_state = persistent;
+			}
+		}
+		
+		static bool eeprom_load(PersistentState &persistent) {
+			RTCMemoryRecord<PersistentState> record;
+			storage.get(PERSISTENT_STATE_EEPROM_ADDR, record);
+			if (rtc_crc32(&record.data, sizeof(record.data)) != record.crc) {
+				return false;
+			}
+			
+			// NB: Erased storage (all 0xFF) has a valid CRC so the contents must
+			// be checked too.
+			if (record.data.fault > FAULT_BUTTON_PRESS_FAILED ||
+			    record.data.n_changes_remaining < 0) {
+				return false;
+			}
+			
+			persistent = record.data;
+			return true;
+		}
+		
+		static void eeprom_store(const PersistentState &persistent) {
+			RTCMemoryRecord<PersistentState> record;
+			record.data = persistent;
+			record.crc = rtc_crc32(&record.data, sizeof(record.data));
+			// NB: Committed to flash by storage.loop() shortly afterwards
+			storage.put(PERSISTENT_STATE_EEPROM_ADDR, record);
+		}
 };
 
 
 ////////////////////////////////////////////////////////////////////////////////
 
-Qth::Property *hot_water_state;
-Qth::Property *hot_water_actual_state;
-Qth::Property *hot_water_fault;
-Qth::Event *move_servo;
+void on_hot_water_state_set(const char *topic, const char *json);
+void on_move_servo_called(const char *topic, const char *json);
+void on_clear_fault_called(const char *topic, const char *json);
+
+Qth::Property hot_water_state(
+	QTH_PREFIX,
+	on_hot_water_state_set,
+	"Set boiler hot water production state.",
+	false, // false == N:1
+	NULL // Don't delete on unregister
+);
+
+Qth::Property hot_water_actual_state(
+	QTH_PREFIX"/actual-state",
+	NULL,
+	"Actual hot water production state.",
+	true, // true == 1:N
+	NULL // Don't delete on unregister
+);
 
-HotWaterController *controller;
+Qth::Property hot_water_fault(
+	QTH_PREFIX"/fault",
+	NULL,
+	"What fault has occurred?",
+	true, // true == 1:N
+	NULL // Don't delete on unregister
+);
+
+Qth::Property hot_water_response_time(
+	QTH_PREFIX"/response-time",
+	NULL,
+	"Time (ms) from the servo starting to press the button to the boiler state change being detected.",
+	true, // true == 1:N
+	NULL // Don't delete on unregister
+);
+
+Qth::Property hot_water_press_stats(
+	QTH_PREFIX"/press-stats",
+	NULL,
+	"Statistics on boiler response times, the current (adapted) button press duration and failed presses since reset.",
+	true, // true == 1:N
+	NULL // Don't delete on unregister
+);
+
+Qth::Event move_servo(
+	QTH_PREFIX"/move-servo",
+	on_move_servo_called,
+	"For calibration purposes.",
+	false // false == N:1
+);
+
+Qth::Event clear_fault(
+	QTH_PREFIX"/clear-fault",
+	on_clear_fault_called,
+	"Clear a fault condition (faults otherwise persist across resets).",
+	false // false == N:1
+);
+
+const QthPropertyEntry properties[] PROGMEM = {
+	// property, watch, initial value
+	{&hot_water_state, true, NULL},
+	{&hot_water_actual_state, false, NULL},
+	{&hot_water_fault, false, "null"},
+	{&hot_water_response_time, false, NULL},
+	{&hot_water_press_stats, false, NULL},
+};
+
+const QthEventEntry events[] PROGMEM = {
+	// event, watch
+	{&move_servo, true},
+	{&clear_fault, true},
+};
+
+void on_hot_water_state_changed(bool new_state);
+void on_hot_water_fault(const char *message);
+void on_hot_water_response(long response_ms);
+
+HotWaterController controller(
+	SERVO_PIN,
+	SERVO_RELEASED_ANGLE, SERVO_PRESSED_ANGLE,
+	SERVO_MOVE_DURATION, SERVO_PRESS_DURATION,
+	LDR_LOW_WATER, LDR_HIGH_WATER, LDR_INVERTED, LDR_SAMPLE_PERIOD,
+	LDR_OVERSAMPLE, LDR_FILTER_SHIFT, LDR_FILTER_SNAP,
+	RATE_LIMIT, N_CHANGES, N_CHANGE_RATE_LIMIT,
+	N_RETRIES,
+	on_hot_water_state_changed,
+	on_hot_water_fault,
+	on_hot_water_response);
 
 void on_hot_water_state_set(const char *topic, const char *json) {
+	metrics.increment(METRIC_PROPERTY_SETS);
+	
 	// Skip whitespace
 	while (*json == ' ') {
 		json++;
@@ -472,12 +1047,12 @@ void on_hot_water_state_set(const char *topic, const char *json) {
 	
 	Serial.print("State change requested: ");
 	Serial.println(new_state);
-	controller->set_state(new_state);
+	controller.set_state(new_state);
 }
 
 void on_hot_water_state_changed(bool new_state) {
-	qth.setProperty(hot_water_state, new_state ? "true" : "false");
-	qth.setProperty(hot_water_actual_state, new_state ? "true" : "false");
+	qth.setProperty(&hot_water_state, new_state ? "true" : "false");
+	qth.setProperty(&hot_water_actual_state, new_state ? "true" : "false");
 	Serial.print("LED state changed: ");
 	Serial.println(new_state);
 }
@@ -489,20 +1064,39 @@ void on_hot_water_fault(const char *message) {
 	message_quoted[strlen(message)+2] = '\0';
 	memcpy(message_quoted + 1, message, strlen(message));
 	
-	qth.setProperty(hot_water_fault, message_quoted);
+	qth.setProperty(&hot_water_fault, message_quoted);
+}
+
+void on_hot_water_response(long response_ms) {
+	char buf[20];
+	snprintf(buf, sizeof(buf), "%ld", response_ms);
+	qth.setProperty(&hot_water_response_time, buf);
+	Serial.print("Boiler responded after (ms): ");
+	Serial.println(response_ms);
+	
+	const RunningStats &stats = controller.get_response_stats();
+	char stats_buf[160];
+	snprintf(stats_buf, sizeof(stats_buf),
+	         "{\"n\":%ld,\"mean_ms\":%.0f,\"stddev_ms\":%.0f,\"min_ms\":%.0f,\"max_ms\":%.0f,"
+	         "\"press_ms\":%ld,\"failed_presses\":%ld}",
+	         stats.get_n(), stats.get_mean(), stats.get_stddev(),
+	         stats.get_min(), stats.get_max(),
+	         controller.get_press_duration(),
+	         controller.get_n_failed_presses());
+	qth.setProperty(&hot_water_press_stats, stats_buf);
 }
 
 void on_move_servo_called(const char *topic, const char *json) {
-	Servo servo;
-	servo.attach(SERVO_PIN, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
-	servo.write(atoi(json));
-	Serial.print("Moving servo to ");
-	Serial.println(atoi(json));
 	Serial.print("LDR = ");
-	Serial.println(analogRead(LDR_PIN));
-	delay(500);
-	servo.detach();
-	digitalWrite(SERVO_PIN, LOW);
+	Serial.println(adc_service.get_last_value());
+	controller.move_servo(atoi(json));
+}
+
+
+void on_clear_fault_called(const char *topic, const char *json) {
+	Serial.println("Clearing fault.");
+	controller.clear_fault();
+	qth.setProperty(&hot_water_fault, "null");
 }
 
 
@@ -514,64 +1108,22 @@ void setup() {
 		Servo s;
 		s.attach(SERVO_PIN, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
 		s.write(SERVO_RELEASED_ANGLE);
-		delay(SERVO_PRESS_DURATION);
+		delay(SERVO_MOVE_DURATION);
 		s.detach();
 	}
 	pinMode(LED_BUILTIN, OUTPUT); // LED on ESP-12 board
 	
 	setup_common();
 	
-	hot_water_state = new Qth::Property(
-		QTH_PREFIX,
-		on_hot_water_state_set,
-		"Set boiler hot water production state.",
-		false, // false == N:1
-		NULL // Don't delete on unregister
-	);
+	qth_register(qth, properties);
+	qth_register(qth, events);
 	
-	hot_water_actual_state = new Qth::Property(
-		QTH_PREFIX"/actual-state",
-		NULL,
-		"Actual hot water production state.",
-		true, // true == 1:N
-		NULL // Don't delete on unregister
-	);
-	
-	hot_water_fault = new Qth::Property(
-		QTH_PREFIX"/fault",
-		NULL,
-		"What fault has occurred?",
-		true, // true == 1:N
-		NULL // Don't delete on unregister
-	);
-	
-	move_servo = new Qth::Event(
-		QTH_PREFIX"/move-servo",
-		on_move_servo_called,
-		"For calibration purposes.",
-		false // false == N:1
-	);
-	
-	qth.registerProperty(hot_water_state);
-	qth.registerProperty(hot_water_actual_state);
-	qth.registerProperty(hot_water_fault);
-	qth.registerEvent(move_servo);
-	
-	qth.watchProperty(hot_water_state);
-	qth.watchEvent(move_servo);
-	qth.setProperty(hot_water_fault, "null");
-	
-	controller = new HotWaterController(
-		SERVO_PIN, LDR_PIN,
-		SERVO_RELEASED_ANGLE, SERVO_PRESSED_ANGLE, SERVO_PRESS_DURATION,
-		LDR_LOW_WATER, LDR_HIGH_WATER, LDR_INVERTED, LDR_SAMPLE_PERIOD,
-		RATE_LIMIT, N_CHANGES, N_CHANGE_RATE_LIMIT,
-		N_RETRIES,
-		on_hot_water_state_changed,
-		on_hot_water_fault);
+	controller.begin();
 }
 
 void loop() {
 	loop_common();
-	controller->loop();
+	
+	WatchdogScope scope(controller_loop_section);
+	controller.loop();
 }
@@ -0,0 +1,196 @@
+/**
+ * Shared scheduler for the ESP8266's single ADC.
+ *
+ * Frequent analogRead calls interfere with WiFi so all users of the ADC
+ * register with the service (with their desired sample period) rather than
+ * calling analogRead directly. The service performs at most one conversion per
+ * call to loop() and never more than one every ADC_MIN_CONVERSION_INTERVAL_US,
+ * giving each conversion to the consumer which has been waiting longest.
+ */
+
+#ifndef ADC_SERVICE_H
+#define ADC_SERVICE_H
+
+#include <Arduino.h>
+
+// Maximum number of registered consumers
+#ifndef ADC_MAX_CONSUMERS
+	#define ADC_MAX_CONSUMERS 4
+#endif
+
+// Minimum interval (us) between conversions across all consumers (the global
+// ADC rate budget).
+#ifndef ADC_MIN_CONVERSION_INTERVAL_US
+	#define ADC_MIN_CONVERSION_INTERVAL_US 2000
+#endif
+
+// A conversion taking longer than this (us) is counted as a stall (i.e. the
+// ADC was held up by the WiFi stack).
+#ifndef ADC_STALL_THRESHOLD_US
+	#define ADC_STALL_THRESHOLD_US 500
+#endif
+
+class AdcService {
+	public:
+		typedef void (*callback_t)(int value, void *data);
+		typedef void (*tap_t)(int consumer, int value, void *data);
+		
+		AdcService(int pin)
+			: pin(pin)
+			, num_consumers(0)
+			, tap(NULL)
+			, tap_data(NULL)
+			, last_conversion_us(0)
+			, last_value(0)
+			, num_conversions(0)
+			, num_stalls(0)
+			, num_late(0)
+		{
+		}
+		
+		/**
+		 * Register a consumer which will be called with a new ADC value (roughly)
+		 * every period_ms. Returns false if too many consumers are registered.
+		 */
+		bool add_consumer(unsigned long period_ms, callback_t callback, void *data = NULL) {
+			if (num_consumers >= ADC_MAX_CONSUMERS) {
+				return false;
+			}
+			Consumer &consumer = consumers[num_consumers++];
+			consumer.period_ms = period_ms;
+			consumer.next_due = millis();
+			consumer.callback = callback;
+			consumer.data = data;
+			return true;
+		}
+		
+		/**
+		 * Set a function to be called with every conversion (before the
+		 * consumer's callback) along with the index of the consumer it is for
+		 * (in registration order). Used to capture sensor traces.
+		 */
+		void set_tap(tap_t tap, void *data = NULL) {
+			this->tap = tap;
+			tap_data = data;
+		}
+		
+		/**
+		 * Call regularly. Performs at most one conversion.
+		 */
+		void loop() {
+			if (micros() - last_conversion_us < ADC_MIN_CONVERSION_INTERVAL_US) {
+				return;
+			}
+			
+			// Find the consumer which has been due the longest
+			unsigned long now = millis();
+			Consumer *next = NULL;
+			long next_overdue = 0;
+			for (int i = 0; i < num_consumers; i++) {
+				long overdue = (long)(now - consumers[i].next_due);
+				if (overdue >= 0 && (!next || overdue > next_overdue)) {
+					next = consumers + i;
+					next_overdue = overdue;
+				}
+			}
+			if (!next) {
+				return;
+			}
+			
+			unsigned long start_us = micros();
+			last_value = analogRead(pin);
+			last_conversion_us = micros();
+			
+			num_conversions++;
+			if (last_conversion_us - start_us > ADC_STALL_THRESHOLD_US) {
+				num_stalls++;
+			}
+			
+			// If the consumer has fallen more than a whole period behind, don't try
+			// to catch up.
+			if ((unsigned long)next_overdue >= next->period_ms) {
+				num_late++;
+				next->next_due = now + next->period_ms;
+			} else {
+				next->next_due += next->period_ms;
+			}
+			
+			if (tap) {
+				tap(next - consumers, last_value, tap_data);
+			}
+			next->callback(last_value, next->data);
+		}
+		
+		/**
+		 * Time (ms) until the next conversion is due (0 if one is due now). Other
+		 * work which may block (e.g. sending bulk data) can be deferred until
+		 * there is a gap between conversions.
+		 */
+		unsigned long get_time_until_due() const {
+			unsigned long now = millis();
+			unsigned long soonest = (unsigned long)-1;
+			for (int i = 0; i < num_consumers; i++) {
+				long remaining = (long)(consumers[i].next_due - now);
+				if (remaining <= 0) {
+					return 0;
+				}
+				if ((unsigned long)remaining < soonest) {
+					soonest = remaining;
+				}
+			}
+			return soonest;
+		}
+		
+		/**
+		 * The most recent value read by any consumer.
+		 */
+		int get_last_value() const {
+			return last_value;
+		}
+		
+		/**
+		 * Total number of conversions performed.
+		 */
+		unsigned long get_num_conversions() const {
+			return num_conversions;
+		}
+		
+		/**
+		 * Number of conversions which took longer than ADC_STALL_THRESHOLD_US.
+		 */
+		unsigned long get_num_stalls() const {
+			return num_stalls;
+		}
+		
+		/**
+		 * Number of conversions which were a whole period (or more) late.
+		 */
+		unsigned long get_num_late() const {
+			return num_late;
+		}
+	
+	private:
+		struct Consumer {
+			unsigned long period_ms;
+			unsigned long next_due;
+			callback_t callback;
+			void *data;
+		};
+		
+		const int pin;
+		
+		Consumer consumers[ADC_MAX_CONSUMERS];
+		int num_consumers;
+		
+		tap_t tap;
+		void *tap_data;
+		
+		unsigned long last_conversion_us;
+		int last_value;
+		
+		unsigned long num_conversions;
+		unsigned long num_stalls;
+		unsigned long num_late;
+};
+
+#endif
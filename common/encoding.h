@@ -0,0 +1,52 @@
+/**
+ * Compact encodings used when sending binary data over Qth.
+ */
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <Arduino.h>
+
+/**
+ * Encode value as LEB128 into buf, returning the number of bytes used (at
+ * most 10).
+ */
+inline size_t leb128_encode(uint64_t value, uint8_t *buf) {
+	size_t length = 0;
+	do {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		buf[length++] = byte | (value ? 0x80 : 0x00);
+	} while (value);
+	return length;
+}
+
+/**
+ * Map a signed value to an unsigned one such that values of small magnitude
+ * remain small (0, -1, 1, -2, ... become 0, 1, 2, 3, ...) ready for LEB128
+ * encoding.
+ */
+inline uint32_t zigzag_encode(int32_t value) {
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/**
+ * Base64 encode length bytes from data into out (which must have space for
+ * ((length + 2) / 3) * 4 + 1 bytes), null terminating the result.
+ */
+inline void base64_encode(const uint8_t *data, size_t length, char *out) {
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	for (size_t i = 0; i < length; i += 3) {
+		uint32_t word = data[i] << 16;
+		if (i + 1 < length) word |= data[i + 1] << 8;
+		if (i + 2 < length) word |= data[i + 2];
+		*out++ = alphabet[(word >> 18) & 0x3F];
+		*out++ = alphabet[(word >> 12) & 0x3F];
+		*out++ = (i + 1 < length) ? alphabet[(word >> 6) & 0x3F] : '=';
+		*out++ = (i + 2 < length) ? alphabet[word & 0x3F] : '=';
+	}
+	*out = '\0';
+}
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * A registry of event counters common to all boards.
+ *
+ * Counters are plain integers indexed by a Metric and so are cheap enough to
+ * increment from any hot path. Counters are never reset (except by a reset of
+ * the board) and wrap around on overflow: rates should be computed downstream
+ * from the difference between successive snapshots. The snapshot includes the
+ * uptime which can be used to detect resets.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+
+// Buffer size sufficient for Metrics::to_json with every counter at its
+// maximum (about 390 characters)
+#define METRICS_JSON_LENGTH 400
+
+enum Metric {
+	// Qth events sent (whilst connected)
+	METRIC_EVENTS_SENT,
+	
+	// Qth events which were lost because the client was not connected
+	METRIC_EVENTS_DROPPED,
+	
+	// Watched properties set by another client
+	METRIC_PROPERTY_SETS,
+	
+	// Connections (including the first) made to the Qth server
+	METRIC_RECONNECTS,
+	
+	// Malformed JSON values received
+	METRIC_JSON_ERRORS,
+	
+	// Unknown 433 MHz codes reported
+	METRIC_UNKNOWN_CODES,
+	
+	// Utility meter pulses detected
+	METRIC_PULSES,
+	
+	// Servo button presses which had to be retried
+	METRIC_SERVO_RETRIES,
+	
+	// Storage images committed to flash
+	METRIC_STORAGE_COMMITS,
+	
+	// Attempts to commit the storage image to flash which failed
+	METRIC_STORAGE_FAILURES,
+	
+	// Total time (ms) spent stalled erasing and writing flash during commits
+	METRIC_STORAGE_STALL_MS,
+	
+	// ADC conversions performed by the ADC service
+	METRIC_ADC_CONVERSIONS,
+	
+	// ADC conversions which took longer than ADC_STALL_THRESHOLD_US
+	METRIC_ADC_STALLS,
+	
+	// ADC conversions which were a whole consumer period (or more) late
+	METRIC_ADC_LATE,
+	
+	NUM_METRICS,
+};
+
+class Metrics {
+	public:
+		Metrics() {
+			for (int i = 0; i < NUM_METRICS; i++) {
+				counters[i] = 0;
+			}
+		}
+		
+		void increment(Metric metric, uint32_t n = 1) {
+			counters[metric] += n;
+		}
+		
+		uint32_t get(Metric metric) const {
+			return counters[metric];
+		}
+		
+		/**
+		 * Produce a JSON object {"uptime": seconds, "<metric>": n, ...}
+		 * snapshotting all counters. Returns false if the buffer is too small.
+		 */
+		bool to_json(char *buf, size_t len) const {
+			static const char *const names[NUM_METRICS] = {
+				"events_sent",
+				"events_dropped",
+				"property_sets",
+				"reconnects",
+				"json_errors",
+				"unknown_codes",
+				"pulses",
+				"servo_retries",
+				"storage_commits",
+				"storage_failures",
+				"storage_stall_ms",
+				"adc_conversions",
+				"adc_stalls",
+				"adc_late",
+			};
+			
+			size_t used = snprintf(buf, len, "{\"uptime\":%lu", millis() / 1000ul);
+			for (int i = 0; i < NUM_METRICS && used < len; i++) {
+				used += snprintf(buf + used, len - used, ",\"%s\":%lu",
+				                 names[i], (unsigned long)counters[i]);
+			}
+			if (used < len) {
+				used += snprintf(buf + used, len - used, "}");
+			}
+			return used < len;
+		}
+	
+	private:
+		uint32_t counters[NUM_METRICS];
+};
+
+#endif
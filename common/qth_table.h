@@ -0,0 +1,86 @@
+/**
+ * Static registration tables for a board's fixed Qth interface.
+ *
+ * Boards declare their Qth::Property and Qth::Event objects as globals (rather
+ * than allocating them with new) and list them in a table, e.g.
+ *
+ *     Qth::Property foo("foo/bar", "A property.", true);
+ *     Qth::Event baz("foo/baz", on_baz, "An event.", false);
+ *
+ *     const QthPropertyEntry properties[] PROGMEM = {
+ *         // property, watch, initial value
+ *         {&foo, false, "null"},
+ *     };
+ *     const QthEventEntry events[] PROGMEM = {
+ *         // event, watch
+ *         {&baz, true},
+ *     };
+ *
+ *     void setup() {
+ *         ...
+ *         qth_register(qth, properties);
+ *         qth_register(qth, events);
+ *     }
+ *
+ * The tables themselves live in flash. NB: The path and description strings
+ * must remain in RAM since the Qth library holds on to (and reads from) the
+ * pointers given to it.
+ */
+
+#ifndef QTH_TABLE_H
+#define QTH_TABLE_H
+
+#include <Arduino.h>
+#include <Qth.h>
+
+struct QthPropertyEntry {
+	Qth::Property *property;
+	
+	// Should the property be watched (i.e. does it have a callback)?
+	bool watch;
+	
+	// Value to set the property to once registered (or NULL to leave it)
+	const char *initial_value;
+};
+
+struct QthEventEntry {
+	Qth::Event *event;
+	
+	// Should the event be watched (i.e. does it have a callback)?
+	bool watch;
+};
+
+/**
+ * Register (and watch and set initial values for) all properties in a table.
+ */
+template <size_t N>
+void qth_register(Qth::QthClient &qth, const QthPropertyEntry (&entries)[N]) {
+	for (size_t i = 0; i < N; i++) {
+		QthPropertyEntry entry;
+		memcpy_P(&entry, entries + i, sizeof(entry));
+		qth.registerProperty(entry.property);
+		if (entry.watch) {
+			qth.watchProperty(entry.property);
+		}
+		if (entry.initial_value) {
+			qth.setProperty(entry.property, entry.initial_value);
+		}
+	}
+}
+
+/**
+ * Register (and watch) all events in a table.
+ */
+template <size_t N>
+void qth_register(Qth::QthClient &qth, const QthEventEntry (&entries)[N]) {
+	for (size_t i = 0; i < N; i++) {
+		QthEventEntry entry;
+		memcpy_P(&entry, entries + i, sizeof(entry));
+		qth.registerEvent(entry.event);
+		if (entry.watch) {
+			qth.watchEvent(entry.event);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * Helpers for keeping small amounts of state in the ESP8266's RTC user memory.
+ *
+ * RTC memory survives resets (including watchdog resets) but not power loss.
+ * It can be written as often as required without wearing anything out, making
+ * it suitable for fast-changing state which should survive a reset.
+ *
+ * Each record is stored alongside a CRC so that the uninitialised contents of
+ * RTC memory after a power-on are not mistaken for valid data.
+ */
+
+#ifndef RTC_MEMORY_H
+#define RTC_MEMORY_H
+
+#include <Arduino.h>
+
+// Offsets (in 4-byte blocks) of the records kept in RTC user memory. The first
+// 32 blocks (128 bytes) are used by the OTA bootloader and must not be used.
+#define RTC_MEMORY_BOARD_OFFSET 32
+
+// Records used by the common watchdog (see watchdog.h) at the end of RTC
+// memory. Board records must not extend beyond this point.
+#define RTC_MEMORY_WATCHDOG_OFFSET 112
+#define RTC_MEMORY_WATCHDOG_REPORT_OFFSET (RTC_MEMORY_WATCHDOG_OFFSET + 2)
+
+/**
+ * Standard CRC-32 (as used by zlib). NB: Named to avoid clashing with the
+ * crc32 provided by the ESP8266 core.
+ */
+inline uint32_t rtc_crc32(const void *data, size_t length, uint32_t crc = 0) {
+	const uint8_t *bytes = (const uint8_t *)data;
+	crc = ~crc;
+	while (length--) {
+		crc ^= *bytes++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1u));
+		}
+	}
+	return ~crc;
+}
+
+template <typename T>
+struct RTCMemoryRecord {
+	T data;
+	uint32_t crc;
+};
+
+/**
+ * Load a record previously stored with rtc_memory_store from the given offset
+ * (in 4-byte blocks). Returns false (leaving data unchanged) if no valid record
+ * is present.
+ */
+template <typename T>
+bool rtc_memory_load(uint32_t offset, T &data) {
+	RTCMemoryRecord<T> record;
+	static_assert(sizeof(record) % 4 == 0, "RTC memory records must be a multiple of 4 bytes.");
+	
+	if (!ESP.rtcUserMemoryRead(offset, (uint32_t *)&record, sizeof(record))) {
+		return false;
+	}
+	if (rtc_crc32(&record.data, sizeof(record.data)) != record.crc) {
+		return false;
+	}
+	
+	data = record.data;
+	return true;
+}
+
+/**
+ * Store a record in RTC memory at the given offset (in 4-byte blocks).
+ */
+template <typename T>
+bool rtc_memory_store(uint32_t offset, const T &data) {
+	RTCMemoryRecord<T> record;
+	static_assert(sizeof(record) % 4 == 0, "RTC memory records must be a multiple of 4 bytes.");
+	
+	record.data = data;
+	record.crc = rtc_crc32(&record.data, sizeof(record.data));
+	return ESP.rtcUserMemoryWrite(offset, (uint32_t *)&record, sizeof(record));
+}
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * An estimate of the Qth server's clock, used to give events timestamps which
+ * remain meaningful however late the events are delivered.
+ *
+ * The server's time (seconds since the UNIX epoch) is periodically sent as the
+ * sys/time event (see time_source.py). Each sample gives a lower bound on the
+ * offset between the server's clock and millis() since the event took some
+ * (unknown, but non-negative) time to arrive. The estimate is therefore the
+ * maximum offset seen over the last SERVER_CLOCK_WINDOW samples, i.e. the
+ * sample with the least delivery delay. The window is kept short so that the
+ * estimate follows any drift of the local oscillator.
+ */
+
+#ifndef SERVER_CLOCK_H
+#define SERVER_CLOCK_H
+
+#include <Arduino.h>
+
+// Number of samples the estimate is the maximum of
+#ifndef SERVER_CLOCK_WINDOW
+	#define SERVER_CLOCK_WINDOW 8
+#endif
+
+// Space required for a timestamp formatted by ServerClock::format (the largest
+// unsigned long number of seconds, '.', three digits and the terminator)
+#define SERVER_CLOCK_FORMAT_LENGTH 26
+
+class ServerClock {
+	public:
+		ServerClock()
+			: num_samples(0)
+			, next_sample(0)
+			, offset(0)
+		{
+		}
+		
+		/**
+		 * Record a timestamp (ms since the UNIX epoch) just received from the
+		 * server.
+		 */
+		void add_sample(uint64_t server_ms) {
+			offsets[next_sample] = (int64_t)(server_ms - local_ms());
+			next_sample = (next_sample + 1) % SERVER_CLOCK_WINDOW;
+			if (num_samples < SERVER_CLOCK_WINDOW) {
+				num_samples++;
+			}
+			
+			offset = offsets[0];
+			for (int i = 1; i < num_samples; i++) {
+				if (offsets[i] > offset) {
+					offset = offsets[i];
+				}
+			}
+		}
+		
+		/**
+		 * Has at least one sample been received?
+		 */
+		bool is_synced() const {
+			return num_samples > 0;
+		}
+		
+		/**
+		 * Convert a (recent) value of millis() into server time (ms since the
+		 * UNIX epoch). Returns 0 if not yet synced.
+		 */
+		uint64_t to_server_time(unsigned long local) const {
+			if (!is_synced()) {
+				return 0;
+			}
+			return (uint64_t)(local_ms() + offset) - (unsigned long)(millis() - local);
+		}
+		
+		/**
+		 * The current server time (ms since the UNIX epoch), or 0 if not yet
+		 * synced.
+		 */
+		uint64_t now() const {
+			return to_server_time(millis());
+		}
+		
+		/**
+		 * Format the server time corresponding to a value of millis() as a JSON
+		 * number of seconds since the UNIX epoch (with ms precision), or null
+		 * if not yet synced. The buffer must be at least
+		 * SERVER_CLOCK_FORMAT_LENGTH bytes.
+		 */
+		void format(unsigned long local, char *buf) const {
+			uint64_t server_ms = to_server_time(local);
+			if (server_ms) {
+				snprintf(buf, SERVER_CLOCK_FORMAT_LENGTH, "%lu.%03u",
+				         (unsigned long)(server_ms / 1000ull),
+				         (unsigned)(server_ms % 1000ull));
+			} else {
+				strcpy(buf, "null");
+			}
+		}
+	
+	private:
+		/**
+		 * A local millisecond clock which does not wrap.
+		 */
+		static uint64_t local_ms() {
+			return micros64() / 1000ull;
+		}
+		
+		int64_t offsets[SERVER_CLOCK_WINDOW];
+		int num_samples;
+		int next_sample;
+		
+		// Current estimate of (server time - local_ms())
+		int64_t offset;
+};
+
+#endif
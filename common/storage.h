@@ -0,0 +1,223 @@
+/**
+ * Persistent storage in flash (replacing the Arduino EEPROM library).
+ *
+ * Like the EEPROM library, the storage is a RAM image which is written back to
+ * flash when committed. Unlike the EEPROM library, writes only mark the image
+ * dirty: it is committed by loop() once no further writes have occurred for
+ * STORAGE_QUIET_PERIOD (or STORAGE_MAX_DELAY after the first unsaved write,
+ * whichever is sooner). This coalesces bursts of writes (e.g. a series of
+ * config updates) into a single sector erase. Call flush() before any
+ * deliberate reset to avoid losing unsaved writes.
+ *
+ * The image is rotated across STORAGE_SECTORS flash sectors. Each sector holds
+ * a header (with a sequence number and CRC) followed by the image; the valid
+ * sector with the highest sequence number is loaded at startup. A commit only
+ * erases the sector after the current one, so with two or more sectors a
+ * power loss part way through a commit leaves the previous image intact (with
+ * one, the only copy is erased first) and further sectors spread the wear. The
+ * first sector is the one reserved for the EEPROM library, any others are
+ * taken from immediately below it, i.e. from the end of the filesystem region,
+ * and so boards which use the filesystem must set STORAGE_SECTORS to 1.
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <Arduino.h>
+
+#include "rtc_memory.h"
+#include "metrics.h"
+
+extern "C" uint32_t _EEPROM_start;
+
+extern Metrics metrics;
+
+// Number of flash sectors to rotate the image across
+#ifndef STORAGE_SECTORS
+	#define STORAGE_SECTORS 2
+#endif
+
+// Time (ms) without writes before a commit is made
+#ifndef STORAGE_QUIET_PERIOD
+	#define STORAGE_QUIET_PERIOD 2000
+#endif
+
+// Maximum time (ms) a write may remain uncommitted
+#ifndef STORAGE_MAX_DELAY
+	#define STORAGE_MAX_DELAY (60 * 1000)
+#endif
+
+// Size of the header at the start of each sector
+#define STORAGE_HEADER_SIZE 16
+
+// Usable size of the storage (bytes)
+#define STORAGE_SIZE (SPI_FLASH_SEC_SIZE - STORAGE_HEADER_SIZE)
+
+// Marks a valid sector header
+#define STORAGE_MAGIC 0x53544F52u
+
+class Storage {
+	public:
+		Storage()
+			: dirty(false)
+			, current_sector(0)
+			, sequence(0)
+		{
+		}
+		
+		/**
+		 * Load the most recently committed image from flash.
+		 */
+		void begin() {
+			bool found = false;
+			for (int i = 0; i < STORAGE_SECTORS; i++) {
+				Header header;
+				ESP.flashRead(get_address(i), (uint32_t *)&header, sizeof(header));
+				if (header.magic != STORAGE_MAGIC ||
+				    (found && (int32_t)(header.sequence - sequence) <= 0)) {
+					continue;
+				}
+				ESP.flashRead(get_address(i) + STORAGE_HEADER_SIZE,
+				              (uint32_t *)image, sizeof(image_words));
+				if (rtc_crc32(image, sizeof(image_words)) == header.crc) {
+					found = true;
+					current_sector = i;
+					sequence = header.sequence;
+				}
+			}
+			
+			if (found) {
+				ESP.flashRead(get_address(current_sector) + STORAGE_HEADER_SIZE,
+				              (uint32_t *)image, sizeof(image_words));
+			} else {
+				Serial.println("No valid storage image found, starting empty.");
+				memset(image, 0xFF, sizeof(image_words));
+			}
+		}
+		
+		size_t size() const {
+			return STORAGE_SIZE;
+		}
+		
+		/**
+		 * Read-only access to the storage image.
+		 */
+		const uint8_t *get_data() const {
+			return image;
+		}
+		
+		/**
+		 * Get a pointer to the part of the image at [addr, addr+length) for
+		 * modification, marking it dirty.
+		 */
+		uint8_t *modify(size_t addr, size_t length) {
+			mark_dirty();
+			return image + addr;
+		}
+		
+		template <typename T>
+		void get(size_t addr, T &value) const {
+			memcpy(&value, image + addr, sizeof(T));
+		}
+		
+		/**
+		 * Write a value into the image (only marking the image dirty if the
+		 * value changed).
+		 */
+		template <typename T>
+		void put(size_t addr, const T &value) {
+			if (memcmp(image + addr, &value, sizeof(T)) != 0) {
+				memcpy(modify(addr, sizeof(T)), &value, sizeof(T));
+			}
+		}
+		
+		/**
+		 * Commit the image if it has been quiet for long enough. Call regularly.
+		 */
+		void loop() {
+			unsigned long now = millis();
+			if (dirty && (now - last_write >= STORAGE_QUIET_PERIOD ||
+			              now - first_write >= STORAGE_MAX_DELAY)) {
+				flush();
+			}
+		}
+		
+		/**
+		 * Commit any unsaved changes immediately. Returns false if the commit
+		 * failed (in which case it is retried by loop() after
+		 * STORAGE_QUIET_PERIOD).
+		 */
+		bool flush() {
+			if (!dirty) {
+				return true;
+			}
+			
+			unsigned long start = millis();
+			
+			Header header;
+			header.magic = STORAGE_MAGIC;
+			header.sequence = sequence + 1;
+			header.crc = rtc_crc32(image, sizeof(image_words));
+			header.reserved = 0;
+			
+			int sector = (current_sector + 1) % STORAGE_SECTORS;
+			uint32_t address = get_address(sector);
+			bool ok = ESP.flashEraseSector(address / SPI_FLASH_SEC_SIZE) &&
+			          ESP.flashWrite(address + STORAGE_HEADER_SIZE,
+			                         (uint32_t *)image, sizeof(image_words)) &&
+			          ESP.flashWrite(address, (uint32_t *)&header, sizeof(header));
+			if (ok) {
+				current_sector = sector;
+				sequence = header.sequence;
+				dirty = false;
+				metrics.increment(METRIC_STORAGE_COMMITS);
+			} else {
+				Serial.println("Failed to commit storage to flash.");
+				metrics.increment(METRIC_STORAGE_FAILURES);
+				// NB: Retry after a quiet period rather than on every loop
+				first_write = last_write = millis();
+			}
+			
+			metrics.increment(METRIC_STORAGE_STALL_MS, millis() - start);
+			return ok;
+		}
+	
+	private:
+		struct Header {
+			uint32_t magic;
+			uint32_t sequence;
+			uint32_t crc;
+			uint32_t reserved;
+		};
+		static_assert(sizeof(Header) == STORAGE_HEADER_SIZE, "Storage header size mismatch.");
+		
+		/**
+		 * Flash address of the nth sector.
+		 */
+		static uint32_t get_address(int sector) {
+			uint32_t eeprom_address = (uint32_t)(uintptr_t)&_EEPROM_start - 0x40200000u;
+			return eeprom_address - (sector * SPI_FLASH_SEC_SIZE);
+		}
+		
+		void mark_dirty() {
+			unsigned long now = millis();
+			if (!dirty) {
+				first_write = now;
+			}
+			last_write = now;
+			dirty = true;
+		}
+		
+		// NB: Must be 4-byte aligned for flashRead/flashWrite
+		uint32_t image_words[STORAGE_SIZE / 4];
+		uint8_t * const image = (uint8_t *)image_words;
+		
+		bool dirty;
+		unsigned long first_write;
+		unsigned long last_write;
+		
+		int current_sector;
+		uint32_t sequence;
+};
+
+#endif
@@ -0,0 +1,33 @@
+"""
+Periodically send the current time as the sys/time event, from which boards
+estimate the server's clock (see server_clock.h). Run this on (or next to)
+the Qth server; for testing, any host with a reasonable clock will do.
+
+Usage:
+
+    python time_source.py [period_seconds]
+"""
+
+import sys
+import time
+import asyncio
+
+import qth
+
+# Must match SERVER_TIME_PATH in common.inc
+SERVER_TIME_PATH = "sys/time"
+
+
+async def send_time(period):
+    client = qth.Client("time-source", "Sends the server's time.")
+    await client.register(
+        SERVER_TIME_PATH, qth.EVENT_ONE_TO_MANY,
+        "The server's time in seconds since the UNIX epoch, sent periodically.")
+    while True:
+        await client.send_event(SERVER_TIME_PATH, round(time.time(), 3))
+        await asyncio.sleep(period)
+
+
+if __name__ == "__main__":
+    period = float(sys.argv[1]) if len(sys.argv) > 1 else 60.0
+    asyncio.get_event_loop().run_until_complete(send_time(period))
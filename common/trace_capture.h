@@ -0,0 +1,207 @@
+/**
+ * Captures timestamped sensor samples and sends them over Qth for offline
+ * analysis (e.g. for tuning detectors against real data).
+ *
+ * Whilst a capture is running, every sample passed to add() is appended to a
+ * chunk buffer as two LEB128 values:
+ *
+ *     (delta_ms << TRACE_CHANNEL_BITS) | channel
+ *     zigzag(value - previous value on the same channel)
+ *
+ * Times and values are relative to the chunk's start_ms and zero respectively
+ * at the start of each chunk so that every chunk can be decoded on its own.
+ * Full chunks are sent as events of the form {"seq": n, "start_ms": board
+ * millis(), "dropped": samples, "more": bool, "data": base64}. Two chunk buffers
+ * are used so that sampling continues whilst a full chunk waits to be sent;
+ * samples arriving when both are full are counted in "dropped".
+ *
+ * See trace_capture.py for a host-side client which requests and decodes
+ * captures.
+ */
+
+#ifndef TRACE_CAPTURE_H
+#define TRACE_CAPTURE_H
+
+#include <Arduino.h>
+
+#include "encoding.h"
+
+// Number of bits used for the channel number. ADC consumers use their
+// registration order as their channel number (0-3), other inputs (e.g.
+// digital) should use TRACE_CHANNEL_DIGITAL onward.
+#define TRACE_CHANNEL_BITS 3
+#define TRACE_NUM_CHANNELS (1 << TRACE_CHANNEL_BITS)
+#define TRACE_CHANNEL_ADC 0
+#define TRACE_CHANNEL_DIGITAL 4
+
+// Size (bytes, before base64 encoding) of each chunk
+#ifndef TRACE_CHUNK_SIZE
+	#define TRACE_CHUNK_SIZE 256
+#endif
+
+// Size of the buffer required for a chunk's JSON
+#define TRACE_JSON_LENGTH (100 + ((TRACE_CHUNK_SIZE + 2) / 3) * 4)
+
+// Longest capture permitted (ms)
+#ifndef TRACE_MAX_DURATION
+	#define TRACE_MAX_DURATION (10ul * 60ul * 1000ul)
+#endif
+
+class TraceCapture {
+	public:
+		TraceCapture()
+			: active(false)
+			, filling(0)
+			, next_seq(0)
+			, dropped(0)
+		{
+			chunks[0].pending = false;
+			chunks[1].pending = false;
+		}
+		
+		/**
+		 * Start a new capture lasting duration_ms (any capture in progress is
+		 * abandoned).
+		 */
+		void start(unsigned long duration_ms) {
+			if (duration_ms > TRACE_MAX_DURATION) {
+				duration_ms = TRACE_MAX_DURATION;
+			}
+			active = true;
+			start_ms = millis();
+			this->duration_ms = duration_ms;
+			filling = 0;
+			next_seq = 0;
+			dropped = 0;
+			chunks[0].pending = false;
+			chunks[1].pending = false;
+			begin_chunk(chunks[0], start_ms);
+		}
+		
+		/**
+		 * End the capture (the final chunk is sent with "more": false).
+		 */
+		void stop() {
+			if (active) {
+				active = false;
+				chunks[filling].pending = true;
+				chunks[filling].more = false;
+			}
+		}
+		
+		bool is_active() const {
+			return active;
+		}
+		
+		/**
+		 * Record a sample (does nothing unless a capture is running).
+		 */
+		void add(uint8_t channel, int value) {
+			if (!active) {
+				return;
+			}
+			channel &= TRACE_NUM_CHANNELS - 1;
+			
+			unsigned long now = millis();
+			Chunk *chunk = &chunks[filling];
+			
+			uint8_t record[10 + 5];
+			size_t length = encode(*chunk, now, channel, value, record);
+			if (chunk->length + length > TRACE_CHUNK_SIZE) {
+				// Chunk full: start filling the other one (unless it hasn't been
+				// sent yet)
+				Chunk *other = &chunks[filling ^ 1];
+				if (other->pending) {
+					dropped++;
+					return;
+				}
+				chunk->pending = true;
+				filling ^= 1;
+				chunk = other;
+				begin_chunk(*chunk, now);
+				length = encode(*chunk, now, channel, value, record);
+			}
+			
+			memcpy(chunk->data + chunk->length, record, length);
+			chunk->length += length;
+			chunk->last_ms = now;
+			chunk->last_values[channel] = value;
+		}
+		
+		/**
+		 * Call regularly. If a chunk is waiting to be sent, writes its JSON into
+		 * buf (of at least TRACE_JSON_LENGTH bytes) and returns true.
+		 */
+		bool loop(char *buf) {
+			if (active && millis() - start_ms >= duration_ms) {
+				stop();
+			}
+			
+			// Send the oldest pending chunk first
+			for (int i = 1; i >= 0; i--) {
+				Chunk &chunk = chunks[filling ^ i];
+				if (chunk.pending) {
+					chunk_to_json(chunk, buf);
+					chunk.pending = false;
+					return true;
+				}
+			}
+			return false;
+		}
+	
+	private:
+		struct Chunk {
+			uint8_t data[TRACE_CHUNK_SIZE];
+			size_t length;
+			uint32_t seq;
+			unsigned long start_ms;
+			unsigned long last_ms;
+			int last_values[TRACE_NUM_CHANNELS];
+			bool more;
+			bool pending;
+		};
+		
+		void begin_chunk(Chunk &chunk, unsigned long now) {
+			chunk.length = 0;
+			chunk.seq = next_seq++;
+			chunk.start_ms = now;
+			chunk.last_ms = now;
+			for (int i = 0; i < TRACE_NUM_CHANNELS; i++) {
+				chunk.last_values[i] = 0;
+			}
+			chunk.more = true;
+		}
+		
+		static size_t encode(const Chunk &chunk, unsigned long now,
+		                     uint8_t channel, int value, uint8_t *record) {
+			size_t length = 0;
+			length += leb128_encode(
+				((uint64_t)(now - chunk.last_ms) << TRACE_CHANNEL_BITS) | channel,
+				record + length);
+			length += leb128_encode(zigzag_encode(value - chunk.last_values[channel]),
+			                        record + length);
+			return length;
+		}
+		
+		void chunk_to_json(const Chunk &chunk, char *buf) const {
+			size_t header_length = snprintf(
+				buf, TRACE_JSON_LENGTH,
+				"{\"seq\":%lu,\"start_ms\":%lu,\"dropped\":%lu,\"more\":%s,\"data\":\"",
+				(unsigned long)chunk.seq, chunk.start_ms, dropped,
+				chunk.more ? "true" : "false");
+			base64_encode(chunk.data, chunk.length, buf + header_length);
+			strcat(buf, "\"}");
+		}
+		
+		bool active;
+		unsigned long start_ms;
+		unsigned long duration_ms;
+		
+		Chunk chunks[2];
+		int filling;
+		
+		uint32_t next_seq;
+		unsigned long dropped;
+};
+
+#endif
@@ -0,0 +1,88 @@
+"""
+Capture a sensor trace from a board (see trace_capture.h) and print the
+samples as CSV (time_ms, channel, value) with times relative to the start of
+the capture.
+
+Usage:
+
+    python trace_capture.py nodemcu_utilities_board 60 > trace.csv
+"""
+
+import sys
+import json
+import base64
+import asyncio
+
+import qth
+
+# Must match TRACE_CHANNEL_BITS in trace_capture.h
+TRACE_CHANNEL_BITS = 3
+
+
+def decode_leb128(data, offset):
+    """Decode a LEB128 value, returning (value, new_offset)."""
+    value = 0
+    shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+def decode_zigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode_chunk(chunk):
+    """
+    Decode a trace/data event, generating (time_ms, channel, value) tuples
+    with times in board millis().
+    """
+    data = base64.b64decode(chunk["data"])
+    time_ms = chunk["start_ms"]
+    last_values = {}
+    offset = 0
+    while offset < len(data):
+        header, offset = decode_leb128(data, offset)
+        delta, offset = decode_leb128(data, offset)
+        time_ms += header >> TRACE_CHANNEL_BITS
+        channel = header & ((1 << TRACE_CHANNEL_BITS) - 1)
+        value = last_values.get(channel, 0) + decode_zigzag(delta)
+        last_values[channel] = value
+        yield (time_ms, channel, value)
+
+
+async def capture(client_id, seconds):
+    client = qth.Client("trace-capture", "Sensor trace capture.")
+    done = asyncio.Event()
+    state = {"start_ms": None, "next_seq": 0}
+
+    def on_data(topic, chunk):
+        if chunk["seq"] != state["next_seq"]:
+            print("Missing chunks {} to {}".format(state["next_seq"], chunk["seq"] - 1),
+                  file=sys.stderr)
+        state["next_seq"] = chunk["seq"] + 1
+        if state["start_ms"] is None:
+            state["start_ms"] = chunk["start_ms"]
+
+        for time_ms, channel, value in decode_chunk(chunk):
+            print("{},{},{}".format(time_ms - state["start_ms"], channel, value))
+
+        if not chunk["more"]:
+            if chunk["dropped"]:
+                print("{} samples dropped".format(chunk["dropped"]), file=sys.stderr)
+            done.set()
+
+    await client.watch_event("sys/{}/trace/data".format(client_id), on_data)
+    await client.send_event("sys/{}/trace/capture".format(client_id), seconds)
+    await done.wait()
+    await client.close()
+
+
+if __name__ == "__main__":
+    client_id, seconds = sys.argv[1], float(sys.argv[2])
+    print("time_ms,channel,value")
+    asyncio.get_event_loop().run_until_complete(capture(client_id, seconds))
@@ -0,0 +1,240 @@
+/**
+ * A software watchdog which records post-mortem evidence when a section of
+ * code takes longer than its budget (or never finishes because the board
+ * reset).
+ *
+ * Sections are declared as globals and entered for the duration of a scope:
+ *
+ *     WatchdogSection parse_section("parse", 500);
+ *
+ *     void parse() {
+ *         WatchdogScope scope(parse_section);
+ *         ...
+ *     }
+ *
+ * On entry, a breadcrumb naming the section is written to RTC memory. If the
+ * board resets before the section exits (e.g. due to the hardware watchdog or
+ * an exception), the breadcrumb is found by Watchdog::begin() after the reset
+ * and turned into a report. If the section exits but overran its budget a
+ * report is produced immediately. Reports are kept in RTC memory until they can
+ * be published.
+ *
+ * The cost on the normal path is a couple of calls to millis() and two small
+ * RTC memory writes per section.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <Arduino.h>
+
+#include "rtc_memory.h"
+
+// Maximum number of WatchdogSections which may be declared
+#ifndef WATCHDOG_MAX_SECTIONS
+	#define WATCHDOG_MAX_SECTIONS 8
+#endif
+
+// Maximum length of a section name (longer names are truncated in reports)
+#define WATCHDOG_NAME_LENGTH 16
+
+class WatchdogSection;
+
+class Watchdog {
+	public:
+		Watchdog()
+			: num_sections(0)
+			, report_pending(false)
+			, active_id(WATCHDOG_NO_SECTION)
+		{
+		}
+		
+		/**
+		 * Check for a report left in RTC memory (or a section which was active
+		 * when the board reset). Call once at startup.
+		 */
+		void begin();
+		
+		/**
+		 * Is there a report waiting to be published?
+		 */
+		bool has_report() const {
+			return report_pending;
+		}
+		
+		/**
+		 * Produce a JSON object describing the pending report:
+		 * {"section": name, "duration_ms": ms or null if the board reset,
+		 *  "budget_ms": ms, "free_heap": bytes, "reset_reason": n}.
+		 */
+		void report_to_json(char *buf, size_t len) const;
+		
+		/**
+		 * Call immediately before a deliberate reset (e.g. ESP.restart()) so
+		 * that the sections executing at the time are not reported as having
+		 * never finished.
+		 */
+		void before_restart() {
+			set_active(WATCHDOG_NO_SECTION);
+		}
+		
+		/**
+		 * Discard the pending report (e.g. once published).
+		 */
+		void clear_report() {
+			report_pending = false;
+			rtc_memory_store(RTC_MEMORY_WATCHDOG_REPORT_OFFSET, Report());
+		}
+	
+	private:
+		friend class WatchdogSection;
+		friend class WatchdogScope;
+		
+		static const uint8_t WATCHDOG_NO_SECTION = 0xFF;
+		
+		// Marks a valid breadcrumb (in the upper bits of Breadcrumb.id)
+		static const uint32_t BREADCRUMB_MAGIC = 0x5AFE0000u;
+		
+		// Written to RTC memory on entry to (and exit from) a section.
+		struct Breadcrumb {
+			uint32_t id;
+			uint32_t free_heap;
+		};
+		
+		struct Report {
+			char section[WATCHDOG_NAME_LENGTH];
+			uint32_t duration_ms; // 0xFFFFFFFF if the board reset
+			uint32_t budget_ms;
+			uint32_t free_heap;
+			uint32_t reset_reason;
+			
+			Report() {
+				memset(this, 0, sizeof(*this));
+			}
+		};
+		
+		uint8_t add_section(WatchdogSection *section) {
+			if (num_sections >= WATCHDOG_MAX_SECTIONS) {
+				return WATCHDOG_NO_SECTION;
+			}
+			sections[num_sections] = section;
+			return num_sections++;
+		}
+		
+		void set_active(uint8_t id) {
+			active_id = id;
+			Breadcrumb breadcrumb;
+			breadcrumb.id = id == WATCHDOG_NO_SECTION ? 0 : BREADCRUMB_MAGIC | id;
+			breadcrumb.free_heap = ESP.getFreeHeap();
+			ESP.rtcUserMemoryWrite(RTC_MEMORY_WATCHDOG_OFFSET,
+			                       (uint32_t *)&breadcrumb, sizeof(breadcrumb));
+		}
+		
+		void add_report(uint8_t id, uint32_t duration_ms, uint32_t free_heap);
+		
+		WatchdogSection *sections[WATCHDOG_MAX_SECTIONS];
+		uint8_t num_sections;
+		
+		Report report;
+		bool report_pending;
+		
+		// The innermost section currently executing
+		uint8_t active_id;
+};
+
+extern Watchdog watchdog;
+
+/**
+ * A named section of code with a time budget (ms). Must be declared as a
+ * global (so sections are numbered consistently across resets).
+ */
+class WatchdogSection {
+	public:
+		WatchdogSection(const char *name, unsigned long budget_ms)
+			: name(name)
+			, budget_ms(budget_ms)
+			, id(watchdog.add_section(this))
+		{
+		}
+		
+		const char * const name;
+		const unsigned long budget_ms;
+		const uint8_t id;
+};
+
+/**
+ * Marks the section as executing for the lifetime of the scope.
+ */
+class WatchdogScope {
+	public:
+		WatchdogScope(const WatchdogSection &section)
+			: section(section)
+			, outer_id(watchdog.active_id)
+			, start(millis())
+		{
+			watchdog.set_active(section.id);
+		}
+		
+		~WatchdogScope() {
+			unsigned long duration = millis() - start;
+			if (duration > section.budget_ms) {
+				watchdog.add_report(section.id, duration, ESP.getFreeHeap());
+			}
+			watchdog.set_active(outer_id);
+		}
+	
+	private:
+		const WatchdogSection &section;
+		const uint8_t outer_id;
+		const unsigned long start;
+};
+
+
+inline void Watchdog::begin() {
+	if (rtc_memory_load(RTC_MEMORY_WATCHDOG_REPORT_OFFSET, report)) {
+		report_pending = report.section[0] != '\0';
+	}
+	
+	Breadcrumb breadcrumb;
+	ESP.rtcUserMemoryRead(RTC_MEMORY_WATCHDOG_OFFSET,
+	                      (uint32_t *)&breadcrumb, sizeof(breadcrumb));
+	if ((breadcrumb.id & 0xFFFF0000u) == BREADCRUMB_MAGIC) {
+		add_report(breadcrumb.id & 0xFFu, 0xFFFFFFFFu, breadcrumb.free_heap);
+	}
+	set_active(WATCHDOG_NO_SECTION);
+}
+
+inline void Watchdog::add_report(uint8_t id, uint32_t duration_ms, uint32_t free_heap) {
+	// Keep the first report until it has been published (in nested sections
+	// the inner section's report is the most informative).
+	if (report_pending || id >= num_sections) {
+		return;
+	}
+	
+	report = Report();
+	strncpy(report.section, sections[id]->name, sizeof(report.section) - 1);
+	report.duration_ms = duration_ms;
+	report.budget_ms = sections[id]->budget_ms;
+	report.free_heap = free_heap;
+	report.reset_reason = ESP.getResetInfoPtr()->reason;
+	report_pending = true;
+	rtc_memory_store(RTC_MEMORY_WATCHDOG_REPORT_OFFSET, report);
+}
+
+inline void Watchdog::report_to_json(char *buf, size_t len) const {
+	char duration[12];
+	if (report.duration_ms == 0xFFFFFFFFu) {
+		strcpy(duration, "null");
+	} else {
+		snprintf(duration, sizeof(duration), "%lu", (unsigned long)report.duration_ms);
+	}
+	snprintf(buf, len,
+	         "{\"section\":\"%s\",\"duration_ms\":%s,\"budget_ms\":%lu,"
+	         "\"free_heap\":%lu,\"reset_reason\":%lu}",
+	         report.section, duration,
+	         (unsigned long)report.budget_ms,
+	         (unsigned long)report.free_heap,
+	         (unsigned long)report.reset_reason);
+}
+
+#endif
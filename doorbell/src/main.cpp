@@ -2,48 +2,477 @@
 #include <ESP8266WiFi.h>
 #include <Qth.h>
 
+#include "rtc_memory.h"
+
 #define QTH_PREFIX "hall/doorbell"
 
 const char *qth_client_id = "nodemcu_doorbell";
 const char *qth_client_description = "Doorbell monitor";
 #include "common.inc"
 
-const int input_pin = A0;
+// NB: The doorbell is read via the ADC service (i.e. from A0)
 const float voltage_divider = 38.0 / (38.0 + 64.0);
 
 const int adc_max = 1023;
 const int adc_pressed_threshold = 50;
 
+// Interval (ms) between ADC samples.
+const unsigned long adc_sample_period = 10;
+
+void on_adc_sample(int adc, void *data);
+
+// Number of recent presses whose battery voltage is used to fit the discharge
+// trend, and the minimum number required before making a forecast.
+const int battery_history_length = 32;
+const int battery_history_min_presses = 8;
+
+// Battery voltage (under load) considered to be depleted
+const float battery_depleted_voltage = 4.4;
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Streaming estimator for a single quantile using the P-squared algorithm (Jain
+ * and Chlamtac, 1985). Uses a fixed, small amount of memory regardless of the
+ * number of samples. Also tracks the (exact) minimum and maximum.
+ *
+ * Since P-squared is inaccurate for short sequences, the first N_EXACT samples
+ * are kept (in sorted order) and the exact quantile is given until these run
+ * out. The P-squared markers are then initialised from these samples.
+ */
+class P2Quantile {
+	public:
+		P2Quantile(float quantile)
+			: quantile(quantile)
+		{
+			reset();
+		}
+		
+		/**
+		 * Discard all samples.
+		 */
+		void reset() {
+			count = 0;
+		}
+		
+		/**
+		 * Add a new sample.
+		 */
+		void add(int x) {
+			if (count < N_EXACT) {
+				add_exact(x);
+			} else {
+				add_p2(x);
+			}
+		}
+		
+		/**
+		 * Get the number of samples added since the last reset.
+		 */
+		long get_count() const {
+			return count;
+		}
+		
+		/**
+		 * Get the estimated quantile. Must have at least one sample.
+		 */
+		float get_quantile() const {
+			if (count <= N_EXACT) {
+				return samples[(int)(quantile * (count - 1) + 0.5f)];
+			} else {
+				return heights[2];
+			}
+		}
+		
+		float get_min() const {
+			return count <= N_EXACT ? samples[0] : heights[0];
+		}
+		
+		float get_max() const {
+			return count <= N_EXACT ? samples[count - 1] : heights[4];
+		}
+	
+	private:
+		// Number of samples to keep for exact computation before switching to
+		// the P-squared estimate.
+		static const int N_EXACT = 32;
+		
+		// The quantile to estimate (0.0 - 1.0)
+		const float quantile;
+		
+		// Number of samples seen
+		long count;
+		
+		// The first N_EXACT samples, in sorted order
+		int16_t samples[N_EXACT];
+		
+		// The P-squared marker heights, actual positions and desired positions.
+		float heights[5];
+		long positions[5];
+		float desired[5];
+		
+		void add_exact(int x) {
+			int i = count++;
+			while (i > 0 && samples[i - 1] > x) {
+				samples[i] = samples[i - 1];
+				i--;
+			}
+			samples[i] = x;
+		}
+		
+		void add_p2(int x) {
+			if (count == N_EXACT) {
+				// Initialise the markers from the exact samples
+				const float quantiles[5] = {0, quantile / 2, quantile, (1 + quantile) / 2, 1};
+				for (int i = 0; i < 5; i++) {
+					desired[i] = quantiles[i] * (N_EXACT - 1);
+					positions[i] = (long)(desired[i] + 0.5f);
+					heights[i] = samples[positions[i]];
+				}
+			}
+			count++;
+			
+			// Find the cell containing the new sample, extending the extremes if
+			// necessary
+			int k;
+			if (x < heights[0]) {
+				heights[0] = x;
+				k = 0;
+			} else if (x >= heights[4]) {
+				heights[4] = x;
+				k = 3;
+			} else {
+				k = 0;
+				while (x >= heights[k + 1]) {
+					k++;
+				}
+			}
+			
+			for (int i = k + 1; i < 5; i++) {
+				positions[i]++;
+			}
+			desired[1] += quantile / 2;
+			desired[2] += quantile;
+			desired[3] += (1 + quantile) / 2;
+			desired[4] += 1;
+			
+			// Adjust the heights of the middle markers if they're off their
+			// desired positions
+			for (int i = 1; i < 4; i++) {
+				float d = desired[i] - positions[i];
+				if ((d >= 1 && positions[i + 1] - positions[i] > 1) ||
+				    (d <= -1 && positions[i - 1] - positions[i] < -1)) {
+					int sign = d >= 0 ? 1 : -1;
+					float height = parabolic(i, sign);
+					if (heights[i - 1] < height && height < heights[i + 1]) {
+						heights[i] = height;
+					} else {
+						heights[i] = linear(i, sign);
+					}
+					positions[i] += sign;
+				}
+			}
+		}
+		
+		float parabolic(int i, int d) const {
+			float n_prev = positions[i - 1];
+			float n = positions[i];
+			float n_next = positions[i + 1];
+			return heights[i] + (d / (n_next - n_prev)) * (
+				(n - n_prev + d) * (heights[i + 1] - heights[i]) / (n_next - n) +
+				(n_next - n - d) * (heights[i] - heights[i - 1]) / (n - n_prev));
+		}
+		
+		float linear(int i, int d) const {
+			return heights[i] + d * (heights[i + d] - heights[i]) / (positions[i + d] - positions[i]);
+		}
+};
+
+/**
+ * Keeps a history of the battery voltage (as a median ADC value) during recent
+ * presses and fits a linear discharge trend to it to forecast the number of
+ * presses until the battery is depleted.
+ *
+ * The history is kept in RTC memory so that it survives resets. The least
+ * squares fit is maintained incrementally using running sums which are updated
+ * as each press is added to (and the oldest removed from) the history.
+ */
+class BatteryHistory {
+	public:
+		BatteryHistory()
+		{
+			history.num_presses = 0;
+			recompute_sums();
+		}
+		
+		/**
+		 * Restore the history from RTC memory. Call once during startup.
+		 */
+		void begin() {
+			if (rtc_memory_load(RTC_MEMORY_BOARD_OFFSET, history)) {
+				Serial.print("Restored battery history of ");
+				Serial.print(history.num_presses);
+				Serial.println(" presses.");
+			} else {
+				history.num_presses = 0;
+			}
+			recompute_sums();
+		}
+		
+		/**
+		 * Record the median ADC value during a press.
+		 */
+		void add(float adc_median) {
+			uint32_t x = history.num_presses;
+			int64_t y = (int64_t)(adc_median * Y_SCALE + 0.5f);
+			uint16_t &slot = history.adc_medians[x % battery_history_length];
+			
+			// Remove the oldest press from the fit
+			if (x >= (uint32_t)battery_history_length) {
+				int64_t old_x = x - battery_history_length;
+				int64_t old_y = slot;
+				n--;
+				sum_x -= old_x;
+				sum_y -= old_y;
+				sum_xx -= old_x * old_x;
+				sum_xy -= old_x * old_y;
+			}
+			
+			slot = y;
+			n++;
+			sum_x += x;
+			sum_y += y;
+			sum_xx += (int64_t)x * x;
+			sum_xy += (int64_t)x * y;
+			
+			history.num_presses++;
+			rtc_memory_store(RTC_MEMORY_BOARD_OFFSET, history);
+		}
+		
+		/**
+		 * Estimate the number of presses remaining until the fitted battery ADC
+		 * value reaches depleted_adc. Returns a negative value if no estimate is
+		 * possible (e.g. too little history or the voltage is not falling).
+		 */
+		float presses_until(float depleted_adc) const {
+			if (n < battery_history_min_presses) {
+				return -1;
+			}
+			
+			// NB: Exact integer arithmetic used for the sums to avoid
+			// cancellation.
+			int64_t denominator = n * sum_xx - sum_x * sum_x;
+			int64_t numerator = n * sum_xy - sum_x * sum_y;
+			if (denominator == 0 || numerator >= 0) {
+				return -1;
+			}
+			float slope = (float)numerator / (float)denominator;
+			
+			// Fitted value at the most recent press
+			float x_mean = (float)sum_x / n;
+			float y_mean = (float)sum_y / n;
+			float y_now = y_mean + slope * ((history.num_presses - 1) - x_mean);
+			
+			float presses = (depleted_adc * Y_SCALE - y_now) / slope;
+			return presses > 0 ? presses : 0;
+		}
+	
+	private:
+		// ADC values are stored with this scale factor to retain some of the
+		// median's precision.
+		static const int Y_SCALE = 16;
+		
+		struct History {
+			// Total number of presses recorded (used as the x coordinate)
+			uint32_t num_presses;
+			
+			// Ring buffer of scaled median ADC values, indexed by press number
+			// modulo battery_history_length.
+			uint16_t adc_medians[battery_history_length];
+		} history;
+		
+		// Running sums for the least squares fit
+		int64_t n;
+		int64_t sum_x;
+		int64_t sum_y;
+		int64_t sum_xx;
+		int64_t sum_xy;
+		
+		void recompute_sums() {
+			n = sum_x = sum_y = sum_xx = sum_xy = 0;
+			uint32_t first = history.num_presses > (uint32_t)battery_history_length
+				? history.num_presses - battery_history_length : 0;
+			for (uint32_t x = first; x < history.num_presses; x++) {
+				int64_t y = history.adc_medians[x % battery_history_length];
+				n++;
+				sum_x += x;
+				sum_y += y;
+				sum_xx += (int64_t)x * x;
+				sum_xy += (int64_t)x * y;
+			}
+		}
+};
+
+BatteryHistory battery_history;
+
+
+/**
+ * Histogram of doorbell event latencies (from the ADC sample where the
+ * threshold crossing was observed to the completion of the MQTT write) with
+ * power-of-two millisecond buckets.
+ */
+class LatencyHistogram {
+	public:
+		// Number of buckets. Bucket i counts latencies below 2^i ms (and above
+		// the previous bucket), the final bucket counts everything else.
+		static const int NUM_BUCKETS = 10;
+		
+		// Buffer size sufficient for to_json with every counter at its maximum
+		// (about 210 characters).
+		static const size_t JSON_LENGTH = 256;
+		
+		LatencyHistogram()
+			: max_us(0)
+			, last_us(0)
+		{
+			for (int i = 0; i < NUM_BUCKETS; i++) {
+				counts[i] = 0;
+			}
+		}
+		
+		void add(uint32_t latency_us) {
+			int bucket = 0;
+			while (bucket < NUM_BUCKETS - 1 && latency_us >= (1000ul << bucket)) {
+				bucket++;
+			}
+			counts[bucket]++;
+			
+			last_us = latency_us;
+			if (latency_us > max_us) {
+				max_us = latency_us;
+			}
+		}
+		
+		/**
+		 * Format the histogram as JSON into buf. Returns false if the buffer is
+		 * too small.
+		 */
+		bool to_json(char *buf, size_t buf_length) const {
+			size_t length = snprintf(buf, buf_length, "{\"le_ms\":[");
+			for (int i = 0; i < NUM_BUCKETS && length < buf_length; i++) {
+				if (i < NUM_BUCKETS - 1) {
+					length += snprintf(buf + length, buf_length - length, "%d,", 1 << i);
+				} else {
+					length += snprintf(buf + length, buf_length - length, "null],\"counts\":[");
+				}
+			}
+			for (int i = 0; i < NUM_BUCKETS && length < buf_length; i++) {
+				length += snprintf(buf + length, buf_length - length, i ? ",%lu" : "%lu",
+				                   (unsigned long)counts[i]);
+			}
+			if (length < buf_length) {
+				length += snprintf(buf + length, buf_length - length,
+				                   "],\"last_us\":%lu,\"max_us\":%lu}",
+				                   (unsigned long)last_us, (unsigned long)max_us);
+			}
+			return length < buf_length;
+		}
+	
+	private:
+		uint32_t counts[NUM_BUCKETS];
+		uint32_t max_us;
+		uint32_t last_us;
+};
+
+LatencyHistogram event_latency;
+
 ////////////////////////////////////////////////////////////////////////////////
 
-Qth::Property *voltage_property;
-Qth::Event *doorbell_event;
+Qth::Property voltage_property(
+	QTH_PREFIX "/battery_voltage",
+	"Voltage of doorbell battery pack whilst shorted across solenoid.",
+	true // true == 1:N
+);
+
+Qth::Property presses_remaining_property(
+	QTH_PREFIX "/battery_presses_remaining",
+	"Forecast number of presses until the battery is depleted (based on its discharge trend), or null if unknown.",
+	true // true == 1:N
+);
+
+Qth::Property latency_property(
+	QTH_PREFIX "/event_latency",
+	"Histogram of latency from doorbell press/release being sampled to the event being sent.",
+	true // true == 1:N
+);
+
+Qth::Event doorbell_event(
+	QTH_PREFIX,
+	"Fired when doorbell pressed (True) or released (False)",
+	true // true == 1:N
+);
+
+const QthPropertyEntry properties[] PROGMEM = {
+	// property, watch, initial value
+	{&voltage_property, false, "null"},
+	{&presses_remaining_property, false, NULL},
+	{&latency_property, false, NULL},
+};
+
+const QthEventEntry events[] PROGMEM = {
+	// event, watch
+	{&doorbell_event, false},
+};
+
+// The doorbell event is always sent immediately. All other (lower priority)
+// publications are deferred until they can be sent without delaying it (see
+// loop_low_priority).
+bool voltage_pending = false;
+bool battery_forecast_pending = false;
+bool latency_pending = false;
+float pending_voltage;
+
+/**
+ * Publish the current forecast of presses until the battery is depleted.
+ */
+void publish_battery_forecast() {
+	float depleted_adc = (battery_depleted_voltage * voltage_divider / 3.3) * adc_max;
+	float presses = battery_history.presses_until(depleted_adc);
+	if (presses < 0) {
+		qth.setProperty(&presses_remaining_property, "null");
+	} else {
+		char buf[20];
+		snprintf(buf, sizeof(buf), "%ld", (long)presses);
+		qth.setProperty(&presses_remaining_property, buf);
+	}
+}
 
 void setup() {
 	setup_common();
 	
-	voltage_property = new Qth::Property(
-		QTH_PREFIX "/battery_voltage",
-		"Voltage of doorbell battery pack whilst shorted across solenoid.",
-		true // true == 1:N
-	);
-	qth.registerProperty(voltage_property);
-	qth.setProperty(voltage_property, "null");
+	qth_register(qth, properties);
+	qth_register(qth, events);
+	
+	battery_history.begin();
+	publish_battery_forecast();
 	
-	doorbell_event = new Qth::Event(
-		QTH_PREFIX,
-		"Fired when doorbell pressed (True) or released (False)",
-		true // true == 1:N
-	);
-	qth.registerEvent(doorbell_event);
+	adc_service.add_consumer(adc_sample_period, on_adc_sample);
 }
 
-void slow_loop() {  // analogRead calls must be rate limited!
-	static int pressed_adc_histogram[adc_max + 1];
-	static int pressed_adc_histogram_count;
+// Was the doorbell pressed when last sampled?
+bool doorbell_pressed = false;
+
+// Was the doorbell sampled during this loop iteration?
+bool doorbell_sampled = false;
+
+void on_adc_sample(int adc, void *data) {
+	unsigned long sample_us = micros();
+	doorbell_sampled = true;
+	
+	// Estimate of the median ADC value while pressed
+	static P2Quantile pressed_adc_median(0.5);
 	
 	static int last_adc = 0;
-	int adc = analogRead(input_pin);
 	
 	bool last_pressed = last_adc >= adc_pressed_threshold;
 	bool pressed = adc >= adc_pressed_threshold;
@@ -51,51 +480,81 @@ void slow_loop() {  // analogRead calls must be rate limited!
 	bool newly_released = !pressed && last_pressed;
 	
 	last_adc = adc;
+	doorbell_pressed = pressed;
 	
-	// Update ADC value histogram while pressed
+	// Update ADC value median estimate while pressed
 	if (newly_pressed) {
-		for (int i = 0; i < adc_max + 1; i++) {
-			pressed_adc_histogram[i] = 0;
-		}
-		pressed_adc_histogram_count = 0;
+		pressed_adc_median.reset();
 	}
 	if (pressed) {
-		pressed_adc_histogram[adc <= adc_max ? adc : adc_max] += 1;
-		pressed_adc_histogram_count ++;
+		pressed_adc_median.add(adc <= adc_max ? adc : adc_max);
 	}
 	
-	// Send events/set properties
+	// Send events first, everything else is deferred
 	if (newly_pressed) {
+		qth_send_event(&doorbell_event, "true");
+		event_latency.add(micros() - sample_us);
+		latency_pending = true;
 		Serial.println("Doorbell pressed...");
-		qth.sendEvent(doorbell_event, "true");
 	}
 	if (newly_released) {
+		qth_send_event(&doorbell_event, "false");
+		event_latency.add(micros() - sample_us);
+		latency_pending = true;
 		Serial.println("Doorbell released...");
-		qth.sendEvent(doorbell_event, "false");
 		
-		// Find median ADC value from histogram
-		int adc_median = 0;
-		int cum_sum = 0;
-		while (cum_sum < pressed_adc_histogram_count / 2) {
-			cum_sum += pressed_adc_histogram[adc_median++];
-		}
+		float adc_median = pressed_adc_median.get_quantile();
 		Serial.print("adc_median = "); Serial.println(adc_median);
+		Serial.print("adc_min = "); Serial.println(pressed_adc_median.get_min());
+		Serial.print("adc_max = "); Serial.println(pressed_adc_median.get_max());
 		
-		float voltage = (adc_median / (float)adc_max) * 3.3 / voltage_divider;
+		float voltage = (adc_median / adc_max) * 3.3 / voltage_divider;
 		Serial.print("voltage = "); Serial.println(voltage);
 		
-		String voltage_str = String(voltage);
-		qth.setProperty(voltage_property, voltage_str.c_str());
+		pending_voltage = voltage;
+		voltage_pending = true;
+		
+		battery_history.add(adc_median);
+		battery_forecast_pending = true;
+	}
+}
+
+/**
+ * Send at most one deferred low-priority publication. Nothing is sent while
+ * the doorbell is pressed.
+ */
+void loop_low_priority(bool pressed) {
+	if (pressed) {
+		return;
+	}
+	
+	if (voltage_pending) {
+		String voltage_str = String(pending_voltage);
+		qth.setProperty(&voltage_property, voltage_str.c_str());
+		voltage_pending = false;
+	} else if (battery_forecast_pending) {
+		publish_battery_forecast();
+		battery_forecast_pending = false;
+	} else if (latency_pending) {
+		char buf[LatencyHistogram::JSON_LENGTH];
+		if (event_latency.to_json(buf, sizeof(buf))) {
+			qth.setProperty(&latency_property, buf);
+		} else {
+			Serial.println("Latency histogram too long to publish.");
+		}
+		latency_pending = false;
 	}
 }
 
 void loop() {
+	// NB: The ADC service samples the doorbell before qth.loop() so that a
+	// sample which is due is not delayed behind any other traffic.
+	doorbell_sampled = false;
 	loop_common();
 	
-	static unsigned long last_slow_loop = 0;
-	unsigned long now = millis();
-	if (now - last_slow_loop > 10) {
-		slow_loop();
-		last_slow_loop = now;
+	// Don't send low-priority traffic in the same iteration as a sample in case
+	// the sample produced an event.
+	if (!doorbell_sampled) {
+		loop_low_priority(doorbell_pressed);
 	}
 }
@@ -1,5 +1,4 @@
 #include <Arduino.h>
-#include <EEPROM.h>
 #include <jsmn.h>
 #include <ESP8266WiFi.h>
 #include <Qth.h>
@@ -14,11 +13,26 @@ const char *qth_client_description = "Qth proxy for 433 MHz radio devices.";
 const int rx_pin = D1;
 const int tx_pin = D2;
 
-Qth::EEPROMProperty *rx_codes_prop;
 Qth::Event rx_unknown_code_event(QTH_PATH_PREFIX"rx_unknown_code", NULL,
                                  "Got an unknown code: [code, length].");
 
-Qth::EEPROMProperty *tx_codes_prop;
+// The rx_codes and tx_codes tables may be split across up to this many
+// chunks, each a separate property no larger than MQTT_MAX_PACKET_SIZE. Chunk
+// 0 is sys/433mhz/rx_codes (or tx_codes) and chunk n is sys/433mhz/rx_codes/n.
+#define CONFIG_MAX_CHUNKS 8
+
+
+// Start address and size of the storage region used to store the chunks.
+#define CONFIG_STORE_ADDR 0
+#define CONFIG_STORE_SIZE STORAGE_SIZE
+
+// Magic number at the start of the config store (changed if the format
+// changes)
+#define CONFIG_STORE_MAGIC 0xC0DE
+
+// Time budget (ms) for parsing (and registering) a chunk of config before a
+// watchdog report is produced.
+#define CONFIG_PARSE_BUDGET 500
 
 // Number of sequential receipts of the same unknown code to receive before
 // reporting it via Qth
@@ -27,116 +41,475 @@ const int UNKNOWN_CODE_REPEAT_COUNT = 4;
 // Minimum code length to bother reporting
 const int UNKNOWN_CODE_MIN_LENGTH = 10;
 
-// Minimum interval (ms) between events for the same code
-const int MIN_INTER_EVENT_TIME = 3000;
+// Default time (ms) after the last frame of a code is received before the
+// button is considered released (may be overridden per-code in rx_codes).
+// Frames separated by less than this are treated as a single press.
+const unsigned long RX_DEFAULT_RELEASE_GAP = 500;
+
+// Maximum number of buttons tracked as held at once
+#define RX_MAX_HELD 8
+
+// Size of the rx_codes hash index (must be a power of two, at least twice the
+// number of rx_codes)
+#define RX_CODE_INDEX_SIZE 256
+
+// Longest code (bits) which can be sent by the raw transmitter
+#define RAW_TX_MAX_BITS 32
+
+// timer1 ticks per microsecond (80 MHz / TIM_DIV16)
+#define RAW_TX_TICKS_PER_US 5
+
+// Maximum number of codes waiting to be transmitted
+#define TX_QUEUE_LENGTH 32
+
+// Time (ms) allowed for FourThreeThree to finish transmitting a code before
+// the raw transmitter may use the TX pin.
+#define RAW_TX_GUARD_TIME 500
 
 #include "common.inc"
 
-typedef struct {
-	char *qth_path;
-	unsigned long code;
-	unsigned int code_length;
-	Qth::Event *event;
-	unsigned long last_event_time;
-} rx_code_t;
+WatchdogSection config_parse_section("config_parse", CONFIG_PARSE_BUDGET);
 
-// The set of codes currently registered in the Qth sys/433mhz/rx_codes
-// property.
-size_t num_rx_codes = 0;
-rx_code_t *rx_codes = NULL;
+/**
+ * Persists the chunks of the rx_codes and tx_codes tables in a region of
+ * storage as a sequence of variable-length records, allowing the tables to use
+ * as much of the storage as they need.
+ *
+ * The region starts with CONFIG_STORE_MAGIC (uint16_t) followed by records
+ * consisting of a 4-byte header (kind, chunk, uint16_t length) and then
+ * length bytes of JSON (without a null terminator). The final record has kind
+ * CONFIG_KIND_END.
+ */
+class ConfigStore {
+	public:
+		static const uint8_t CONFIG_KIND_END = 0;
+		static const uint8_t CONFIG_KIND_RX = 1;
+		static const uint8_t CONFIG_KIND_TX = 2;
+		static const uint8_t CONFIG_KIND_GROUPS = 3;
+		
+		typedef void (*callback_t)(uint8_t kind, uint8_t chunk,
+		                           const char *value, size_t length);
+		
+		/**
+		 * Initialise the store (must be called after setup_common()). An empty
+		 * store is created if one is not already present.
+		 */
+		void begin() {
+			uint16_t magic;
+			storage.get(CONFIG_STORE_ADDR, magic);
+			if (magic != CONFIG_STORE_MAGIC) {
+				Serial.println("Initialising empty config store.");
+				storage.put(CONFIG_STORE_ADDR, (uint16_t)CONFIG_STORE_MAGIC);
+				storage.put(CONFIG_STORE_ADDR + 2, (uint8_t)CONFIG_KIND_END);
+			}
+		}
+		
+		/**
+		 * Call the callback with every stored chunk. The value is not null
+		 * terminated and points directly into the storage's RAM image.
+		 *
+		 * If a record is found which extends beyond the store (i.e. the store
+		 * is corrupt) it and any following records are discarded.
+		 */
+		void load(callback_t callback) {
+			const uint8_t *data = storage.get_data();
+			size_t offset = first();
+			for (; !is_end(offset); offset = next(offset)) {
+				callback(data[offset], data[offset + 1],
+				         (const char *)(data + offset + 4), get_length(offset));
+			}
+			
+			if (data[offset] != CONFIG_KIND_END) {
+				Serial.print("Corrupt config store record at offset ");
+				Serial.print(offset);
+				Serial.println(", discarding it and any following records.");
+				storage.put(offset, (uint8_t)CONFIG_KIND_END);
+			}
+		}
+		
+		/**
+		 * Replace the stored value of a chunk (or remove it if length is zero).
+		 * The storage is only marked dirty if the value has changed (it is
+		 * committed to flash once config updates stop arriving).
+		 *
+		 * Returns false (leaving any previously stored value unchanged) if there
+		 * is not enough space for the new value.
+		 */
+		bool store(uint8_t kind, uint8_t chunk, const char *value, size_t length) {
+			const uint8_t *data = storage.get_data();
+			
+			// Find the existing record (if any) and the end of the store
+			size_t offset = first();
+			size_t existing = 0;
+			for (; !is_end(offset); offset = next(offset)) {
+				if (data[offset] == kind && data[offset + 1] == chunk) {
+					existing = offset;
+				}
+			}
+			size_t end = offset;
+			
+			if (existing &&
+			    get_length(existing) == length &&
+			    memcmp(data + existing + 4, value, length) == 0) {
+				// Unchanged
+				return true;
+			}
+			if (!existing && length == 0) {
+				// Nothing to remove
+				return true;
+			}
+			
+			// Check the new record will fit (once the old one is removed) before
+			// changing anything
+			size_t existing_size = existing ? next(existing) - existing : 0;
+			if (length > 0 && !fits(end - existing_size, length)) {
+				Serial.print("Not enough space to store config chunk ");
+				Serial.println(chunk);
+				return false;
+			}
+			
+			// Remove the old record by shifting everything after it down
+			uint8_t *mut_data = storage.modify(CONFIG_STORE_ADDR, CONFIG_STORE_SIZE);
+			if (existing) {
+				size_t existing_end = next(existing);
+				memmove(mut_data + existing,
+				        mut_data + existing_end,
+				        end - existing_end);
+				end -= existing_size;
+			}
+			
+			// Append the new record
+			if (length > 0) {
+				mut_data[end + 0] = kind;
+				mut_data[end + 1] = chunk;
+				mut_data[end + 2] = length & 0xFF;
+				mut_data[end + 3] = (length >> 8) & 0xFF;
+				memcpy(mut_data + end + 4, value, length);
+				end += 4 + length;
+			}
+			
+			// NB: Also terminates a store which ended in a corrupt record
+			mut_data[end] = CONFIG_KIND_END;
+			return true;
+		}
+	
+	private:
+		size_t first() const {
+			return CONFIG_STORE_ADDR + 2;
+		}
+		
+		/**
+		 * Would a record with length bytes of value starting at offset (and the
+		 * end marker following it) fit within the store?
+		 */
+		bool fits(size_t offset, size_t length) const {
+			return offset + 4 + length + 1 <= CONFIG_STORE_ADDR + CONFIG_STORE_SIZE;
+		}
+		
+		/**
+		 * Is the record at offset the end marker, or one which does not fit
+		 * within the store (and so must be corrupt)?
+		 *
+		 * NB: Every record before offset fits (leaving space for an end
+		 * marker) so offset itself is always within the store.
+		 */
+		bool is_end(size_t offset) const {
+			const uint8_t *data = storage.get_data();
+			return data[offset] == CONFIG_KIND_END ||
+			       offset + 4 > CONFIG_STORE_ADDR + CONFIG_STORE_SIZE ||
+			       !fits(offset, get_length(offset));
+		}
+		
+		size_t get_length(size_t offset) const {
+			const uint8_t *data = storage.get_data();
+			return data[offset + 2] | (data[offset + 3] << 8);
+		}
+		
+		size_t next(size_t offset) const {
+			return offset + 4 + get_length(offset);
+		}
+};
 
-void on_rx_codes_changed(const char *topic, const char *value) {
-	// Remove all old registrations
-	for (size_t i = 0; i < num_rx_codes; i++) {
-		qth.unregisterEvent(rx_codes[i].event);
-		delete rx_codes[i].event;
-		delete [] rx_codes[i].qth_path;
+ConfigStore config_store;
+
+
+/**
+ * Get the chunk number of a chunked config property from its path, or -1 if
+ * the path isn't a chunk of the given table.
+ */
+int get_config_chunk(const char *topic, const char *base_path) {
+	size_t base_length = strlen(base_path);
+	if (strncmp(topic, base_path, base_length) != 0) {
+		return -1;
 	}
-	delete [] rx_codes;
-	num_rx_codes = 0;
-	rx_codes = NULL;
-	
-	// Parse incoming JSON specification
+	if (topic[base_length] == '\0') {
+		return 0;
+	}
+	if (topic[base_length] != '/') {
+		return -1;
+	}
+	int chunk = atoi(topic + base_length + 1);
+	if (chunk <= 0 || chunk >= CONFIG_MAX_CHUNKS) {
+		return -1;
+	}
+	return chunk;
+}
+
+/**
+ * Parse a JSON object of length bytes into a newly allocated array of tokens.
+ * Returns NULL (after printing an error) if the JSON is invalid or not an
+ * object.
+ */
+jsmntok_t *parse_config_chunk(const char *name, const char *value, size_t length) {
 	jsmn_parser parser;
 	
 	jsmn_init(&parser);
-	int num_tokens = jsmn_parse(&parser, value, strlen(value), NULL, 0);
+	int num_tokens = jsmn_parse(&parser, value, length, NULL, 0);
 	if (num_tokens < 1) {
 		// Bad JSON, stop now
-		Serial.print("Bad JSON in rx_codes (");
+		metrics.increment(METRIC_JSON_ERRORS);
+		Serial.print("Bad JSON in ");
+		Serial.print(name);
+		Serial.print(" (");
 		Serial.print(num_tokens);
-		Serial.print("): ");
-		Serial.println(value);
-		return;
+		Serial.println(")");
+		return NULL;
 	}
 	
 	jsmntok_t *tokens = new jsmntok_t[num_tokens];
 	jsmn_init(&parser);
-	num_tokens = jsmn_parse(&parser, value, strlen(value), tokens, num_tokens);
+	num_tokens = jsmn_parse(&parser, value, length, tokens, num_tokens);
 	if (num_tokens < 1) {
 		// Bad JSON, stop now
-		Serial.print("Bad JSON in rx_codes (");
+		metrics.increment(METRIC_JSON_ERRORS);
+		Serial.print("Bad JSON in ");
+		Serial.print(name);
+		Serial.print(" (");
 		Serial.print(num_tokens);
-		Serial.print("): ");
-		Serial.println(value);
-		return;
+		Serial.println(")");
+		delete [] tokens;
+		return NULL;
 	}
 	
 	if (tokens[0].type != JSMN_OBJECT) {
 		// Expected an object, give up
-		Serial.print("Expected object in rx_codes (got ");
+		metrics.increment(METRIC_JSON_ERRORS);
+		Serial.print("Expected object in ");
+		Serial.print(name);
+		Serial.print(" (got ");
 		Serial.print(tokens[0].type);
-		Serial.println(",");
-		Serial.print(tokens[0].start);
-		Serial.println(",");
-		Serial.print(tokens[0].end);
-		Serial.println(",");
-		Serial.print(tokens[0].size);
 		Serial.println(")");
-		delete tokens;
-		return;
+		delete [] tokens;
+		return NULL;
+	}
+	
+	return tokens;
+}
+
+
+typedef struct {
+	char *qth_path;
+	unsigned long code;
+	unsigned int code_length;
+	Qth::Event *event;
+	// The chunk of the rx_codes table this code was defined in
+	uint8_t chunk;
+	
+	// Event sent when the button is released and its path (qth_path/release)
+	char *release_path;
+	Qth::Event *release_event;
+	
+	// Time (ms) without a frame after which the button is considered released
+	unsigned long release_gap;
+	
+	// Is the button currently held and, if so, when did the press start and
+	// when was the last frame received?
+	bool held;
+	unsigned long press_time;
+	unsigned long last_frame_time;
+} rx_code_t;
+
+// The set of codes currently registered in the Qth sys/433mhz/rx_codes
+// property (and its chunks).
+size_t num_rx_codes = 0;
+rx_code_t *rx_codes = NULL;
+
+// Open-addressed hash table of indices into rx_codes (or -1 if empty) used to
+// find received codes in constant time.
+int16_t rx_code_index[RX_CODE_INDEX_SIZE];
+
+// Indices into rx_codes of the codes whose buttons are currently held (oldest
+// press first).
+size_t rx_held[RX_MAX_HELD];
+size_t num_rx_held = 0;
+
+size_t rx_code_hash(unsigned long code, unsigned int code_length) {
+	return ((code * 2654435761ul) ^ code_length) & (RX_CODE_INDEX_SIZE - 1);
+}
+
+rx_code_t *find_rx_code(unsigned long code, unsigned int code_length) {
+	size_t slot = rx_code_hash(code, code_length);
+	for (size_t i = 0; i < RX_CODE_INDEX_SIZE; i++) {
+		int16_t index = rx_code_index[slot];
+		if (index < 0) {
+			break;
+		}
+		if (rx_codes[index].code == code && rx_codes[index].code_length == code_length) {
+			return rx_codes + index;
+		}
+		slot = (slot + 1) & (RX_CODE_INDEX_SIZE - 1);
 	}
 	
+	return NULL;
+}
+
+/**
+ * Send the release event for held button n (an index into rx_held) and stop
+ * tracking it.
+ */
+void release_rx_code(size_t n) {
+	rx_code_t *rx_code = rx_codes + rx_held[n];
+	rx_code->held = false;
+	num_rx_held--;
+	memmove(rx_held + n, rx_held + n + 1, (num_rx_held - n) * sizeof(rx_held[0]));
 	
-	// Count and verify the entries of the provided object
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%lu", rx_code->last_frame_time - rx_code->press_time);
+	qth_send_event(rx_code->release_event, buf);
+}
+
+/**
+ * Send release events for all held buttons (before the rx_codes table
+ * changes).
+ */
+void release_all_rx_codes() {
+	while (num_rx_held) {
+		release_rx_code(0);
+	}
+}
+
+/**
+ * Rebuild rx_code_index after the rx_codes table changes.
+ */
+void rebuild_rx_code_index() {
+	for (size_t slot = 0; slot < RX_CODE_INDEX_SIZE; slot++) {
+		rx_code_index[slot] = -1;
+	}
+	
+	for (size_t i = 0; i < num_rx_codes; i++) {
+		// NB: The table is kept at most half full so probe sequences stay short
+		if (i >= RX_CODE_INDEX_SIZE / 2) {
+			Serial.print("Too many rx_codes, ignoring ");
+			Serial.println(rx_codes[i].qth_path);
+			continue;
+		}
+		
+		// Where a code appears more than once, the first definition is used
+		if (find_rx_code(rx_codes[i].code, rx_codes[i].code_length)) {
+			continue;
+		}
+		size_t slot = rx_code_hash(rx_codes[i].code, rx_codes[i].code_length);
+		while (rx_code_index[slot] >= 0) {
+			slot = (slot + 1) & (RX_CODE_INDEX_SIZE - 1);
+		}
+		rx_code_index[slot] = i;
+	}
+}
+
+/**
+ * Remove (and unregister) all RX codes defined by a particular chunk.
+ */
+void remove_rx_codes(uint8_t chunk) {
+	// NB: Held buttons are tracked by their index in rx_codes
+	release_all_rx_codes();
+	
+	size_t num_remaining = 0;
+	for (size_t i = 0; i < num_rx_codes; i++) {
+		if (rx_codes[i].chunk == chunk) {
+			qth.unregisterEvent(rx_codes[i].event);
+			qth.unregisterEvent(rx_codes[i].release_event);
+			delete rx_codes[i].event;
+			delete rx_codes[i].release_event;
+			delete [] rx_codes[i].qth_path;
+			delete [] rx_codes[i].release_path;
+		} else {
+			rx_codes[num_remaining++] = rx_codes[i];
+		}
+	}
+	num_rx_codes = num_remaining;
+	rebuild_rx_code_index();
+}
+
+/**
+ * Is the given token a number?
+ */
+bool is_number_token(const char *value, const jsmntok_t &token) {
+	return token.type == JSMN_PRIMITIVE &&
+	       value[token.start] != 't' &&
+	       value[token.start] != 'f' &&
+	       value[token.start] != 'n';
+}
+
+/**
+ * Parse a chunk of the rx_codes table and add (and register) its codes.
+ */
+void add_rx_codes(uint8_t chunk, const char *value, size_t length) {
+	jsmntok_t *tokens = parse_config_chunk("rx_codes", value, length);
+	if (!tokens) {
+		return;
+	}
+	
+	// Count and verify the entries of the provided object. Each is
+	// "name": [code, code_length] or "name": [code, code_length, release_gap].
 	size_t num_entries = tokens[0].size;
-	for (size_t i = 1; i < (num_entries*4) + 1; i += 4) {
-		if (tokens[i+0].type != JSMN_STRING ||     // Expect a name
-		    tokens[i+1].type != JSMN_ARRAY ||      // Expect an array
-		    tokens[i+1].size != 2 ||               // ...of length 2
-		    tokens[i+2].type != JSMN_PRIMITIVE ||  // Both elements should be
-		    value[tokens[i+2].start] == 't' ||     // numbers.
-		    value[tokens[i+2].start] == 'f' ||
-		    value[tokens[i+2].start] == 'n' ||
-		    tokens[i+3].type != JSMN_PRIMITIVE ||
-		    value[tokens[i+3].start] == 't' ||
-		    value[tokens[i+3].start] == 'f' ||
-		    value[tokens[i+3].start] == 'n') {
-			// Expected a "name": [code, code_length] entry, give up!
-			delete tokens;
+	for (size_t entry = 0, i = 1; entry < num_entries; entry++) {
+		bool valid = tokens[i+0].type == JSMN_STRING &&  // Expect a name
+		             tokens[i+1].type == JSMN_ARRAY &&   // Expect an array
+		             (tokens[i+1].size == 2 ||           // ...of length 2 or 3
+		              tokens[i+1].size == 3);
+		for (int j = 0; valid && j < tokens[i+1].size; j++) {
+			// All elements should be numbers
+			valid = is_number_token(value, tokens[i+2+j]);
+		}
+		if (!valid) {
+			// Expected a "name": [code, code_length(, release_gap)] entry, give up!
+			delete [] tokens;
+			metrics.increment(METRIC_JSON_ERRORS);
 			Serial.print("Expected rx_code entry at offset ");
 			Serial.print(i);
-			Serial.println(" to be two-arrays of integers.");
+			Serial.println(" to be an array of two or three integers.");
 			return;
 		}
+		i += 2 + tokens[i+1].size;
 	}
 	
-	num_rx_codes = num_entries;
-	rx_codes = new rx_code_t[num_rx_codes];
+	// Grow the table to fit the new codes
+	rx_code_t *new_rx_codes = new rx_code_t[num_rx_codes + num_entries];
+	memcpy(new_rx_codes, rx_codes, num_rx_codes * sizeof(rx_code_t));
+	delete [] rx_codes;
+	rx_codes = new_rx_codes;
+	rx_code_t *rx_code = rx_codes + num_rx_codes;
+	num_rx_codes += num_entries;
 	
 	// Create and register all RX events
-	rx_code_t *rx_code = rx_codes;
-	for (size_t i = 1; i < (num_entries*4)+1; i += 4, rx_code++) {
+	for (size_t entry = 0, i = 1; entry < num_entries; entry++, rx_code++) {
 		// Get event path name
 		const char *name = value + tokens[i].start;
 		size_t name_length = tokens[i].end - tokens[i].start;
 		rx_code->qth_path = new char[name_length + 1];
 		memcpy(rx_code->qth_path, name, name_length);
 		rx_code->qth_path[name_length] = '\0';
+		rx_code->release_path = new char[name_length + sizeof("/release")];
+		memcpy(rx_code->release_path, name, name_length);
+		strcpy(rx_code->release_path + name_length, "/release");
 		
-		// Create and register the event
-		rx_code->event = new Qth::Event(rx_code->qth_path, NULL, "433 MHz receiver");
+		// Create and register the events
+		rx_code->event = new Qth::Event(rx_code->qth_path, NULL, "433 MHz receiver (button pressed)");
 		qth.registerEvent(rx_code->event);
+		rx_code->release_event = new Qth::Event(
+			rx_code->release_path, NULL,
+			"433 MHz receiver (button released). Value is the time (ms) the button was held.");
+		qth.registerEvent(rx_code->release_event);
 		
 		// Get code
 		const char *code_str = value + tokens[i+2].start;
@@ -146,12 +519,215 @@ void on_rx_codes_changed(const char *topic, const char *value) {
 		const char *code_length_str = value + tokens[i+3].start;
 		rx_code->code_length = (unsigned int)strtoul(code_length_str, NULL, 10);
 		
-		rx_code->last_event_time = 0ul;
+		// Get release gap (if given)
+		if (tokens[i+1].size == 3) {
+			const char *release_gap_str = value + tokens[i+4].start;
+			rx_code->release_gap = strtoul(release_gap_str, NULL, 10);
+		} else {
+			rx_code->release_gap = RX_DEFAULT_RELEASE_GAP;
+		}
+		
+		rx_code->held = false;
+		rx_code->chunk = chunk;
+		
+		i += 2 + tokens[i+1].size;
+	}
+	
+	delete [] tokens;
+	rebuild_rx_code_index();
+}
+
+/**
+ * Handle a frame containing a known code: sends a press event if the button
+ * wasn't already held.
+ */
+void on_rx_frame(rx_code_t *rx_code) {
+	unsigned long now = millis();
+	rx_code->last_frame_time = now;
+	if (rx_code->held) {
+		// Repeated frame whilst held
+		return;
+	}
+	
+	// If too many buttons are held, release the oldest
+	if (num_rx_held == RX_MAX_HELD) {
+		release_rx_code(0);
+	}
+	rx_code->held = true;
+	rx_code->press_time = now;
+	rx_held[num_rx_held++] = rx_code - rx_codes;
+	
+	qth_send_event(rx_code->event, "null");
+}
+
+/**
+ * Send release events for any held buttons whose frames have stopped.
+ */
+void loop_rx_release() {
+	unsigned long now = millis();
+	for (size_t n = 0; n < num_rx_held;) {
+		rx_code_t *rx_code = rx_codes + rx_held[n];
+		if (now - rx_code->last_frame_time >= rx_code->release_gap) {
+			release_rx_code(n);
+		} else {
+			n++;
+		}
+	}
+}
+
+void on_rx_codes_changed(const char *topic, const char *value) {
+	WatchdogScope scope(config_parse_section);
+	metrics.increment(METRIC_PROPERTY_SETS);
+	
+	int chunk = get_config_chunk(topic, QTH_PATH_PREFIX"rx_codes");
+	if (chunk < 0) {
+		return;
+	}
+	
+	// Only the codes from this chunk are replaced (an empty value deletes the
+	// chunk)
+	size_t length = strlen(value);
+	remove_rx_codes(chunk);
+	if (length > 0) {
+		add_rx_codes(chunk, value, length);
+	}
+	config_store.store(ConfigStore::CONFIG_KIND_RX, chunk, value, length);
+}
+
+
+/**
+ * Pulse timings for transmitting codes in protocols which FourThreeThree's
+ * transmitter does not support. Each bit is sent MSB first as a high pulse
+ * followed by a low pulse. Each repeat of the code is followed by a further
+ * gap (low).
+ */
+typedef struct {
+	const char *name;
+	uint16_t zero_high_us;
+	uint16_t zero_low_us;
+	uint16_t one_high_us;
+	uint16_t one_low_us;
+	uint16_t gap_us;
+	uint8_t repeats;
+} pulse_template_t;
+
+const pulse_template_t pulse_templates[] = {
+	// Bit timings from remote_controlled_adapters.md. NB: The 8000 us gap
+	// and 8 repeats are unverified assumptions (neither was measured on the
+	// scope); check them against a real remote before relying on them.
+	{"mercury", 170, 600, 550, 220, 8000, 8},
+	// PT2262/EV1527-style fixed code remotes
+	{"pt2262", 350, 1050, 1050, 350, 10850, 8},
+};
+
+const pulse_template_t *find_pulse_template(const char *name, size_t name_length) {
+	for (size_t i = 0; i < sizeof(pulse_templates) / sizeof(pulse_templates[0]); i++) {
+		if (strlen(pulse_templates[i].name) == name_length &&
+		    strncmp(pulse_templates[i].name, name, name_length) == 0) {
+			return pulse_templates + i;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Transmits a code as a raw waveform according to a pulse_template_t.
+ *
+ * The waveform's pulse durations are expanded into a preallocated pool and
+ * then played out on the TX pin by the timer1 interrupt so that the main loop
+ * continues to run during (potentially long) transmissions.
+ */
+class RawTransmitter {
+	public:
+		void begin(int pin) {
+			this->pin = pin;
+			busy = false;
+			timer1_attachInterrupt(on_timer);
+		}
+		
+		/**
+		 * Is a transmission in progress?
+		 */
+		bool is_busy() const {
+			return busy;
+		}
+		
+		/**
+		 * Start transmitting a code of code_length bits (at most 32). Returns
+		 * false if a transmission is already in progress.
+		 */
+		bool start(const pulse_template_t &pulse_template,
+		           unsigned long code, unsigned int code_length) {
+			if (busy || code_length == 0) {
+				return false;
+			}
+			if (code_length > RAW_TX_MAX_BITS) {
+				code_length = RAW_TX_MAX_BITS;
+			}
+			
+			num_pulses = 0;
+			for (int bit = code_length - 1; bit >= 0; bit--) {
+				if ((code >> bit) & 1) {
+					pulses[num_pulses++] = pulse_template.one_high_us * RAW_TX_TICKS_PER_US;
+					pulses[num_pulses++] = pulse_template.one_low_us * RAW_TX_TICKS_PER_US;
+				} else {
+					pulses[num_pulses++] = pulse_template.zero_high_us * RAW_TX_TICKS_PER_US;
+					pulses[num_pulses++] = pulse_template.zero_low_us * RAW_TX_TICKS_PER_US;
+				}
+			}
+			// Extend the final low pulse by the inter-code gap
+			pulses[num_pulses - 1] += pulse_template.gap_us * RAW_TX_TICKS_PER_US;
+			
+			next_pulse = 0;
+			repeats_remaining = pulse_template.repeats;
+			busy = true;
+			timer1_enable(TIM_DIV16, TIM_EDGE, TIM_SINGLE);
+			on_timer();
+			return true;
+		}
+	
+	private:
+		static void IRAM_ATTR on_timer();
+		
+		static int pin;
+		
+		// The pool of pulse durations (in timer ticks) for one repeat of the
+		// code, alternately high and low.
+		static uint32_t pulses[RAW_TX_MAX_BITS * 2];
+		static volatile size_t num_pulses;
+		static volatile size_t next_pulse;
+		static volatile uint8_t repeats_remaining;
+		static volatile bool busy;
+};
+
+int RawTransmitter::pin;
+uint32_t RawTransmitter::pulses[RAW_TX_MAX_BITS * 2];
+volatile size_t RawTransmitter::num_pulses;
+volatile size_t RawTransmitter::next_pulse;
+volatile uint8_t RawTransmitter::repeats_remaining;
+volatile bool RawTransmitter::busy;
+
+void IRAM_ATTR RawTransmitter::on_timer() {
+	if (next_pulse == num_pulses) {
+		if (--repeats_remaining == 0) {
+			digitalWrite(pin, LOW);
+			timer1_disable();
+			busy = false;
+			return;
+		}
+		next_pulse = 0;
 	}
 	
-	delete tokens;
+	// Even pulses are high, odd pulses are low
+	digitalWrite(pin, (next_pulse & 1) ? LOW : HIGH);
+	timer1_write(pulses[next_pulse++]);
 }
 
+RawTransmitter raw_tx;
+
+// Time (ms) at which FourThreeThree was last given a code to transmit
+unsigned long last_four_three_three_tx = 0;
+
 
 typedef struct {
 	char *qth_path;
@@ -164,132 +740,164 @@ typedef struct {
 	// Which command (on or off) should be sent when it comes to this code's
 	// turn?
 	bool state;
+	// The chunk of the tx_codes table this code was defined in
+	uint8_t chunk;
+	// The pulse timings to transmit the code with using raw_tx (or NULL to
+	// use FourThreeThree)
+	const pulse_template_t *pulse_template;
 } tx_code_t;
 
-// The set of codes currently registered in the Qth sys/433mhz/rx_codes
-// property.
+// The set of codes currently registered in the Qth sys/433mhz/tx_codes
+// property (and its chunks).
 size_t num_tx_codes = 0;
 tx_code_t *tx_codes = NULL;
 
-void on_tx_code_set(const char *topic, const char *value) {
-	// Determine the desired state
+// FIFO of indices into tx_codes waiting to be transmitted. A code is in the
+// queue if (and only if) its waiting flag is set.
+size_t tx_queue[TX_QUEUE_LENGTH];
+size_t tx_queue_head = 0;
+size_t tx_queue_length = 0;
+
+// Time (ms) at which the most recent group burst was queued (or 0 if the
+// burst has been sent).
+unsigned long tx_burst_start = 0;
+
+/**
+ * Queue a code to be transmitted. If the code is already queued, only its
+ * state is changed.
+ */
+void queue_tx_code(size_t index, bool state) {
+	tx_codes[index].state = state;
+	if (tx_codes[index].waiting) {
+		return;
+	}
+	if (tx_queue_length == TX_QUEUE_LENGTH) {
+		Serial.print("TX queue full, dropping ");
+		Serial.println(tx_codes[index].qth_path);
+		return;
+	}
+	tx_queue[(tx_queue_head + tx_queue_length++) % TX_QUEUE_LENGTH] = index;
+	tx_codes[index].waiting = true;
+}
+
+/**
+ * Parse a truthy/falsy JSON value as an on/off state. Returns false if the
+ * value is null (i.e. nothing should be sent).
+ */
+bool parse_tx_state(const char *value, bool *state) {
 	// XXX: Ideally this would use a full JSON parsing pass to determine if the
 	// value is 'truthy'...
-	bool state;
 	
 	// Skip whitespace in JSON
 	while (value[0] == ' ' || value[0] == '\t') {
 		value++;
 	}
 	
-	if (value[0] == 'n') {
-		// Do nothing if null.
-		return;
+	if (value[0] == 'n' || value[0] == '\0') {
+		// Do nothing if null (or deleted).
+		return false;
 	}
 	
 	if ((value[0] == '0' && atof(value) == 0)
 	    || value[0] == 'f') {
-		state = false;
+		*state = false;
 	} else {
-		state = true;
+		*state = true;
+	}
+	return true;
+}
+
+void on_tx_code_set(const char *topic, const char *value) {
+	metrics.increment(METRIC_PROPERTY_SETS);
+	
+	// Determine the desired state
+	bool state;
+	if (!parse_tx_state(value, &state)) {
+		return;
 	}
 	
 	// Send the code
 	for (size_t i = 0; i < num_tx_codes; i++) {
 		if (strcmp(tx_codes[i].qth_path, topic) == 0) {
-			tx_codes[i].waiting = true;
-			tx_codes[i].state = state;
+			queue_tx_code(i, state);
 		}
 	}
 }
 
-void on_tx_codes_changed(const char *topic, const char *value) {
-	// Remove all old registrations
+/**
+ * Remove (and unregister) all TX codes defined by a particular chunk.
+ */
+void remove_tx_codes(uint8_t chunk) {
+	size_t num_remaining = 0;
 	for (size_t i = 0; i < num_tx_codes; i++) {
-		qth.unregisterProperty(tx_codes[i].property);
-		qth.unwatchProperty(tx_codes[i].property);
-		delete tx_codes[i].property;
-		delete [] tx_codes[i].qth_path;
-	}
-	delete [] tx_codes;
-	num_tx_codes = 0;
-	tx_codes = NULL;
-	
-	// Parse incoming JSON specification
-	jsmn_parser parser;
-	
-	jsmn_init(&parser);
-	int num_tokens = jsmn_parse(&parser, value, strlen(value), NULL, 0);
-	if (num_tokens < 1) {
-		// Bad JSON, stop now
-		Serial.print("Bad JSON in tx_codes (");
-		Serial.print(num_tokens);
-		Serial.print("): ");
-		Serial.println(value);
-		return;
+		if (tx_codes[i].chunk == chunk) {
+			qth.unregisterProperty(tx_codes[i].property);
+			qth.unwatchProperty(tx_codes[i].property);
+			delete tx_codes[i].property;
+			delete [] tx_codes[i].qth_path;
+		} else {
+			tx_codes[num_remaining++] = tx_codes[i];
+		}
 	}
+	num_tx_codes = num_remaining;
 	
-	jsmntok_t *tokens = new jsmntok_t[num_tokens];
-	jsmn_init(&parser);
-	num_tokens = jsmn_parse(&parser, value, strlen(value), tokens, num_tokens);
-	if (num_tokens < 1) {
-		// Bad JSON, stop now
-		Serial.print("Bad JSON in tx_codes (");
-		Serial.print(num_tokens);
-		Serial.print("): ");
-		Serial.println(value);
-		return;
+	// Indices into the table have changed so anything queued is dropped
+	tx_queue_length = 0;
+	for (size_t i = 0; i < num_tx_codes; i++) {
+		tx_codes[i].waiting = false;
 	}
-	
-	if (tokens[0].type != JSMN_OBJECT) {
-		// Expected an object, give up
-		Serial.print("Expected object in tx_codes (got ");
-		Serial.print(tokens[0].type);
-		Serial.println(",");
-		Serial.print(tokens[0].start);
-		Serial.println(",");
-		Serial.print(tokens[0].end);
-		Serial.println(",");
-		Serial.print(tokens[0].size);
-		Serial.println(")");
-		delete tokens;
+}
+
+/**
+ * Parse a chunk of the tx_codes table and add (and register) its codes.
+ */
+void add_tx_codes(uint8_t chunk, const char *value, size_t length) {
+	jsmntok_t *tokens = parse_config_chunk("tx_codes", value, length);
+	if (!tokens) {
 		return;
 	}
 	
-	
-	// Count and verify the entries of the provided object
+	// Count and verify the entries of the provided object. Each is
+	// "name": [on_code, off_code, code_length] or
+	// "name": [on_code, off_code, code_length, "pulse template name"].
 	size_t num_entries = tokens[0].size;
-	for (size_t i = 1; i < (num_entries*5) + 1; i += 5) {
-		if (tokens[i+0].type != JSMN_STRING ||     // Expect a name
-		    tokens[i+1].type != JSMN_ARRAY ||      // Expect an array
-		    tokens[i+1].size != 3 ||               // ...of length 3
-		    tokens[i+2].type != JSMN_PRIMITIVE ||  // All elements should be
-		    value[tokens[i+2].start] == 't' ||     // numbers.
-		    value[tokens[i+2].start] == 'f' ||
-		    value[tokens[i+2].start] == 'n' ||
-		    tokens[i+3].type != JSMN_PRIMITIVE ||
-		    value[tokens[i+3].start] == 't' ||
-		    value[tokens[i+3].start] == 'f' ||
-		    value[tokens[i+3].start] == 'n' ||
-		    tokens[i+4].type != JSMN_PRIMITIVE ||
-		    value[tokens[i+4].start] == 't' ||
-		    value[tokens[i+4].start] == 'f' ||
-		    value[tokens[i+4].start] == 'n') {
-			// Expected a "name": [on_code, off_code, code_length] entry, give up!
-			delete tokens;
+	for (size_t entry = 0, i = 1; entry < num_entries; entry++) {
+		bool valid = tokens[i+0].type == JSMN_STRING &&  // Expect a name
+		             tokens[i+1].type == JSMN_ARRAY &&   // Expect an array
+		             (tokens[i+1].size == 3 ||           // ...of length 3 or 4
+		              tokens[i+1].size == 4);
+		for (int j = 0; valid && j < 3; j++) {
+			// The first three elements should be numbers
+			valid = is_number_token(value, tokens[i+2+j]);
+		}
+		if (valid && tokens[i+1].size == 4) {
+			// ...and the fourth the name of a pulse template
+			valid = tokens[i+5].type == JSMN_STRING &&
+			        find_pulse_template(value + tokens[i+5].start,
+			                            tokens[i+5].end - tokens[i+5].start);
+		}
+		if (!valid) {
+			// Expected a "name": [on_code, off_code, code_length(, template)] entry, give up!
+			delete [] tokens;
+			metrics.increment(METRIC_JSON_ERRORS);
 			Serial.print("Expected tx_code entry at offset ");
 			Serial.print(i);
-			Serial.println(" to be two-arrays of integers.");
+			Serial.println(" to be an array of three integers and an optional pulse template name.");
 			return;
 		}
+		i += 2 + tokens[i+1].size;
 	}
 	
-	num_tx_codes = num_entries;
-	tx_codes = new tx_code_t[num_tx_codes];
+	// Grow the table to fit the new codes
+	tx_code_t *new_tx_codes = new tx_code_t[num_tx_codes + num_entries];
+	memcpy(new_tx_codes, tx_codes, num_tx_codes * sizeof(tx_code_t));
+	delete [] tx_codes;
+	tx_codes = new_tx_codes;
+	tx_code_t *tx_code = tx_codes + num_tx_codes;
+	num_tx_codes += num_entries;
 	
 	// Create and register all TX events
-	tx_code_t *tx_code = tx_codes;
-	for (size_t i = 1; i < (num_entries*5)+1; i += 5, tx_code++) {
+	for (size_t entry = 0, i = 1; entry < num_entries; entry++, tx_code++) {
 		// Get event path name
 		const char *name = value + tokens[i].start;
 		size_t name_length = tokens[i].end - tokens[i].start;
@@ -316,11 +924,271 @@ void on_tx_codes_changed(const char *topic, const char *value) {
 		const char *code_length_str = value + tokens[i+4].start;
 		tx_code->code_length = (unsigned int)strtoul(code_length_str, NULL, 10);
 		
+		// Get pulse template (if given)
+		if (tokens[i+1].size == 4) {
+			tx_code->pulse_template = find_pulse_template(
+				value + tokens[i+5].start, tokens[i+5].end - tokens[i+5].start);
+		} else {
+			tx_code->pulse_template = NULL;
+		}
+		
 		// Initially not sending anything
 		tx_code->waiting = false;
+		tx_code->chunk = chunk;
+		
+		i += 2 + tokens[i+1].size;
+	}
+	
+	delete [] tokens;
+}
+
+void on_tx_codes_changed(const char *topic, const char *value) {
+	WatchdogScope scope(config_parse_section);
+	metrics.increment(METRIC_PROPERTY_SETS);
+	
+	int chunk = get_config_chunk(topic, QTH_PATH_PREFIX"tx_codes");
+	if (chunk < 0) {
+		return;
+	}
+	
+	// Only the codes from this chunk are replaced (an empty value deletes the
+	// chunk)
+	size_t length = strlen(value);
+	remove_tx_codes(chunk);
+	if (length > 0) {
+		add_tx_codes(chunk, value, length);
+	}
+	config_store.store(ConfigStore::CONFIG_KIND_TX, chunk, value, length);
+}
+
+
+typedef struct {
+	char *qth_path;
+	Qth::Property *property;
+	// The qth_paths of the tx_codes in the group
+	char **member_paths;
+	size_t num_members;
+} group_t;
+
+// The set of groups currently registered in the Qth sys/433mhz/groups
+// property.
+size_t num_groups = 0;
+group_t *groups = NULL;
+
+void on_group_set(const char *topic, const char *value) {
+	metrics.increment(METRIC_PROPERTY_SETS);
+	
+	bool state;
+	if (!parse_tx_state(value, &state)) {
+		return;
+	}
+	
+	group_t *group = NULL;
+	for (size_t i = 0; i < num_groups; i++) {
+		if (strcmp(groups[i].qth_path, topic) == 0) {
+			group = groups + i;
+		}
+	}
+	if (!group) {
+		return;
+	}
+	
+	// Queue all members as a single burst. Codes sent by the raw transmitter
+	// are queued first since FourThreeThree codes can follow them immediately
+	// whereas the reverse requires waiting RAW_TX_GUARD_TIME.
+	for (int raw = 1; raw >= 0; raw--) {
+		for (size_t m = 0; m < group->num_members; m++) {
+			for (size_t i = 0; i < num_tx_codes; i++) {
+				if ((tx_codes[i].pulse_template != NULL) == raw &&
+				    strcmp(tx_codes[i].qth_path, group->member_paths[m]) == 0) {
+					queue_tx_code(i, state);
+				}
+			}
+		}
+	}
+	
+	tx_burst_start = millis();
+}
+
+/**
+ * Remove (and unregister) all groups.
+ */
+void remove_groups() {
+	for (size_t i = 0; i < num_groups; i++) {
+		qth.unregisterProperty(groups[i].property);
+		qth.unwatchProperty(groups[i].property);
+		delete groups[i].property;
+		delete [] groups[i].qth_path;
+		for (size_t m = 0; m < groups[i].num_members; m++) {
+			delete [] groups[i].member_paths[m];
+		}
+		delete [] groups[i].member_paths;
 	}
+	delete [] groups;
+	num_groups = 0;
+	groups = NULL;
+}
+
+/**
+ * Allocate a null-terminated copy of a JSON string token.
+ */
+char *copy_token(const char *value, const jsmntok_t &token) {
+	size_t length = token.end - token.start;
+	char *str = new char[length + 1];
+	memcpy(str, value + token.start, length);
+	str[length] = '\0';
+	return str;
+}
+
+/**
+ * Parse the groups table and create (and register) its groups.
+ */
+void add_groups(const char *value, size_t length) {
+	jsmntok_t *tokens = parse_config_chunk("groups", value, length);
+	if (!tokens) {
+		return;
+	}
+	
+	// Count and verify the entries of the provided object. Each is
+	// "name": ["tx_code name", ...].
+	size_t num_entries = tokens[0].size;
+	for (size_t entry = 0, i = 1; entry < num_entries; entry++) {
+		bool valid = tokens[i+0].type == JSMN_STRING &&  // Expect a name
+		             tokens[i+1].type == JSMN_ARRAY;     // Expect an array
+		for (int j = 0; valid && j < tokens[i+1].size; j++) {
+			// ...of strings
+			valid = tokens[i+2+j].type == JSMN_STRING;
+		}
+		if (!valid) {
+			// Expected a "name": ["tx_code name", ...] entry, give up!
+			delete [] tokens;
+			metrics.increment(METRIC_JSON_ERRORS);
+			Serial.print("Expected group entry at offset ");
+			Serial.print(i);
+			Serial.println(" to be an array of tx_code names.");
+			return;
+		}
+		i += 2 + tokens[i+1].size;
+	}
+	
+	num_groups = num_entries;
+	groups = new group_t[num_groups];
+	
+	// Create and register all group properties
+	group_t *group = groups;
+	for (size_t entry = 0, i = 1; entry < num_entries; entry++, group++) {
+		group->qth_path = copy_token(value, tokens[i]);
+		group->num_members = tokens[i+1].size;
+		group->member_paths = new char *[group->num_members];
+		for (size_t m = 0; m < group->num_members; m++) {
+			group->member_paths[m] = copy_token(value, tokens[i+2+m]);
+		}
+		
+		group->property = new Qth::Property(group->qth_path,
+		                                    on_group_set,
+		                                    "433 MHz code TX group.",
+		                                    false,
+		                                    NULL);
+		qth.registerProperty(group->property);
+		qth.watchProperty(group->property);
+		
+		i += 2 + tokens[i+1].size;
+	}
+	
+	delete [] tokens;
+}
+
+void on_groups_changed(const char *topic, const char *value) {
+	WatchdogScope scope(config_parse_section);
+	metrics.increment(METRIC_PROPERTY_SETS);
 	
-	delete tokens;
+	// An empty value deletes all groups
+	size_t length = strlen(value);
+	remove_groups();
+	if (length > 0) {
+		add_groups(value, length);
+	}
+	config_store.store(ConfigStore::CONFIG_KIND_GROUPS, 0, value, length);
+}
+
+
+// The chunks of the rx_codes and tx_codes tables (see CONFIG_MAX_CHUNKS)
+#define RX_CODES_CHUNK(n) \
+	Qth::Property(QTH_PATH_PREFIX"rx_codes/" #n, on_rx_codes_changed, \
+	              "Additional codes to listen for (see rx_codes).", false, NULL)
+#define TX_CODES_CHUNK(n) \
+	Qth::Property(QTH_PATH_PREFIX"tx_codes/" #n, on_tx_codes_changed, \
+	              "Additional on/off codes to make properties for (see tx_codes).", false, NULL)
+
+Qth::Property rx_codes_props[] = {
+	Qth::Property(
+		QTH_PATH_PREFIX"rx_codes",
+		on_rx_codes_changed,
+		"Codes to listen for. {\\\"qth_path\\\": [code, length], ...}. Further codes may be given in rx_codes/1, rx_codes/2, ...",
+		false,
+		NULL),
+	RX_CODES_CHUNK(1), RX_CODES_CHUNK(2), RX_CODES_CHUNK(3), RX_CODES_CHUNK(4),
+	RX_CODES_CHUNK(5), RX_CODES_CHUNK(6), RX_CODES_CHUNK(7),
+};
+
+Qth::Property tx_codes_props[] = {
+	Qth::Property(
+		QTH_PATH_PREFIX"tx_codes",
+		on_tx_codes_changed,
+		"On/off codes to make properties for. {\\\"qth_path\\\": [on_code, off_code, length], ...}. Further codes may be given in tx_codes/1, tx_codes/2, ...",
+		false,
+		NULL),
+	TX_CODES_CHUNK(1), TX_CODES_CHUNK(2), TX_CODES_CHUNK(3), TX_CODES_CHUNK(4),
+	TX_CODES_CHUNK(5), TX_CODES_CHUNK(6), TX_CODES_CHUNK(7),
+};
+
+static_assert(sizeof(rx_codes_props) / sizeof(rx_codes_props[0]) == CONFIG_MAX_CHUNKS &&
+              sizeof(tx_codes_props) / sizeof(tx_codes_props[0]) == CONFIG_MAX_CHUNKS,
+              "A property must be declared for every config chunk.");
+
+Qth::Property groups_prop(
+	QTH_PATH_PREFIX"groups",
+	on_groups_changed,
+	"Groups of tx_codes to make properties for. Setting a group's property sends all of its codes in one burst. {\\\"qth_path\\\": [\\\"tx_code qth_path\\\", ...], ...}.",
+	false,
+	NULL);
+
+const QthPropertyEntry properties[] PROGMEM = {
+	// property, watch, initial value
+	{&rx_codes_props[0], true, NULL},
+	{&rx_codes_props[1], true, NULL},
+	{&rx_codes_props[2], true, NULL},
+	{&rx_codes_props[3], true, NULL},
+	{&rx_codes_props[4], true, NULL},
+	{&rx_codes_props[5], true, NULL},
+	{&rx_codes_props[6], true, NULL},
+	{&rx_codes_props[7], true, NULL},
+	{&tx_codes_props[0], true, NULL},
+	{&tx_codes_props[1], true, NULL},
+	{&tx_codes_props[2], true, NULL},
+	{&tx_codes_props[3], true, NULL},
+	{&tx_codes_props[4], true, NULL},
+	{&tx_codes_props[5], true, NULL},
+	{&tx_codes_props[6], true, NULL},
+	{&tx_codes_props[7], true, NULL},
+	{&groups_prop, true, NULL},
+};
+
+const QthEventEntry events[] PROGMEM = {
+	// event, watch
+	{&rx_unknown_code_event, false},
+};
+
+
+void on_config_loaded(uint8_t kind, uint8_t chunk, const char *value, size_t length) {
+	WatchdogScope scope(config_parse_section);
+	if (kind == ConfigStore::CONFIG_KIND_RX) {
+		add_rx_codes(chunk, value, length);
+	} else if (kind == ConfigStore::CONFIG_KIND_TX) {
+		add_tx_codes(chunk, value, length);
+	} else if (kind == ConfigStore::CONFIG_KIND_GROUPS) {
+		add_groups(value, length);
+	}
 }
 
 
@@ -334,44 +1202,20 @@ void setup() {
 	                        /*one_max_us =*/ 1100ul,
 	                        /*symbol_max_us =*/ 1500ul);
 	FourThreeThree_tx_begin(tx_pin);
+	raw_tx.begin(tx_pin);
 	
-	rx_codes_prop = new Qth::EEPROMProperty(
-		QTH_PATH_PREFIX"rx_codes",
-		MQTT_MAX_PACKET_SIZE,  // EPROM Block Length
-		0,  // EPROM Start addr
-		"Codes to listen for. {\\\"qth_path\\\": [code, length], ...}.",
-		false,
-		NULL,
-		on_rx_codes_changed);
+	rebuild_rx_code_index();
 	
-	tx_codes_prop = new Qth::EEPROMProperty(
-		QTH_PATH_PREFIX"tx_codes",
-		MQTT_MAX_PACKET_SIZE,  // EPROM Block Length
-		MQTT_MAX_PACKET_SIZE,  // EPROM Start addr
-		"On/off codes to make properties for. {\\\"qth_path\\\": [on_code, off_code, length], ...}.",
-		false,
-		NULL,
-		on_tx_codes_changed);
-	
-	qth.registerProperty(rx_codes_prop);
-	qth.registerProperty(tx_codes_prop);
-	qth.watchProperty(rx_codes_prop);
-	qth.watchProperty(tx_codes_prop);
+	// Restore the code tables from storage (any changes will be delivered by
+	// Qth once connected)
+	config_store.begin();
+	config_store.load(on_config_loaded);
 	
-	qth.registerEvent(&rx_unknown_code_event);
+	qth_register(qth, properties);
+	qth_register(qth, events);
 }
 
 
-rx_code_t *find_rx_code(unsigned long code, unsigned int code_length) {
-	for (size_t i = 0; i < num_rx_codes; i++) {
-		if (rx_codes[i].code == code && rx_codes[i].code_length == code_length) {
-			return rx_codes + i;
-		}
-	}
-	
-	return NULL;
-}
-
 void loop() {
 	loop_common();
 	FourThreeThree_tx_loop();
@@ -394,30 +1238,50 @@ void loop() {
 		}
 		
 		if (rx_code) {
-			// Known code, only send out events for the first occurrence
-			unsigned long now = millis();
-			unsigned long ellapsed = now - rx_code->last_event_time;
-			if (ellapsed >= MIN_INTER_EVENT_TIME) {
-				qth.sendEvent(rx_code->event, "null");
-				rx_code->last_event_time = now;
-			}
+			// Known code, only send out events for the start of a press
+			on_rx_frame(rx_code);
 		} else if (last_code_repeats == UNKNOWN_CODE_REPEAT_COUNT &&
 		           last_code_length >= UNKNOWN_CODE_MIN_LENGTH) {
 			// Unknown code (only issue after it has been seen several times in
 			// succession to reduce chances of it being noise)
 			char *buf = new char[16];
 			snprintf(buf, 16, "[%ld,%d]", code, code_length);
-			qth.sendEvent(&rx_unknown_code_event, buf);
-			delete buf;
+			qth_send_event(&rx_unknown_code_event, buf);
+			metrics.increment(METRIC_UNKNOWN_CODES);
+			delete[] buf;
 		}
 	}
+	loop_rx_release();
 	
-	// Try and transmit
-	for (size_t i = 0; i < num_tx_codes; i++) {
-		if (tx_codes[i].waiting &&
-		    FourThreeThree_tx(tx_codes[i].state ? tx_codes[i].on_code : tx_codes[i].off_code,
-		                      tx_codes[i].code_length)) {
-			tx_codes[i].waiting = false;
+	// Try and transmit (NB: FourThreeThree and the raw transmitter share the
+	// TX pin so only one may be used at once)
+	// Codes are sent in the order queued and the next code is started as soon
+	// as the transmitter accepts it.
+	while (tx_queue_length && !raw_tx.is_busy()) {
+		tx_code_t *tx_code = tx_codes + tx_queue[tx_queue_head];
+		unsigned long code = tx_code->state ? tx_code->on_code : tx_code->off_code;
+		bool started;
+		if (tx_code->pulse_template) {
+			started = millis() - last_four_three_three_tx >= RAW_TX_GUARD_TIME &&
+			          raw_tx.start(*tx_code->pulse_template, code, tx_code->code_length);
+		} else {
+			started = FourThreeThree_tx(code, tx_code->code_length);
+			if (started) {
+				last_four_three_three_tx = millis();
+			}
 		}
+		if (!started) {
+			break;
+		}
+		
+		tx_code->waiting = false;
+		tx_queue_head = (tx_queue_head + 1) % TX_QUEUE_LENGTH;
+		tx_queue_length--;
+	}
+	
+	if (tx_burst_start && !tx_queue_length) {
+		Serial.print("Group burst started in (ms): ");
+		Serial.println(millis() - tx_burst_start);
+		tx_burst_start = 0;
 	}
 }
@@ -0,0 +1,244 @@
+/**
+ * Benchmarks for the bathroom board:
+ *
+ * * "hot_water_controller_loop" and "bathroom_loop": the steady-state cost of
+ *   HotWaterController::loop() and of the whole main loop.
+ * * "ldr_detection": replays of LDR readings through LDRMonitor, reporting
+ *   the latency of detecting each change of the boiler's indicator, missed
+ *   changes and false transitions. Both the board's oversampled and filtered
+ *   settings ("filtered") and the single raw reading per sample period used
+ *   before ("raw") are replayed.
+ *
+ * Usage:
+ *
+ *     ./bathroom_board_bench [trace.csv ...]
+ *
+ * Recorded LDR readings (channel 0) are replayed too. Recorded traces carry no
+ * record of the boiler's true state so only the number of transitions is
+ * reported for them.
+ */
+
+#include "../bathroom_board/src/main.cpp"
+
+#include "bench.h"
+
+// Loop iterations per benchmark call
+const size_t iteration_counts[] = {1000, 10000};
+
+// Interval (ms) between LDR readings (the ADC consumer period)
+#define LDR_READING_PERIOD (LDR_SAMPLE_PERIOD / LDR_OVERSAMPLE)
+
+// Length (readings) of the synthetic LDR traces (one hour)
+#define LDR_TRACE_LENGTH (60 * 60 * 1000 / LDR_READING_PERIOD)
+
+/**
+ * Time the main loop with the ADC reading from a sequence of readings (one
+ * per ms, repeated as necessary).
+ */
+void bench_loop(const char *input, const std::vector<int> &readings, size_t iterations) {
+	if (readings.empty()) {
+		return;
+	}
+	sim::adc_source = [&]() {
+		return readings[(sim::now_ns() / 1000000ull) % readings.size()];
+	};
+	bench("bathroom_loop", input, iterations, iterations, [&]() {
+		for (size_t i = 0; i < iterations; i++) {
+			loop();
+			sim::advance_us(1000);
+		}
+		sim::qth_log.clear();
+	});
+	sim::adc_source = nullptr;
+}
+
+/**
+ * A sequence of LDR readings (one every LDR_READING_PERIOD) and the reading
+ * indices at which the boiler's indicator changes (starting off).
+ */
+struct LDRTrace {
+	const char *name;
+	std::vector<int> readings;
+	std::vector<size_t> changes;
+};
+
+/**
+ * Generate an hour of readings with the boiler switching on or off at random
+ * intervals of 20-120 seconds. reading(random, on, t) gives a reading t
+ * readings after the most recent change to the given state.
+ */
+template <typename Reading>
+LDRTrace make_ldr_trace(const char *name, Reading reading) {
+	BenchRandom random;
+	LDRTrace trace = {name, {}, {}};
+	size_t next_change = 20 * 1000 / LDR_READING_PERIOD;
+	bool on = false;
+	size_t last_change = 0;
+	for (size_t i = 0; i < LDR_TRACE_LENGTH; i++) {
+		if (i == next_change) {
+			trace.changes.push_back(i);
+			on = !on;
+			last_change = i;
+			next_change += (20 + random.next(100)) * 1000 / LDR_READING_PERIOD;
+		}
+		// NB: The initial state is treated as having been reached long ago
+		size_t t = trace.changes.empty() ? SIZE_MAX : i - last_change;
+		trace.readings.push_back(std::min(1023, std::max(0, reading(random, on, t))));
+	}
+	return trace;
+}
+
+std::vector<LDRTrace> make_ldr_traces() {
+	// NB: The LDR is inverted: a low reading means the boiler is on
+	std::vector<LDRTrace> traces;
+	
+	traces.push_back(make_ldr_trace("clean", [](BenchRandom &random, bool on, size_t t) {
+		return (on ? 300 : 900) + random.noise(10);
+	}));
+	
+	// Levels close to the water marks with plenty of noise
+	traces.push_back(make_ldr_trace("marginal", [](BenchRandom &random, bool on, size_t t) {
+		return (on ? LDR_LOW_WATER - 40 : LDR_HIGH_WATER + 40) + random.noise(80);
+	}));
+	
+	// Occasional single-reading spikes (e.g. a light being switched on nearby)
+	traces.push_back(make_ldr_trace("spiky", [](BenchRandom &random, bool on, size_t t) {
+		int spike = random.next(100) == 0 ? (on ? 500 : -500) : 0;
+		return (on ? 300 : 900) + spike + random.noise(10);
+	}));
+	
+	// The indicator fading between levels over one second
+	traces.push_back(make_ldr_trace("fading", [](BenchRandom &random, bool on, size_t t) {
+		int fade = 1000 / LDR_READING_PERIOD;
+		int progress = (int)std::min(t, (size_t)fade);
+		int from = on ? 900 : 300;
+		int to = on ? 300 : 900;
+		return from + (to - from) * progress / fade + random.noise(10);
+	}));
+	
+	return traces;
+}
+
+/**
+ * Print the number of transitions found and (if the true changes are known)
+ * the missed changes, false transitions and detection latency given the
+ * reading indices at which each transition was detected.
+ */
+void report_ldr_detection(const char *input, const char *detector,
+                          const std::vector<size_t> &detected, const std::vector<size_t> *changes) {
+	printf("{\"bench\": \"ldr_detection\", \"input\": \"%s\", \"detector\": \"%s\", \"transitions\": %zu",
+	       input, detector, detected.size());
+	if (changes) {
+		// A change is found by the first transition after it and before the
+		// next change.
+		size_t found = 0;
+		uint64_t total_latency_ms = 0;
+		uint64_t max_latency_ms = 0;
+		size_t d = 0;
+		for (size_t c = 0; c < changes->size(); c++) {
+			size_t next_change = c + 1 < changes->size() ? (*changes)[c + 1] : SIZE_MAX;
+			while (d < detected.size() && detected[d] < (*changes)[c]) {
+				d++;
+			}
+			if (d < detected.size() && detected[d] < next_change) {
+				uint64_t latency_ms = (detected[d] - (*changes)[c]) * LDR_READING_PERIOD;
+				total_latency_ms += latency_ms;
+				max_latency_ms = std::max(max_latency_ms, latency_ms);
+				found++;
+				d++;
+			}
+		}
+		printf(", \"changes\": %zu, \"missed\": %zu, \"false\": %zu, "
+		       "\"mean_latency_ms\": %.1f, \"max_latency_ms\": %llu",
+		       changes->size(), changes->size() - found, detected.size() - found,
+		       found ? (double)total_latency_ms / found : 0.0, (unsigned long long)max_latency_ms);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/**
+ * Replay readings through an LDRMonitor with the given oversampling and filter
+ * settings and report its transitions.
+ */
+void replay_ldr(const char *input, const char *detector,
+                const std::vector<int> &readings, const std::vector<size_t> *changes,
+                int oversample, int filter_shift) {
+	// NB: Run in a fresh boot since the monitor registers itself with the ADC
+	// service.
+	sim::boot([&]() {
+		LDRMonitor ldr(LDR_LOW_WATER, LDR_HIGH_WATER, LDR_INVERTED, LDR_SAMPLE_PERIOD,
+		               oversample, filter_shift, LDR_FILTER_SNAP);
+		
+		// With less oversampling, readings are taken less often
+		size_t stride = LDR_OVERSAMPLE / oversample;
+		
+		// NB: The first LDR_OVERSAMPLE readings initialise the monitor (its
+		// state is meaningless until then).
+		bool last_state = false;
+		std::vector<size_t> detected;
+		for (size_t i = 0; i < readings.size(); i++) {
+			sim::advance_ms(LDR_READING_PERIOD);
+			if (i % stride != stride - 1) {
+				continue;
+			}
+			ldr.add_sample(readings[i]);
+			if (i < LDR_OVERSAMPLE) {
+				last_state = ldr.get_state();
+			} else if (ldr.get_state() != last_state) {
+				last_state = ldr.get_state();
+				detected.push_back(i);
+			}
+		}
+		report_ldr_detection(input, detector, detected, changes);
+	});
+}
+
+/**
+ * Replay readings with the board's settings and with the single raw reading
+ * per sample period used before.
+ */
+void replay_ldr_detectors(const char *input, const std::vector<int> &readings,
+                          const std::vector<size_t> *changes) {
+	replay_ldr(input, "filtered", readings, changes, LDR_OVERSAMPLE, LDR_FILTER_SHIFT);
+	replay_ldr(input, "raw", readings, changes, 1, 0);
+}
+
+int main(int argc, char *argv[]) {
+	for (const LDRTrace &trace : make_ldr_traces()) {
+		replay_ldr_detectors(trace.name, trace.readings, &trace.changes);
+	}
+	for (int i = 1; i < argc; i++) {
+		replay_ldr_detectors(argv[i], trace_channel(load_trace(argv[i]), 0), NULL);
+	}
+	
+	setup();
+	
+	// Let the controller settle into its idle state
+	sim::adc_value = LDR_LOW_WATER;
+	sim::run(loop, 10 * 1000);
+	
+	for (size_t iterations : iteration_counts) {
+		bench("hot_water_controller_loop", "synthetic", iterations, iterations, [&]() {
+			for (size_t i = 0; i < iterations; i++) {
+				controller.loop();
+				sim::advance_us(1000);
+			}
+		});
+	}
+	
+	BenchRandom random;
+	std::vector<int> readings;
+	for (size_t i = 0; i < 1000; i++) {
+		readings.push_back(LDR_LOW_WATER + random.noise(10));
+	}
+	for (size_t iterations : iteration_counts) {
+		bench_loop("synthetic", readings, iterations);
+	}
+	
+	for (int i = 1; i < argc; i++) {
+		bench_loop(argv[i], trace_channel(load_trace(argv[i]), 0), iteration_counts[1]);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * The bathroom board in the multi-board load test (see load.h): a boiler
+ * whose hot water indicator responds to the button being pressed (the broker
+ * switches heating/hot_water, see load_broker.cpp).
+ */
+
+#define BOARD_LOAD
+
+#include "../bathroom_board/src/main.cpp"
+
+#include "load.h"
+
+const char *load_board_name = "bathroom_board";
+
+// Time (ms) the button must be held for the boiler to respond
+#define LOAD_BOILER_RESPONSE_MS 300
+
+bool boiler_on = false;
+bool boiler_pressed = false;
+bool boiler_toggled = false;
+uint64_t boiler_press_ns;
+
+void load_traffic_begin() {
+	sim::servo_hook = [](int angle) {
+		bool pressed = angle == SERVO_PRESSED_ANGLE;
+		if (pressed && !boiler_pressed) {
+			boiler_press_ns = sim::now_ns();
+			boiler_toggled = false;
+		}
+		boiler_pressed = pressed;
+	};
+	sim::adc_source = []() {
+		if (boiler_pressed && !boiler_toggled &&
+		    sim::now_ns() - boiler_press_ns >= LOAD_BOILER_RESPONSE_MS * 1000000ull) {
+			boiler_on = !boiler_on;
+			boiler_toggled = true;
+		}
+		// NB: The LDR is inverted
+		return boiler_on ? LDR_LOW_WATER - 200 : LDR_HIGH_WATER + 100;
+	};
+}
+
+void load_traffic_loop() {
+}
+
+int main(int argc, char *argv[]) {
+	return load_board_main(argc, argv);
+}
@@ -0,0 +1,599 @@
+/**
+ * Tests for the bathroom board, built from its unmodified src/main.cpp.
+ */
+
+#include <sys/mman.h>
+
+#include "../bathroom_board/src/main.cpp"
+
+#include "test.h"
+
+TEST(bathroom_board_boots) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 2 * METRICS_PUBLISH_PERIOD);
+		CHECK(sim::qth_is_registered("heating/hot_water"));
+		CHECK(sim::qth_last("sys/nodemcu_bathroom_board/metrics"));
+	}));
+}
+
+TEST(setup_does_not_allocate) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		uint64_t allocations = sim::heap_allocations;
+		uint64_t bytes = sim::heap_bytes;
+		setup();
+		CHECK_EQ(sim::heap_allocations - allocations, 0);
+		CHECK_EQ(sim::heap_bytes - bytes, 0);
+	}));
+}
+
+/**
+ * A simulated boiler whose hot water indicator (seen by the LDR) toggles once
+ * the button has been held by the servo for boiler_response_ms.
+ */
+bool boiler_on = false;
+unsigned long boiler_response_ms = 300;
+uint64_t boiler_press_ns = 0;
+bool boiler_pressed = false;
+bool boiler_toggled = false;
+int boiler_presses = 0;
+
+void boiler_begin(bool on = false) {
+	boiler_on = on;
+	boiler_pressed = false;
+	sim::servo_hook = [](int angle) {
+		bool pressed = angle == SERVO_PRESSED_ANGLE;
+		if (pressed && !boiler_pressed) {
+			boiler_press_ns = sim::now_ns();
+			boiler_toggled = false;
+			boiler_presses++;
+		}
+		boiler_pressed = pressed;
+	};
+	sim::adc_source = []() {
+		if (boiler_pressed && !boiler_toggled &&
+		    sim::now_ns() - boiler_press_ns >= boiler_response_ms * 1000000ull) {
+			boiler_on = !boiler_on;
+			boiler_toggled = true;
+		}
+		// NB: The LDR is inverted (a low reading means the boiler is on)
+		return boiler_on ? LDR_LOW_WATER - 200 : LDR_HIGH_WATER + 100;
+	};
+}
+
+/**
+ * Ask for hot water and wait for the controller to act on it. If the boiler is
+ * already on it is first switched off by hand (so a press is always needed).
+ */
+void request_hot_water() {
+	boiler_on = false;
+	sim::run(loop, 5 * 1000);
+	sim::qth_set_property(QTH_PREFIX, "true");
+	sim::run(loop, RATE_LIMIT);
+}
+
+TEST(change_budget_survives_power_loss) {
+	sim::erase_all();
+	
+	// The budget is used up without the commanded state ever changing
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, 5 * 1000);
+		for (int i = 0; i < N_CHANGES - 1; i++) {
+			request_hot_water();
+		}
+		CHECK_EQ(boiler_presses, N_CHANGES - 1);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"), "null");
+	}));
+	sim::power_off();
+	
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin(true);
+		setup();
+		sim::run(loop, 5 * 1000);
+		
+		// One change remains...
+		request_hot_water();
+		CHECK_EQ(boiler_presses, 1);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"), "null");
+		
+		// ...and no more
+		request_hot_water();
+		CHECK_EQ(boiler_presses, 1);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"), "\"FATAL: Rate limit reached.\"");
+	}));
+}
+
+TEST(change_budget_survives_immediate_power_loss) {
+	sim::erase_all();
+	
+	// Power is lost just after the final change is used
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, 5 * 1000);
+		for (int i = 0; i < N_CHANGES - 1; i++) {
+			request_hot_water();
+		}
+		boiler_on = false;
+		sim::run(loop, 5 * 1000);
+		sim::qth_set_property(QTH_PREFIX, "true");
+		sim::run(loop, 200);
+		CHECK_EQ(boiler_presses, N_CHANGES);
+	}));
+	sim::power_off();
+	
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, 5 * 1000);
+		request_hot_water();
+		CHECK_EQ(boiler_presses, 0);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"), "\"FATAL: Rate limit reached.\"");
+	}));
+}
+
+TEST(fault_survives_immediate_power_loss) {
+	sim::erase_all();
+	
+	// The boiler never responds to the button
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		boiler_response_ms = 24 * 60 * 60 * 1000ul;
+		setup();
+		sim::run(loop, 5 * 1000);
+		
+		sim::qth_set_property(QTH_PREFIX, "true");
+		for (int i = 0; i < 600 && strcmp(sim::qth_last(QTH_PREFIX"/fault"), "null") == 0; i++) {
+			sim::run(loop, 100);
+		}
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"),
+		             "\"FATAL: Button press failed to change boiler state.\"");
+		
+		// The power is lost well within STORAGE_QUIET_PERIOD
+		sim::run(loop, 100);
+	}));
+	sim::power_off();
+	
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, 1000);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"),
+		             "\"FATAL: Button press failed to change boiler state (before reset).\"");
+	}));
+}
+
+TEST(fault_survives_power_loss_during_commit) {
+	// Cut the power before each flash erase and write of a later commit in
+	// turn until it completes.
+	for (int n = 0; ; n++) {
+		sim::erase_all();
+		CHECK_BOOT(sim::boot([]() {
+			boiler_begin();
+			boiler_response_ms = 24 * 60 * 60 * 1000ul;
+			setup();
+			sim::run(loop, 5 * 1000);
+			sim::qth_set_property(QTH_PREFIX, "true");
+			sim::run(loop, 60 * 1000);
+			CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"),
+			             "\"FATAL: Button press failed to change boiler state.\"");
+		}));
+		sim::power_off();
+		
+		// A new command is persisted while still faulted
+		sim::BootResult result = sim::boot([n]() {
+			boiler_begin();
+			setup();
+			sim::run(loop, 1000);
+			sim::qth_set_property(QTH_PREFIX, "false");
+			sim::power_cut_after(n);
+			sim::run(loop, 2 * STORAGE_QUIET_PERIOD);
+		});
+		CHECK_BOOT(result);
+		sim::power_off();
+		
+		CHECK_BOOT(sim::boot([]() {
+			boiler_begin();
+			setup();
+			sim::run(loop, 1000);
+			CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"),
+			             "\"FATAL: Button press failed to change boiler state (before reset).\"");
+		}));
+		
+		if (!result.power_cut) {
+			CHECK(n > 0);
+			break;
+		}
+	}
+}
+
+TEST(restored_command_does_not_press_before_ldr_is_read) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, 5 * 1000);
+		sim::qth_set_property(QTH_PREFIX, "false");
+		sim::run(loop, 5 * 1000);
+		CHECK_EQ(boiler_presses, 0);
+	}));
+	
+	// A reset (RTC memory kept) with the boiler still off
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, RATE_LIMIT);
+		CHECK_EQ(boiler_presses, 0);
+		CHECK_EQ(controller.get_n_failed_presses(), 0);
+		for (const sim::QthMessage &message : sim::qth_sent(QTH_PREFIX"/actual-state")) {
+			CHECK_STR_EQ(message.value.c_str(), "false");
+		}
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/actual-state"), "false");
+	}));
+}
+
+TEST(loop_stays_responsive_during_actuation) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		setup();
+		sim::run(loop, 5 * 1000);
+		
+		sim::qth_set_property(QTH_PREFIX, "true");
+		sim::LoopStats stats = sim::run(loop, 10 * 1000);
+		CHECK(boiler_on);
+		CHECK_EQ(boiler_presses, 1);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/actual-state"), "true");
+		CHECK(stats.max_iteration_us < 2000);
+		printf("  max loop iteration while actuating: %llu us\n",
+		       (unsigned long long)stats.max_iteration_us);
+		
+		// Calibration moves are non-blocking too
+		sim::qth_send_event(QTH_PREFIX"/move-servo", "45");
+		stats = sim::run(loop, 5 * 1000);
+		CHECK(stats.max_iteration_us < 2000);
+	}));
+}
+
+/**
+ * Make controller_millis() wrap around (like the 32-bit millis() on the real
+ * board) wrap_after_ms from now.
+ */
+uint32_t wrapped_millis_offset;
+
+unsigned long wrapped_millis() {
+	return (uint32_t)(millis() + wrapped_millis_offset);
+}
+
+void wrap_controller_millis(unsigned long wrap_after_ms) {
+	wrapped_millis_offset = (uint32_t)(0 - millis() - wrap_after_ms);
+	controller_millis = wrapped_millis;
+}
+
+TEST(timeout_expires_across_millis_wraparound) {
+	CHECK_BOOT(sim::boot([]() {
+		wrap_controller_millis(1000);
+		Timeout timeout;
+		timeout.reset(5000);
+		sim::advance_ms(4999);
+		CHECK(!timeout.expired());
+		sim::advance_ms(1);
+		CHECK(timeout.expired());
+		
+		// A timeout longer than the time remaining before the wrap
+		timeout.reset(N_CHANGE_RATE_LIMIT);
+		sim::advance_ms(N_CHANGE_RATE_LIMIT - 1);
+		CHECK(!timeout.expired());
+		sim::advance_ms(1);
+		CHECK(timeout.expired());
+	}));
+}
+
+TEST(ldr_change_time_across_millis_wraparound) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		// Wrap around while the button is being pressed, before the boiler
+		// responds (and the LDR reading snaps to the new level)
+		boiler_begin();
+		wrap_controller_millis(5 * 1000 + 100);
+		setup();
+		sim::run(loop, 5 * 1000);
+		
+		sim::qth_set_property(QTH_PREFIX, "true");
+		sim::run(loop, 10 * 1000);
+		CHECK_EQ(boiler_presses, 1);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"), "null");
+		const char *response_ms = sim::qth_last(QTH_PREFIX"/response-time");
+		CHECK(response_ms);
+		if (response_ms) {
+			CHECK(strtoul(response_ms, NULL, 10) >= boiler_response_ms);
+			CHECK(atol(response_ms) < 1000);
+		}
+	}));
+}
+
+TEST(change_budget_resets_across_millis_wraparound) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		boiler_begin();
+		wrap_controller_millis(60 * 60 * 1000);
+		setup();
+		sim::run(loop, 5 * 1000);
+		for (int i = 0; i < N_CHANGES; i++) {
+			request_hot_water();
+		}
+		CHECK_EQ(boiler_presses, N_CHANGES);
+		
+		// The window ends after the wrap and the budget is restored
+		sim::run(loop, N_CHANGE_RATE_LIMIT, 100 * 1000);
+		request_hot_water();
+		CHECK_EQ(boiler_presses, N_CHANGES + 1);
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/fault"), "null");
+	}));
+}
+
+/**
+ * A scripted demand schedule spanning several days, with the board reset and
+ * losing power along the way.
+ */
+enum ScheduleAction {
+	SCHEDULE_COMMAND_ON,
+	SCHEDULE_COMMAND_OFF,
+	SCHEDULE_MANUAL_TOGGLE,  // Someone presses the boiler's button by hand
+	SCHEDULE_BOILER_STUCK,  // The boiler stops responding to the button...
+	SCHEDULE_BOILER_UNSTUCK,  // ...and starts again
+	SCHEDULE_CLEAR_FAULT,
+	SCHEDULE_RESET,  // RTC memory is kept
+	SCHEDULE_POWER_LOSS,
+};
+
+struct ScheduleStep {
+	uint32_t time_s;
+	ScheduleAction action;
+};
+
+#define SCHEDULE_DAYS 3
+
+std::vector<ScheduleStep> make_schedule() {
+	std::vector<ScheduleStep> steps;
+	auto at = [&](int day, int h, int m, int s, ScheduleAction action) {
+		steps.push_back({(uint32_t)(((day * 24 + h) * 60 + m) * 60 + s), action});
+	};
+	
+	for (int day = 0; day < SCHEDULE_DAYS; day++) {
+		at(day, 6, 0, 0, SCHEDULE_COMMAND_ON);
+		at(day, 6, 40, 0, SCHEDULE_COMMAND_OFF);
+		at(day, 8, 0, 0, SCHEDULE_MANUAL_TOGGLE);
+		at(day, 8, 30, 0, SCHEDULE_MANUAL_TOGGLE);
+		at(day, 17, 30, 0, SCHEDULE_COMMAND_ON);
+		at(day, 18, 15, 0, SCHEDULE_COMMAND_OFF);
+		at(day, 21, 0, 0, SCHEDULE_COMMAND_ON);
+		at(day, 21, 20, 0, SCHEDULE_COMMAND_OFF);
+	}
+	
+	// Day 0: power lost mid-press and a flapping demand which uses up the
+	// change budget (with a reset part way through).
+	at(0, 6, 0, 1, SCHEDULE_POWER_LOSS);
+	for (int i = 0; i < 30; i++) {
+		at(0, 10, 0, i * 40, i % 2 ? SCHEDULE_COMMAND_OFF : SCHEDULE_COMMAND_ON);
+	}
+	at(0, 10, 5, 1, SCHEDULE_RESET);
+	at(0, 11, 0, 0, SCHEDULE_CLEAR_FAULT);
+	
+	// Day 1: the boiler stops responding (a fault), is fixed and the fault is
+	// cleared. Power is lost just after a press and the board is reset just
+	// before midnight.
+	at(1, 12, 0, 0, SCHEDULE_BOILER_STUCK);
+	at(1, 12, 0, 10, SCHEDULE_COMMAND_ON);
+	at(1, 12, 30, 0, SCHEDULE_BOILER_UNSTUCK);
+	at(1, 12, 31, 0, SCHEDULE_CLEAR_FAULT);
+	at(1, 12, 32, 0, SCHEDULE_COMMAND_ON);
+	at(1, 12, 50, 0, SCHEDULE_COMMAND_OFF);
+	at(1, 17, 30, 2, SCHEDULE_POWER_LOSS);
+	at(1, 23, 59, 50, SCHEDULE_RESET);
+	
+	// Day 2: a reset just after a press completes, another burst of flapping
+	// interrupted by a power loss and a power loss during the evening
+	at(2, 6, 0, 3, SCHEDULE_RESET);
+	for (int i = 0; i < 15; i++) {
+		at(2, 14, 0, i * 40, i % 2 ? SCHEDULE_COMMAND_OFF : SCHEDULE_COMMAND_ON);
+	}
+	at(2, 14, 5, 3, SCHEDULE_POWER_LOSS);
+	at(2, 15, 0, 0, SCHEDULE_CLEAR_FAULT);
+	at(2, 21, 0, 5, SCHEDULE_POWER_LOSS);
+	
+	std::stable_sort(steps.begin(), steps.end(), [](const ScheduleStep &a, const ScheduleStep &b) {
+		return a.time_s < b.time_s;
+	});
+	return steps;
+}
+
+/**
+ * State of the schedule shared between the boots (which run in separate
+ * processes), including the real world (the boiler) and the history of
+ * presses against which the invariants are checked. Times are ms since the
+ * start of the schedule.
+ */
+struct ScheduleState {
+	size_t next_step;
+	uint64_t boot_start_ms;
+	bool power_loss;
+	
+	bool boiler_on;
+	bool boiler_stuck;
+	uint64_t last_toggle_ms;
+	
+	// Presses which start a change (rather than retrying one)
+	int n_change_presses;
+	uint64_t last_change_press_ms;
+	// Change presses since the budget was last refilled and when the current
+	// N_CHANGE_RATE_LIMIT window started
+	int budget_used;
+	uint64_t window_start_ms;
+	
+	int n_presses;
+	int n_retries;
+};
+
+ScheduleState *schedule;
+
+// Step (ms) between loop() calls and the interval at which invariants are
+// checked (besides on every press)
+#define SCHEDULE_LOOP_STEP_US (10 * 1000)
+#define SCHEDULE_CHECK_PERIOD (60 * 1000)
+
+// Time (ms) allowed for a change of the boiler's state to be reported
+#define SCHEDULE_REPORT_DELAY 2000
+
+uint64_t schedule_now_ms() {
+	return schedule->boot_start_ms + sim::now_ns() / 1000000ull;
+}
+
+bool is_faulted() {
+	const char *fault = sim::qth_last(QTH_PREFIX"/fault");
+	return fault && strcmp(fault, "null") != 0;
+}
+
+/**
+ * Refill the modelled change budget at the end of each N_CHANGE_RATE_LIMIT
+ * window.
+ */
+void schedule_refill_budget() {
+	while (schedule_now_ms() - schedule->window_start_ms >= N_CHANGE_RATE_LIMIT) {
+		schedule->window_start_ms += N_CHANGE_RATE_LIMIT;
+		schedule->budget_used = 0;
+	}
+}
+
+void schedule_check_state() {
+	schedule_refill_budget();
+	if (schedule_now_ms() - schedule->last_toggle_ms >= SCHEDULE_REPORT_DELAY &&
+	    sim::now_ns() >= SCHEDULE_REPORT_DELAY * 1000000ull) {
+		CHECK_STR_EQ(sim::qth_last(QTH_PREFIX"/actual-state"), schedule->boiler_on ? "true" : "false");
+	}
+}
+
+void schedule_boot() {
+	bool pressed = false;
+	uint64_t press_ms = 0;
+	bool toggled = false;
+	uint32_t last_retries = 0;
+	sim::servo_hook = [&](int angle) {
+		bool now_pressed = angle == SERVO_PRESSED_ANGLE;
+		if (now_pressed && !pressed) {
+			press_ms = schedule_now_ms();
+			toggled = false;
+			schedule->n_presses++;
+			
+			CHECK(!is_faulted());
+			bool retry = metrics.get(METRIC_SERVO_RETRIES) != last_retries;
+			last_retries = metrics.get(METRIC_SERVO_RETRIES);
+			if (retry) {
+				schedule->n_retries++;
+			} else {
+				schedule_refill_budget();
+				CHECK(schedule->budget_used < N_CHANGES);
+				CHECK(schedule->n_change_presses == 0 ||
+				      press_ms - schedule->last_change_press_ms >= RATE_LIMIT);
+				schedule->budget_used++;
+				schedule->n_change_presses++;
+				schedule->last_change_press_ms = press_ms;
+			}
+		}
+		pressed = now_pressed;
+	};
+	sim::adc_source = [&]() {
+		if (pressed && !toggled && !schedule->boiler_stuck &&
+		    schedule_now_ms() - press_ms >= boiler_response_ms) {
+			schedule->boiler_on = !schedule->boiler_on;
+			schedule->last_toggle_ms = schedule_now_ms();
+			toggled = true;
+		}
+		return schedule->boiler_on ? LDR_LOW_WATER - 200 : LDR_HIGH_WATER + 100;
+	};
+	
+	setup();
+	// NB: The controller's window starts with its first loop()
+	schedule->window_start_ms = schedule_now_ms();
+	
+	std::vector<ScheduleStep> steps = make_schedule();
+	while (schedule->next_step < steps.size()) {
+		const ScheduleStep &step = steps[schedule->next_step];
+		uint64_t step_ms = step.time_s * 1000ull;
+		while (schedule_now_ms() < step_ms) {
+			uint64_t ms = std::min((uint64_t)SCHEDULE_CHECK_PERIOD, step_ms - schedule_now_ms());
+			sim::run(loop, ms, SCHEDULE_LOOP_STEP_US);
+			schedule_check_state();
+		}
+		schedule->next_step++;
+		
+		switch (step.action) {
+			case SCHEDULE_COMMAND_ON:
+				sim::qth_set_property(QTH_PREFIX, "true");
+				break;
+			case SCHEDULE_COMMAND_OFF:
+				sim::qth_set_property(QTH_PREFIX, "false");
+				break;
+			case SCHEDULE_MANUAL_TOGGLE:
+				schedule->boiler_on = !schedule->boiler_on;
+				schedule->last_toggle_ms = schedule_now_ms();
+				break;
+			case SCHEDULE_BOILER_STUCK:
+				schedule->boiler_stuck = true;
+				break;
+			case SCHEDULE_BOILER_UNSTUCK:
+				schedule->boiler_stuck = false;
+				break;
+			case SCHEDULE_CLEAR_FAULT:
+				sim::qth_send_event(QTH_PREFIX"/clear-fault", "null");
+				schedule->budget_used = 0;
+				schedule->window_start_ms = schedule_now_ms();
+				break;
+			case SCHEDULE_POWER_LOSS:
+				schedule->power_loss = true;
+				// Fall through
+			case SCHEDULE_RESET:
+				schedule->boot_start_ms = schedule_now_ms();
+				return;
+		}
+	}
+	
+	// Run out the final day
+	while (schedule_now_ms() < SCHEDULE_DAYS * 24 * 60 * 60 * 1000ull) {
+		sim::run(loop, SCHEDULE_CHECK_PERIOD, SCHEDULE_LOOP_STEP_US);
+		schedule_check_state();
+	}
+	schedule->next_step = SIZE_MAX;
+}
+
+TEST(scripted_schedule_keeps_invariants) {
+	// NB: Shared with (and updated by) the boots
+	schedule = (ScheduleState *)mmap(NULL, sizeof(ScheduleState), PROT_READ | PROT_WRITE,
+	                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	memset(schedule, 0, sizeof(*schedule));
+	
+	sim::erase_all();
+	int n_boots = 0;
+	while (schedule->next_step != SIZE_MAX) {
+		CHECK_BOOT(sim::boot(schedule_boot));
+		n_boots++;
+		if (schedule->power_loss) {
+			sim::power_off();
+			schedule->power_loss = false;
+		}
+		if (test_failures) {
+			break;
+		}
+	}
+	
+	printf("  %d boots, %d presses (%d changes, %d retries)\n",
+	       n_boots, schedule->n_presses, schedule->n_change_presses, schedule->n_retries);
+	CHECK_EQ(n_boots, 8);
+	CHECK(schedule->n_retries > 0);
+	CHECK(schedule->n_change_presses >= 2 * 2 * SCHEDULE_DAYS);
+	munmap(schedule, sizeof(ScheduleState));
+}
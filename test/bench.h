@@ -0,0 +1,143 @@
+/**
+ * Helpers for the host-side benchmarks.
+ *
+ * Each benchmark prints one JSON object per line:
+ *
+ *     {"bench": "find_rx_code", "input": "synthetic", "size": 32, "ops": 4096000, "ns_per_op": 11.2}
+ *
+ * Where "input" is "synthetic" or the path of a recorded input and "size" is
+ * the size of the input (meaning depends on the benchmark). Times are host
+ * wall-clock times and so are only meaningful relative to one another.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "sim.h"
+
+// Minimum wall-clock time (s) each benchmark is run for
+#define BENCH_MIN_SECONDS 0.2
+
+/**
+ * Call fn (which performs ops_per_call operations) repeatedly for at least
+ * BENCH_MIN_SECONDS and print the mean time per operation.
+ */
+template <typename F>
+void bench(const char *name, const char *input, size_t size, uint64_t ops_per_call, F fn) {
+	typedef std::chrono::steady_clock clock;
+	uint64_t ops = 0;
+	clock::time_point start = clock::now();
+	double elapsed;
+	do {
+		fn();
+		ops += ops_per_call;
+		elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	} while (elapsed < BENCH_MIN_SECONDS);
+	
+	printf("{\"bench\": \"%s\", \"input\": \"%s\", \"size\": %zu, \"ops\": %llu, \"ns_per_op\": %.1f}\n",
+	       name, input, size, (unsigned long long)ops, (elapsed * 1e9) / ops);
+	fflush(stdout);
+}
+
+/**
+ * A sample from a trace CSV (as produced by common/trace_capture.py).
+ */
+struct TraceSample {
+	uint64_t time_ms;
+	int channel;
+	int value;
+};
+
+/**
+ * Load a trace CSV (time_ms,channel,value with an optional header line).
+ * Exits if the file cannot be read.
+ */
+static inline std::vector<TraceSample> load_trace(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	std::vector<TraceSample> samples;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long time_ms;
+		int channel;
+		int value;
+		if (sscanf(line, "%llu,%d,%d", &time_ms, &channel, &value) == 3) {
+			samples.push_back({time_ms, channel, value});
+		}
+	}
+	fclose(f);
+	return samples;
+}
+
+/**
+ * The values of one channel of a trace.
+ */
+static inline std::vector<int> trace_channel(const std::vector<TraceSample> &trace, int channel) {
+	std::vector<int> values;
+	for (const TraceSample &sample : trace) {
+		if (sample.channel == channel) {
+			values.push_back(sample.value);
+		}
+	}
+	return values;
+}
+
+/**
+ * Load a whole file into a string. Exits if the file cannot be read.
+ */
+static inline std::string load_file(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	std::string contents;
+	char buf[256];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		contents.append(buf, n);
+	}
+	fclose(f);
+	return contents;
+}
+
+/**
+ * A deterministic pseudo-random number generator for synthetic inputs.
+ */
+class BenchRandom {
+	public:
+		BenchRandom(uint32_t seed = 1)
+			: state(seed)
+		{
+		}
+		
+		/**
+		 * Uniformly distributed in [0, n).
+		 */
+		uint32_t next(uint32_t n) {
+			state = state * 1664525u + 1013904223u;
+			return (state >> 8) % n;
+		}
+		
+		/**
+		 * Uniformly distributed in [-spread, spread].
+		 */
+		int noise(int spread) {
+			return (int)next(2 * spread + 1) - spread;
+		}
+	
+	private:
+		uint32_t state;
+};
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * Benchmarks for the doorbell board's running median of the ADC value while
+ * pressed (P2Quantile), compared with the 4 KB histogram it replaced:
+ *
+ * * "doorbell_median": time per sample.
+ * * "doorbell_median_ram": RAM used by each estimator.
+ * * "doorbell_median_accuracy": error of each estimator relative to the exact
+ *   median of each press.
+ *
+ * Usage:
+ *
+ *     ./doorbell_bench [trace.csv ...]
+ *
+ * Presses in recorded traces (channel 0 at or above adc_pressed_threshold)
+ * are replayed too.
+ */
+
+#include "../doorbell/src/main.cpp"
+
+#include "bench.h"
+
+// Press lengths (samples)
+const size_t press_lengths[] = {16, 256, 4096};
+
+// Number of presses in each synthetic accuracy trace
+#define NUM_PRESSES 200
+
+// Benchmarked results are written here so they are not optimised away
+volatile float sink;
+
+/**
+ * The median estimate used before P2Quantile: a histogram of every possible
+ * ADC value.
+ */
+class HistogramMedian {
+	public:
+		void reset() {
+			for (int i = 0; i < adc_max + 1; i++) {
+				histogram[i] = 0;
+			}
+			count = 0;
+		}
+		
+		void add(int adc) {
+			histogram[adc <= adc_max ? adc : adc_max] += 1;
+			count++;
+		}
+		
+		int get_median() const {
+			int median = 0;
+			int cum_sum = 0;
+			while (cum_sum < count / 2) {
+				cum_sum += histogram[median++];
+			}
+			return median;
+		}
+	
+	private:
+		int histogram[adc_max + 1];
+		int count;
+};
+
+/**
+ * The exact median of a press (the mean of the middle two samples if there
+ * are an even number).
+ */
+float exact_median(std::vector<int> press) {
+	size_t middle = press.size() / 2;
+	std::nth_element(press.begin(), press.begin() + middle, press.end());
+	float median = press[middle];
+	if (press.size() % 2 == 0) {
+		median = (median + *std::max_element(press.begin(), press.begin() + middle)) / 2;
+	}
+	return median;
+}
+
+/**
+ * Time estimating the median of each press (a sequence of ADC values).
+ */
+void bench_median(const char *input, const std::vector<std::vector<int>> &presses) {
+	size_t num_samples = 0;
+	for (const std::vector<int> &press : presses) {
+		num_samples += press.size();
+	}
+	if (!num_samples) {
+		return;
+	}
+	
+	P2Quantile median(0.5);
+	bench("doorbell_median", input, num_samples / presses.size(), num_samples, [&]() {
+		for (const std::vector<int> &press : presses) {
+			median.reset();
+			for (int adc : press) {
+				median.add(adc);
+			}
+			sink = median.get_quantile();
+		}
+	});
+	
+	static HistogramMedian histogram;
+	bench("doorbell_median_histogram", input, num_samples / presses.size(), num_samples, [&]() {
+		for (const std::vector<int> &press : presses) {
+			histogram.reset();
+			for (int adc : press) {
+				histogram.add(adc);
+			}
+			sink = histogram.get_median();
+		}
+	});
+}
+
+/**
+ * Print the mean and maximum absolute error (ADC counts) of both estimators
+ * over a series of presses.
+ */
+void report_accuracy(const char *input, const std::vector<std::vector<int>> &presses) {
+	if (presses.empty()) {
+		return;
+	}
+	
+	static HistogramMedian histogram;
+	P2Quantile median(0.5);
+	double p2_total = 0;
+	double p2_max = 0;
+	double histogram_total = 0;
+	double histogram_max = 0;
+	for (const std::vector<int> &press : presses) {
+		median.reset();
+		histogram.reset();
+		for (int adc : press) {
+			median.add(adc);
+			histogram.add(adc);
+		}
+		float exact = exact_median(press);
+		double p2_error = fabs(median.get_quantile() - exact);
+		double histogram_error = fabs(histogram.get_median() - exact);
+		p2_total += p2_error;
+		p2_max = std::max(p2_max, p2_error);
+		histogram_total += histogram_error;
+		histogram_max = std::max(histogram_max, histogram_error);
+	}
+	
+	printf("{\"bench\": \"doorbell_median_accuracy\", \"input\": \"%s\", \"estimator\": \"p2quantile\", "
+	       "\"presses\": %zu, \"mean_abs_error\": %.2f, \"max_abs_error\": %.2f}\n",
+	       input, presses.size(), p2_total / presses.size(), p2_max);
+	printf("{\"bench\": \"doorbell_median_accuracy\", \"input\": \"%s\", \"estimator\": \"histogram\", "
+	       "\"presses\": %zu, \"mean_abs_error\": %.2f, \"max_abs_error\": %.2f}\n",
+	       input, presses.size(), histogram_total / presses.size(), histogram_max);
+	fflush(stdout);
+}
+
+/**
+ * Generate NUM_PRESSES presses of 10-300 samples (0.1-3 s). sample(random, i,
+ * length) gives the ith ADC value of a press.
+ */
+template <typename Sample>
+std::vector<std::vector<int>> make_presses(Sample sample) {
+	BenchRandom random;
+	std::vector<std::vector<int>> presses(NUM_PRESSES);
+	for (std::vector<int> &press : presses) {
+		size_t length = 10 + random.next(291);
+		for (size_t i = 0; i < length; i++) {
+			press.push_back(std::min(adc_max, std::max(0, sample(random, i, length))));
+		}
+	}
+	return presses;
+}
+
+int main(int argc, char *argv[]) {
+	printf("{\"bench\": \"doorbell_median_ram\", \"estimator\": \"p2quantile\", \"bytes\": %zu}\n",
+	       sizeof(P2Quantile));
+	printf("{\"bench\": \"doorbell_median_ram\", \"estimator\": \"histogram\", \"bytes\": %zu}\n",
+	       sizeof(HistogramMedian));
+	
+	BenchRandom random;
+	for (size_t length : press_lengths) {
+		// A battery sagging slightly during the press, plus noise
+		std::vector<std::vector<int>> presses(1);
+		for (size_t i = 0; i < length; i++) {
+			presses[0].push_back(700 - (int)(20 * i / length) + random.noise(15));
+		}
+		bench_median("synthetic", presses);
+	}
+	
+	report_accuracy("steady", make_presses([](BenchRandom &random, size_t i, size_t length) {
+		return 700 + random.noise(5);
+	}));
+	
+	// The voltage sagging under load during the press
+	report_accuracy("sagging", make_presses([](BenchRandom &random, size_t i, size_t length) {
+		return 720 - (int)(40 * i / length) + random.noise(5);
+	}));
+	
+	// Contact bounce at the start of the press
+	report_accuracy("bouncy", make_presses([](BenchRandom &random, size_t i, size_t length) {
+		return (i < 5 ? 100 + (int)random.next(600) : 700) + random.noise(5);
+	}));
+	
+	report_accuracy("noisy", make_presses([](BenchRandom &random, size_t i, size_t length) {
+		return 700 + random.noise(60);
+	}));
+	
+	for (int i = 1; i < argc; i++) {
+		std::vector<std::vector<int>> presses;
+		bool pressed = false;
+		for (int adc : trace_channel(load_trace(argv[i]), 0)) {
+			if (adc >= adc_pressed_threshold) {
+				if (!pressed) {
+					presses.emplace_back();
+				}
+				presses.back().push_back(adc <= adc_max ? adc : adc_max);
+			}
+			pressed = adc >= adc_pressed_threshold;
+		}
+		bench_median(argv[i], presses);
+		report_accuracy(argv[i], presses);
+	}
+	
+	return 0;
+}
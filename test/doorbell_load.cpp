@@ -0,0 +1,25 @@
+/**
+ * The doorbell in the multi-board load test (see load.h): a half-second
+ * press every five seconds.
+ */
+
+#define BOARD_LOAD
+
+#include "../doorbell/src/main.cpp"
+
+#include "load.h"
+
+const char *load_board_name = "doorbell";
+
+void load_traffic_begin() {
+	sim::adc_source = []() {
+		return (sim::now_ns() / 1000000ull) % 5000 < 500 ? 700 : 10;
+	};
+}
+
+void load_traffic_loop() {
+}
+
+int main(int argc, char *argv[]) {
+	return load_board_main(argc, argv);
+}
@@ -0,0 +1,139 @@
+/**
+ * Tests for the doorbell board, built from its unmodified src/main.cpp.
+ */
+
+#include "../doorbell/src/main.cpp"
+
+#include "test.h"
+
+TEST(doorbell_boots) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 2 * METRICS_PUBLISH_PERIOD);
+		CHECK(sim::qth_last("sys/nodemcu_doorbell/metrics"));
+	}));
+}
+
+TEST(latency_histogram_json_fits) {
+	LatencyHistogram histogram;
+	for (int i = 0; i < LatencyHistogram::NUM_BUCKETS; i++) {
+		histogram.add((1000ul << i) - 1);
+	}
+	histogram.add(0xFFFFFFFFul);
+	
+	char buf[LatencyHistogram::JSON_LENGTH];
+	CHECK(histogram.to_json(buf, sizeof(buf)));
+	CHECK_STR_EQ(buf,
+		"{\"le_ms\":[1,2,4,8,16,32,64,128,256,null],"
+		"\"counts\":[1,1,1,1,1,1,1,1,1,2],"
+		"\"last_us\":4294967295,\"max_us\":4294967295}");
+	
+	// With every count at its maximum (ten digits rather than one)
+	size_t worst_length = strlen(buf) + LatencyHistogram::NUM_BUCKETS * 9;
+	CHECK(worst_length < LatencyHistogram::JSON_LENGTH);
+	
+	// Truncation is reported
+	CHECK(!histogram.to_json(buf, strlen(buf)));
+	CHECK(!histogram.to_json(buf, strlen(buf) / 8));
+}
+
+TEST(metrics_json_fits) {
+	Metrics counters;
+	for (int i = 0; i < NUM_METRICS; i++) {
+		counters.increment((Metric)i, 0xFFFFFFFFul);
+	}
+	char buf[METRICS_JSON_LENGTH];
+	CHECK(counters.to_json(buf, sizeof(buf)));
+}
+
+TEST(adc_counters_are_published_in_metrics) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 2 * METRICS_PUBLISH_PERIOD);
+		const char *json = sim::qth_last("sys/nodemcu_doorbell/metrics");
+		CHECK(json);
+		const char *conversions = json ? strstr(json, "\"adc_conversions\":") : NULL;
+		CHECK(conversions);
+		if (conversions) {
+			CHECK(atol(conversions + strlen("\"adc_conversions\":")) > 0);
+		}
+		CHECK(json && strstr(json, "\"adc_stalls\":"));
+		CHECK(json && strstr(json, "\"adc_late\":"));
+	}));
+}
+
+TEST(failed_storage_commit_is_counted_and_retried) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 1000);
+		
+		sim::flash_fail = true;
+		storage.put(0, (uint32_t)1234);
+		CHECK(!storage.flush());
+		CHECK_EQ(metrics.get(METRIC_STORAGE_COMMITS), 0);
+		CHECK_EQ(metrics.get(METRIC_STORAGE_FAILURES), 1);
+		
+		// Not retried on every loop...
+		sim::run(loop, STORAGE_QUIET_PERIOD / 2);
+		CHECK_EQ(metrics.get(METRIC_STORAGE_FAILURES), 1);
+		
+		// ...but once the quiet period has passed
+		sim::flash_fail = false;
+		sim::run(loop, STORAGE_QUIET_PERIOD);
+		CHECK_EQ(metrics.get(METRIC_STORAGE_COMMITS), 1);
+		CHECK_EQ(metrics.get(METRIC_STORAGE_FAILURES), 1);
+	}));
+	sim::power_off();
+	
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		uint32_t value;
+		storage.get(0, value);
+		CHECK_EQ(value, 1234);
+	}));
+}
+
+TEST(restart_event_commits_storage) {
+	sim::erase_all();
+	sim::BootResult result = sim::boot([]() {
+		setup();
+		sim::run(loop, 1000);
+		storage.put(0, (uint32_t)1234);
+		sim::qth_send_event("sys/nodemcu_doorbell/restart", "null");
+		sim::run(loop, 1000);
+	});
+	CHECK_EQ(result.failures, 0);
+	CHECK(result.restarted);
+	sim::power_off();
+	
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		uint32_t value;
+		storage.get(0, value);
+		CHECK_EQ(value, 1234);
+		CHECK_EQ(metrics.get(METRIC_STORAGE_COMMITS), 0);
+	}));
+}
+
+TEST(restart_event_is_not_reported_as_stall) {
+	sim::erase_all();
+	sim::BootResult result = sim::boot([]() {
+		setup();
+		sim::run(loop, 1000);
+		sim::qth_send_event("sys/nodemcu_doorbell/restart", "null");
+		sim::run(loop, 1000);
+	});
+	CHECK_EQ(result.failures, 0);
+	CHECK(result.restarted);
+	
+	// NB: RTC memory (and so any watchdog breadcrumb) survives the restart
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		CHECK(!watchdog.has_report());
+		sim::run(loop, 1000);
+		CHECK_EQ(sim::qth_sent("sys/nodemcu_doorbell/stall_report").size(), 0);
+	}));
+}
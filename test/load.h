@@ -0,0 +1,292 @@
+/**
+ * Multi-board load test: shared protocol and the board side.
+ *
+ * load_broker (see load_broker.cpp) stands in for the Qth server. It starts N
+ * board processes (<board>_load, each running one board's unmodified
+ * src/main.cpp against the simulated ESP8266) which connect to it over a Unix
+ * socket. Each board's virtual clock is paced to the wall clock so that
+ * throughput and latencies are real. The board-specific part of each
+ * <board>_load.cpp generates the board's sensor inputs (meter pulses, button
+ * presses, 433 MHz codes, ...).
+ *
+ * Messages in both directions are frames: a LoadFrameHeader followed by the
+ * path and value. The sent_ns field holds the sender's steady_clock time so
+ * the receiver can measure the latency.
+ */
+
+#ifndef LOAD_H
+#define LOAD_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Frame types
+#define LOAD_FRAME_HELLO 0     // Board to broker: path = board name, value = index
+#define LOAD_FRAME_PROPERTY 1  // Either way: a property set
+#define LOAD_FRAME_EVENT 2     // Either way: an event
+#define LOAD_FRAME_STATS 3     // Board to broker: value = JSON (see load_board_main)
+
+// Time (ms) a board waits before reconnecting after being disconnected
+#define LOAD_RECONNECT_DELAY_MS 1000
+
+struct LoadFrameHeader {
+	uint32_t type;
+	uint32_t path_length;
+	uint32_t value_length;
+	uint32_t reserved;
+	uint64_t sent_ns;
+};
+
+struct LoadFrame {
+	uint32_t type;
+	std::string path;
+	std::string value;
+	uint64_t sent_ns;
+};
+
+/**
+ * Wall-clock time (ns) comparable between processes.
+ */
+static inline uint64_t load_wall_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Send a frame, returning false if the connection has gone.
+ */
+static inline bool load_send(int fd, uint32_t type, const std::string &path, const std::string &value) {
+	LoadFrameHeader header = {type, (uint32_t)path.size(), (uint32_t)value.size(), 0, load_wall_ns()};
+	std::string frame((const char *)&header, sizeof(header));
+	frame += path;
+	frame += value;
+	size_t sent = 0;
+	while (sent < frame.size()) {
+		ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
+
+/**
+ * Reassembles frames from a stream socket.
+ */
+class LoadFrameReader {
+	public:
+		/**
+		 * Read whatever is available (without blocking if nonblocking is set).
+		 * Returns false once the connection has been closed.
+		 */
+		bool read(int fd, bool nonblocking = true) {
+			char buf[4096];
+			ssize_t n = recv(fd, buf, sizeof(buf), nonblocking ? MSG_DONTWAIT : 0);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+				return false;
+			}
+			if (n > 0) {
+				buffer.append(buf, n);
+			}
+			return true;
+		}
+		
+		/**
+		 * Take the next complete frame (if any).
+		 */
+		bool next(LoadFrame &frame) {
+			LoadFrameHeader header;
+			if (buffer.size() < sizeof(header)) {
+				return false;
+			}
+			memcpy(&header, buffer.data(), sizeof(header));
+			size_t length = sizeof(header) + header.path_length + header.value_length;
+			if (buffer.size() < length) {
+				return false;
+			}
+			frame.type = header.type;
+			frame.path = buffer.substr(sizeof(header), header.path_length);
+			frame.value = buffer.substr(sizeof(header) + header.path_length, header.value_length);
+			frame.sent_ns = header.sent_ns;
+			buffer.erase(0, length);
+			return true;
+		}
+	
+	private:
+		std::string buffer;
+};
+
+/**
+ * Connect to the broker's socket (or return -1).
+ */
+static inline int load_connect(const char *socket_path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Percentiles of a set of samples as a JSON object.
+ */
+static inline std::string load_percentiles_json(std::vector<uint64_t> samples) {
+	if (samples.empty()) {
+		return "null";
+	}
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&](double p) {
+		return (unsigned long long)samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+	};
+	char buf[128];
+	snprintf(buf, sizeof(buf), "{\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+	         percentile(0.5), percentile(0.9), percentile(0.99),
+	         (unsigned long long)samples.back());
+	return buf;
+}
+
+#ifdef BOARD_LOAD
+
+#include "sim.h"
+
+// Defined by each <board>_load.cpp: the board's name (as used by the broker
+// to choose what to send it), a function called once after setup() to start
+// generating its inputs and one called after every loop().
+extern const char *load_board_name;
+void load_traffic_begin();
+void load_traffic_loop();
+
+/**
+ * Run the board against the broker. Usage:
+ *
+ *     <board>_load socket_path index duration_ms
+ *
+ * Once duration_ms of wall-clock time has passed a LOAD_FRAME_STATS frame is
+ * sent with the number of loop() iterations, the greatest lag (ms) of the
+ * virtual clock behind the wall clock, the board's dropped-event and reconnect
+ * counts and the latency (us) of every property set and event delivered from
+ * the broker.
+ */
+int load_board_main(int argc, char *argv[]) {
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s socket_path index duration_ms\n", argv[0]);
+		return 1;
+	}
+	const char *socket_path = argv[1];
+	std::string index = argv[2];
+	uint64_t duration_ns = strtoull(argv[3], NULL, 10) * 1000000ull;
+	
+	int fd = load_connect(socket_path);
+	if (fd < 0 || !load_send(fd, LOAD_FRAME_HELLO, load_board_name, index)) {
+		perror(socket_path);
+		return 1;
+	}
+	
+	LoadFrameReader reader;
+	std::vector<uint64_t> delivery_latencies_us;
+	uint64_t disconnected_ns = 0;
+	
+	sim::qth_transport = [&](const sim::QthMessage &message) {
+		uint32_t type = message.is_event ? LOAD_FRAME_EVENT : LOAD_FRAME_PROPERTY;
+		if (!load_send(fd, type, message.path, message.value)) {
+			sim::qth_connected = false;
+		}
+	};
+	sim::qth_poll = [&]() {
+		if (!sim::qth_connected) {
+			return;
+		}
+		if (!reader.read(fd)) {
+			sim::qth_connected = false;
+			return;
+		}
+		LoadFrame frame;
+		while (reader.next(frame)) {
+			delivery_latencies_us.push_back((load_wall_ns() - frame.sent_ns) / 1000ull);
+			if (frame.type == LOAD_FRAME_EVENT) {
+				sim::qth_send_event(frame.path.c_str(), frame.value.c_str());
+			} else {
+				sim::qth_set_property(frame.path.c_str(), frame.value.c_str());
+			}
+		}
+	};
+	
+	sim::erase_all();
+	setup();
+	load_traffic_begin();
+	
+	// Pace the virtual clock to the wall clock, one loop() per virtual ms
+	uint64_t iterations = 0;
+	uint64_t max_lag_ns = 0;
+	uint64_t wall_start_ns = load_wall_ns();
+	uint64_t sim_start_ns = sim::now_ns();
+	while (load_wall_ns() - wall_start_ns < duration_ns) {
+		uint64_t target_ns = sim_start_ns + (load_wall_ns() - wall_start_ns);
+		if (sim::now_ns() < target_ns) {
+			max_lag_ns = std::max(max_lag_ns, target_ns - sim::now_ns());
+		}
+		while (sim::now_ns() < target_ns) {
+			loop();
+			load_traffic_loop();
+			iterations++;
+			sim::advance_us(1000);
+		}
+		
+		if (!sim::qth_connected) {
+			// Reconnect after a delay (like the Qth client)
+			if (!disconnected_ns) {
+				close(fd);
+				disconnected_ns = sim::now_ns();
+			} else if (sim::now_ns() - disconnected_ns >= LOAD_RECONNECT_DELAY_MS * 1000000ull) {
+				fd = load_connect(socket_path);
+				if (fd >= 0 && load_send(fd, LOAD_FRAME_HELLO, load_board_name, index)) {
+					reader = LoadFrameReader();
+					sim::qth_connected = true;
+					disconnected_ns = 0;
+				} else {
+					if (fd >= 0) {
+						close(fd);
+					}
+					disconnected_ns = sim::now_ns();
+				}
+			}
+		}
+		usleep(200);
+	}
+	
+	std::string latencies;
+	for (uint64_t latency_us : delivery_latencies_us) {
+		latencies += (latencies.empty() ? "" : ",") + std::to_string(latency_us);
+	}
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+	         "{\"iterations\": %llu, \"max_lag_ms\": %.1f, \"events_dropped\": %u, \"reconnects\": %u, "
+	         "\"delivery_latency_us\": [",
+	         (unsigned long long)iterations, max_lag_ns / 1e6,
+	         metrics.get(METRIC_EVENTS_DROPPED), metrics.get(METRIC_RECONNECTS));
+	if (sim::qth_connected) {
+		load_send(fd, LOAD_FRAME_STATS, "", buf + latencies + "]}");
+	}
+	close(fd);
+	return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+/**
+ * Multi-board load test (see load.h): a stand-in for the Qth server which
+ * runs increasing numbers of simulated boards against itself.
+ *
+ * Usage:
+ *
+ *     ./load_broker [-d duration_ms] N [N ...]
+ *
+ * For each N, N boards are started (cycling through the four board types)
+ * and run for duration_ms (default 10 s) of wall-clock time. Halfway through
+ * the broker drops every connection and the boards must reconnect. One JSON
+ * object is printed per N:
+ *
+ * * "published"/"publish_rate": property sets and events received from the
+ *   boards (in total and per second).
+ * * "publish_latency_us": time from a board sending a message to the broker
+ *   receiving it.
+ * * "delivered"/"delivery_latency_us": property sets and events sent to the
+ *   boards (by the broker, see churn()) and the time until each board
+ *   received them.
+ * * "reconnected"/"reconnect_ms": the number of boards which reconnected after
+ *   the drop and the time each took.
+ * * "events_dropped": events the boards could not send while disconnected.
+ * * "max_lag_ms": the furthest any board's (virtual) clock fell behind the
+ *   wall clock, i.e. whether the boards kept up.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include <map>
+
+#include "load.h"
+
+// Board types, in the order boards are started
+const char *board_names[] = {"utilities_board", "doorbell", "radio_board", "bathroom_board"};
+
+// Config sent to each radio board when it connects (as the Qth server would
+// deliver the retained properties)
+#define LOAD_RX_CODES "{\"load/remote\": [1234, 24]}"
+#define LOAD_TX_CODES "{\"load/socket\": [1, 2, 24]}"
+
+// Property churn periods (ms)
+#define LOAD_SOCKET_PERIOD 500
+#define LOAD_CONFIG_PERIOD 2000
+#define LOAD_HOT_WATER_PERIOD 2000
+
+struct Connection {
+	int fd;
+	LoadFrameReader reader;
+	std::string board;
+	int index;
+};
+
+struct Results {
+	uint64_t published = 0;
+	std::vector<uint64_t> publish_latencies_us;
+	std::vector<uint64_t> delivery_latencies_us;
+	std::vector<uint64_t> reconnect_ms;
+	uint64_t events_dropped = 0;
+	double max_lag_ms = 0;
+	int stats_received = 0;
+};
+
+/**
+ * Send the broker's share of the traffic to a board: socket switching and
+ * config changes for the radio board and hot water requests for the bathroom
+ * board. Called every ms with the time since the start of the run.
+ */
+void churn(Connection &connection, uint64_t ms, uint64_t last_ms) {
+	auto due = [&](uint64_t period) {
+		return ms / period != last_ms / period;
+	};
+	if (connection.board == "radio_board") {
+		if (due(LOAD_SOCKET_PERIOD)) {
+			load_send(connection.fd, LOAD_FRAME_PROPERTY, "load/socket",
+			          (ms / LOAD_SOCKET_PERIOD) % 2 ? "true" : "false");
+		}
+		if (due(LOAD_CONFIG_PERIOD)) {
+			load_send(connection.fd, LOAD_FRAME_PROPERTY, "sys/433mhz/tx_codes/1",
+			          (ms / LOAD_CONFIG_PERIOD) % 2 ? "{\"load/socket_b\": [3, 4, 24]}" : "{}");
+		}
+	} else if (connection.board == "bathroom_board") {
+		if (due(LOAD_HOT_WATER_PERIOD)) {
+			load_send(connection.fd, LOAD_FRAME_PROPERTY, "heating/hot_water",
+			          (ms / LOAD_HOT_WATER_PERIOD) % 2 ? "true" : "false");
+		}
+	}
+}
+
+/**
+ * Record the contents of a board's LOAD_FRAME_STATS frame.
+ */
+void add_stats(Results &results, const std::string &json) {
+	double max_lag_ms = 0;
+	unsigned events_dropped = 0;
+	const char *lag = strstr(json.c_str(), "\"max_lag_ms\": ");
+	const char *dropped = strstr(json.c_str(), "\"events_dropped\": ");
+	const char *latencies = strstr(json.c_str(), "\"delivery_latency_us\": [");
+	if (!lag || !dropped || !latencies) {
+		return;
+	}
+	sscanf(lag, "\"max_lag_ms\": %lf", &max_lag_ms);
+	sscanf(dropped, "\"events_dropped\": %u", &events_dropped);
+	results.max_lag_ms = std::max(results.max_lag_ms, max_lag_ms);
+	results.events_dropped += events_dropped;
+	for (const char *p = strchr(latencies, '[') + 1; *p && *p != ']';) {
+		char *end;
+		results.delivery_latencies_us.push_back(strtoull(p, &end, 10));
+		p = *end == ',' ? end + 1 : end;
+		if (end == p && *p != ']') {
+			break;
+		}
+	}
+	results.stats_received++;
+}
+
+/**
+ * Run n boards against the broker for duration_ms and print the results.
+ */
+void run(const std::string &bin_dir, int n, uint64_t duration_ms) {
+	std::string socket_path = "/tmp/load_broker." + std::to_string(getpid()) + ".sock";
+	unlink(socket_path.c_str());
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+		perror(socket_path.c_str());
+		exit(1);
+	}
+	
+	std::vector<pid_t> children;
+	for (int i = 0; i < n; i++) {
+		std::string binary = bin_dir + "/" + board_names[i % 4] + "_load";
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(listen_fd);
+			std::string index = std::to_string(i);
+			std::string duration = std::to_string(duration_ms);
+			execl(binary.c_str(), binary.c_str(), socket_path.c_str(),
+			      index.c_str(), duration.c_str(), (char *)NULL);
+			perror(binary.c_str());
+			_exit(1);
+		}
+		children.push_back(pid);
+	}
+	
+	Results results;
+	std::vector<Connection> connections;
+	std::map<int, uint64_t> dropped_ns;
+	uint64_t start_ns = load_wall_ns();
+	uint64_t last_ms = 0;
+	bool dropped = false;
+	size_t running = children.size();
+	while (running || !connections.empty()) {
+		std::vector<struct pollfd> fds = {{listen_fd, POLLIN, 0}};
+		for (const Connection &connection : connections) {
+			fds.push_back({connection.fd, POLLIN, 0});
+		}
+		poll(fds.data(), fds.size(), 1);
+		uint64_t now_ns = load_wall_ns();
+		uint64_t ms = (now_ns - start_ns) / 1000000ull;
+		
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if (fd >= 0) {
+				connections.push_back({fd, LoadFrameReader(), "", -1});
+			}
+		}
+		
+		for (size_t i = 0; i < connections.size();) {
+			Connection &connection = connections[i];
+			bool open = !(fds.size() > i + 1 && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) ||
+			            connection.reader.read(connection.fd);
+			LoadFrame frame;
+			while (connection.reader.next(frame)) {
+				if (frame.type == LOAD_FRAME_HELLO) {
+					connection.board = frame.path;
+					connection.index = atoi(frame.value.c_str());
+					auto drop = dropped_ns.find(connection.index);
+					if (drop != dropped_ns.end()) {
+						results.reconnect_ms.push_back((now_ns - drop->second) / 1000000ull);
+						dropped_ns.erase(drop);
+					}
+					if (connection.board == "radio_board") {
+						load_send(connection.fd, LOAD_FRAME_PROPERTY, "sys/433mhz/rx_codes", LOAD_RX_CODES);
+						load_send(connection.fd, LOAD_FRAME_PROPERTY, "sys/433mhz/tx_codes", LOAD_TX_CODES);
+					}
+				} else if (frame.type == LOAD_FRAME_STATS) {
+					add_stats(results, frame.value);
+				} else {
+					results.published++;
+					results.publish_latencies_us.push_back((now_ns - frame.sent_ns) / 1000ull);
+				}
+			}
+			if (!open) {
+				close(connection.fd);
+				connections.erase(connections.begin() + i);
+				continue;
+			}
+			if (ms != last_ms && connection.index >= 0) {
+				churn(connection, ms, last_ms);
+			}
+			i++;
+		}
+		last_ms = ms;
+		
+		// Drop every connection halfway through
+		if (!dropped && ms >= duration_ms / 2) {
+			dropped = true;
+			for (const Connection &connection : connections) {
+				dropped_ns[connection.index] = now_ns;
+				close(connection.fd);
+			}
+			connections.clear();
+		}
+		
+		int status;
+		while (running && waitpid(-1, &status, WNOHANG) > 0) {
+			running--;
+		}
+	}
+	close(listen_fd);
+	unlink(socket_path.c_str());
+	
+	double duration_s = duration_ms / 1000.0;
+	printf("{\"bench\": \"load\", \"boards\": %d, \"duration_s\": %.1f, "
+	       "\"published\": %llu, \"publish_rate\": %.1f, \"publish_latency_us\": %s, "
+	       "\"delivered\": %zu, \"delivery_latency_us\": %s, "
+	       "\"reconnected\": %zu, \"reconnect_ms\": %s, \"events_dropped\": %llu, "
+	       "\"max_lag_ms\": %.1f, \"boards_reporting\": %d}\n",
+	       n, duration_s,
+	       (unsigned long long)results.published, results.published / duration_s,
+	       load_percentiles_json(results.publish_latencies_us).c_str(),
+	       results.delivery_latencies_us.size(),
+	       load_percentiles_json(results.delivery_latencies_us).c_str(),
+	       results.reconnect_ms.size(), load_percentiles_json(results.reconnect_ms).c_str(),
+	       (unsigned long long)results.events_dropped,
+	       results.max_lag_ms, results.stats_received);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t duration_ms = 10 * 1000;
+	int arg = 1;
+	if (arg + 1 < argc && strcmp(argv[arg], "-d") == 0) {
+		duration_ms = strtoull(argv[arg + 1], NULL, 10);
+		arg += 2;
+	}
+	if (arg >= argc) {
+		fprintf(stderr, "Usage: %s [-d duration_ms] N [N ...]\n", argv[0]);
+		return 1;
+	}
+	
+	std::string bin_dir = argv[0];
+	size_t slash = bin_dir.rfind('/');
+	bin_dir = slash == std::string::npos ? "." : bin_dir.substr(0, slash);
+	
+	for (; arg < argc; arg++) {
+		run(bin_dir, atoi(argv[arg]), duration_ms);
+	}
+	return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * Benchmarks for the radio board's hot paths: looking up received codes and
+ * parsing the rx_codes and tx_codes tables.
+ *
+ * Also reports the (simulated) board time taken to switch TX_SWITCH_CODES
+ * codes using a group property ("tx_switch_group") and using one write per
+ * code ("tx_switch_individual"): from the first property set reaching the
+ * board until the last code has been transmitted ("board_ms").
+ *
+ * Usage:
+ *
+ *     ./radio_board_bench [rx_codes.json [tx_codes.json]]
+ *
+ * Optionally benchmarks recorded values of the sys/433mhz/rx_codes and
+ * tx_codes properties too.
+ */
+
+#include "../radio_board/src/main.cpp"
+
+#include "bench.h"
+
+const size_t table_sizes[] = {8, 32, 128};
+
+// Number of codes switched by the tx_switch benchmarks
+#define TX_SWITCH_CODES 10
+
+// Time (us) assumed for FourThreeThree to send a code (the simulator's
+// FourThreeThree_tx() otherwise completes instantly)
+#define TX_SWITCH_FOUR_THREE_THREE_US (100 * 1000)
+
+// Benchmarked results are written here so they are not optimised away
+rx_code_t *volatile sink;
+
+/**
+ * A synthetic rx_codes table with n codes.
+ */
+std::string make_rx_codes(size_t n) {
+	std::string json = "{";
+	for (size_t i = 0; i < n; i++) {
+		char entry[64];
+		snprintf(entry, sizeof(entry), "%s\"bench/rx/%zu\": [%lu, 24]",
+		         i ? ", " : "", i, 100000ul + i * 7919ul);
+		json += entry;
+	}
+	return json + "}";
+}
+
+/**
+ * A synthetic tx_codes table with n codes (every fourth using a pulse
+ * template).
+ */
+std::string make_tx_codes(size_t n) {
+	std::string json = "{";
+	for (size_t i = 0; i < n; i++) {
+		char entry[80];
+		snprintf(entry, sizeof(entry), "%s\"bench/tx/%zu\": [%lu, %lu, 24%s]",
+		         i ? ", " : "", i, 200000ul + i * 2, 200001ul + i * 2,
+		         i % 4 == 3 ? ", \"pt2262\"" : "");
+		json += entry;
+	}
+	return json + "}";
+}
+
+/**
+ * Set each of the given properties to true, one per loop() iteration (as
+ * separate MQTT messages are received), and return the board time (ms) until
+ * every resulting code has been transmitted.
+ */
+double tx_switch_ms(const std::vector<std::string> &paths) {
+	// Start with an idle transmitter
+	sim::run(loop, 2 * RAW_TX_GUARD_TIME);
+	
+	sim::tx_log.clear();
+	sim::pin_log.clear();
+	sim::log_pins = true;
+	uint64_t start_ns = sim::now_ns();
+	for (const std::string &path : paths) {
+		sim::qth_set_property(path.c_str(), "true");
+		loop();
+		sim::advance_us(1000);
+	}
+	sim::run(loop, 10 * 1000);
+	sim::log_pins = false;
+	
+	uint64_t end_ns = start_ns;
+	for (const sim::RadioCode &code : sim::tx_log) {
+		end_ns = std::max(end_ns, code.ns + sim::four_three_three_tx_us * 1000);
+	}
+	for (const sim::PinChange &change : sim::pin_log) {
+		if (change.pin == tx_pin) {
+			end_ns = std::max(end_ns, change.ns);
+		}
+	}
+	return (end_ns - start_ns) / 1e6;
+}
+
+void bench_tx_switch() {
+	sim::four_three_three_tx_us = TX_SWITCH_FOUR_THREE_THREE_US;
+	sim::qth_set_property(QTH_PATH_PREFIX"tx_codes", make_tx_codes(TX_SWITCH_CODES).c_str());
+	
+	std::vector<std::string> paths;
+	std::string group = "{\"bench/group\": [";
+	for (size_t i = 0; i < TX_SWITCH_CODES; i++) {
+		paths.push_back("bench/tx/" + std::to_string(i));
+		group += (i ? ", \"" : "\"") + paths.back() + "\"";
+	}
+	sim::qth_set_property(QTH_PATH_PREFIX"groups", (group + "]}").c_str());
+	sim::run(loop, 1000);
+	
+	double group_ms = tx_switch_ms({"bench/group"});
+	double individual_ms = tx_switch_ms(paths);
+	printf("{\"bench\": \"tx_switch_group\", \"input\": \"synthetic\", \"size\": %d, \"board_ms\": %.1f}\n",
+	       TX_SWITCH_CODES, group_ms);
+	printf("{\"bench\": \"tx_switch_individual\", \"input\": \"synthetic\", \"size\": %d, \"board_ms\": %.1f}\n",
+	       TX_SWITCH_CODES, individual_ms);
+	fflush(stdout);
+	
+	sim::four_three_three_tx_us = 0;
+}
+
+void bench_find_rx_code(const char *input, const std::string &rx_codes_json) {
+	on_rx_codes_changed(QTH_PATH_PREFIX"rx_codes", rx_codes_json.c_str());
+	size_t n = num_rx_codes;
+	if (!n) {
+		return;
+	}
+	std::vector<unsigned long> codes;
+	for (size_t i = 0; i < n; i++) {
+		codes.push_back(rx_codes[i].code);
+	}
+	
+	bench("find_rx_code_hit", input, n, n, [&]() {
+		for (size_t i = 0; i < n; i++) {
+			sink = find_rx_code(codes[i], 24);
+		}
+	});
+	bench("find_rx_code_miss", input, n, n, [&]() {
+		for (size_t i = 0; i < n; i++) {
+			sink = find_rx_code(codes[i] + 1, 24);
+		}
+	});
+}
+
+void bench_rx_codes_parse(const char *input, size_t size, const std::string &json) {
+	bench("rx_codes_parse", input, size, 1, [&]() {
+		on_rx_codes_changed(QTH_PATH_PREFIX"rx_codes", json.c_str());
+	});
+}
+
+void bench_tx_codes_parse(const char *input, size_t size, const std::string &json) {
+	bench("tx_codes_parse", input, size, 1, [&]() {
+		on_tx_codes_changed(QTH_PATH_PREFIX"tx_codes", json.c_str());
+	});
+}
+
+int main(int argc, char *argv[]) {
+	setup();
+	
+	bench_tx_switch();
+	
+	for (size_t size : table_sizes) {
+		bench_find_rx_code("synthetic", make_rx_codes(size));
+	}
+	for (size_t size : table_sizes) {
+		bench_rx_codes_parse("synthetic", size, make_rx_codes(size));
+	}
+	for (size_t size : table_sizes) {
+		bench_tx_codes_parse("synthetic", size, make_tx_codes(size));
+	}
+	
+	if (argc > 1) {
+		std::string json = load_file(argv[1]);
+		bench_find_rx_code(argv[1], json);
+		bench_rx_codes_parse(argv[1], json.size(), json);
+	}
+	if (argc > 2) {
+		std::string json = load_file(argv[2]);
+		bench_tx_codes_parse(argv[2], json.size(), json);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,38 @@
+/**
+ * The radio board in the multi-board load test (see load.h): a known remote
+ * button pressed every second (the broker sets up rx_codes and tx_codes and
+ * switches a socket, see load_broker.cpp).
+ */
+
+#define BOARD_LOAD
+
+#include "../radio_board/src/main.cpp"
+
+#include "load.h"
+
+const char *load_board_name = "radio_board";
+
+// The code sent by the remote (see LOAD_RX_CODES in load_broker.cpp)
+#define LOAD_RX_CODE 1234
+#define LOAD_RX_CODE_LENGTH 24
+
+uint64_t next_press_ns;
+
+void load_traffic_begin() {
+	next_press_ns = sim::now_ns();
+}
+
+void load_traffic_loop() {
+	if (sim::now_ns() >= next_press_ns) {
+		// A few frames per press, as sent by a real remote
+		for (int i = 0; i < 4; i++) {
+			sim::rx_queue.push_back({LOAD_RX_CODE, LOAD_RX_CODE_LENGTH, next_press_ns + i * 50000000ull});
+		}
+		next_press_ns += 1000000000ull;
+	}
+	sim::tx_log.clear();
+}
+
+int main(int argc, char *argv[]) {
+	return load_board_main(argc, argv);
+}
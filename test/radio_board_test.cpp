@@ -0,0 +1,259 @@
+/**
+ * Tests for the radio board, built from its unmodified src/main.cpp.
+ */
+
+#include "../radio_board/src/main.cpp"
+
+#include "test.h"
+
+TEST(radio_board_boots) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 2 * METRICS_PUBLISH_PERIOD);
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"rx_codes"));
+		CHECK(sim::qth_last("sys/nodemcu_radio_board/metrics"));
+	}));
+}
+
+TEST(setup_registers_config_properties_without_allocating) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		uint64_t allocations = sim::heap_allocations;
+		uint64_t bytes = sim::heap_bytes;
+		setup();
+		CHECK_EQ(sim::heap_allocations - allocations, 0);
+		CHECK_EQ(sim::heap_bytes - bytes, 0);
+		
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"tx_codes"));
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"rx_codes/7"));
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"tx_codes/7"));
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"groups"));
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"rx_unknown_code"));
+	}));
+}
+
+/**
+ * The chunks found by ConfigStore::load() as "kind,chunk,value;..."
+ */
+std::string loaded_chunks;
+
+void on_chunk_loaded(uint8_t kind, uint8_t chunk, const char *value, size_t length) {
+	loaded_chunks += std::to_string(kind) + "," + std::to_string(chunk) + ",";
+	loaded_chunks.append(value, length);
+	loaded_chunks += ";";
+}
+
+const char *load_chunks() {
+	loaded_chunks.clear();
+	config_store.load(on_chunk_loaded);
+	return loaded_chunks.c_str();
+}
+
+TEST(config_store_keeps_old_chunk_when_new_one_does_not_fit) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_RX, 0, "{\"a\":[1,2]}", 11));
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_TX, 1, "{}", 2));
+		
+		std::string too_big(CONFIG_STORE_SIZE, ' ');
+		CHECK(!config_store.store(ConfigStore::CONFIG_KIND_RX, 0, too_big.c_str(), too_big.size()));
+		CHECK_STR_EQ(load_chunks(), "1,0,{\"a\":[1,2]};2,1,{};");
+		
+		// Exactly filling the store (with the old record replaced) is fine
+		std::string just_fits(CONFIG_STORE_SIZE - 2 - 4 - 2 - 4 - 1, ' ');
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_RX, 0, just_fits.c_str(), just_fits.size()));
+		std::string expected = "2,1,{};1,0," + just_fits + ";";
+		CHECK_STR_EQ(load_chunks(), expected.c_str());
+		
+		// Removal
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_RX, 0, "", 0));
+		CHECK_STR_EQ(load_chunks(), "2,1,{};");
+	}));
+}
+
+TEST(config_store_discards_corrupt_records) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_RX, 0, "{}", 2));
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_TX, 0, "{}", 2));
+		
+		// Give the second record a length running past the end of the store
+		uint8_t *data = storage.modify(CONFIG_STORE_ADDR, CONFIG_STORE_SIZE);
+		data[CONFIG_STORE_ADDR + 2 + 6 + 2] = 0xFF;
+		data[CONFIG_STORE_ADDR + 2 + 6 + 3] = 0xFF;
+		CHECK_STR_EQ(load_chunks(), "1,0,{};");
+		
+		// The store remains usable
+		CHECK(config_store.store(ConfigStore::CONFIG_KIND_GROUPS, 0, "{}", 2));
+		CHECK_STR_EQ(load_chunks(), "1,0,{};3,0,{};");
+	}));
+}
+
+TEST(empty_config_chunk_deletes_it) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 1000);
+		
+		sim::qth_set_property(QTH_PATH_PREFIX"rx_codes/1", "{\"remote/a\": [1234, 24]}");
+		sim::qth_set_property(QTH_PATH_PREFIX"tx_codes", "{\"socket/a\": [1, 2, 24]}");
+		sim::qth_set_property(QTH_PATH_PREFIX"groups", "{\"sockets\": [\"socket/a\"]}");
+		sim::run(loop, 1000);
+		CHECK(sim::qth_is_registered("remote/a"));
+		CHECK(sim::qth_is_registered("socket/a"));
+		CHECK(sim::qth_is_registered("sockets"));
+		
+		sim::qth_set_property(QTH_PATH_PREFIX"rx_codes/1", "");
+		sim::qth_set_property(QTH_PATH_PREFIX"tx_codes", "");
+		sim::qth_set_property(QTH_PATH_PREFIX"groups", "");
+		sim::run(loop, 1000);
+		CHECK(!sim::qth_is_registered("remote/a"));
+		CHECK(!sim::qth_is_registered("socket/a"));
+		CHECK(!sim::qth_is_registered("sockets"));
+		CHECK_EQ(metrics.get(METRIC_JSON_ERRORS), 0);
+		CHECK_STR_EQ(load_chunks(), "");
+	}));
+}
+
+/**
+ * The waveform expected on the TX pin for a code sent with a pulse template,
+ * as alternating high and low durations (us), repeats included.
+ */
+std::vector<uint64_t> expected_waveform(const pulse_template_t &pulse_template,
+                                        unsigned long code, unsigned int code_length) {
+	std::vector<uint64_t> durations;
+	for (unsigned int repeat = 0; repeat < pulse_template.repeats; repeat++) {
+		for (int bit = code_length - 1; bit >= 0; bit--) {
+			bool one = (code >> bit) & 1;
+			durations.push_back(one ? pulse_template.one_high_us : pulse_template.zero_high_us);
+			durations.push_back(one ? pulse_template.one_low_us : pulse_template.zero_low_us);
+		}
+		durations.back() += pulse_template.gap_us;
+	}
+	return durations;
+}
+
+TEST(mercury_waveform_timing) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 1000);
+		
+		// Button 1 of remote_controlled_adapters.md
+		sim::qth_set_property(QTH_PATH_PREFIX"tx_codes",
+		                      "{\"socket/mercury\": [11053670, 11053688, 25, \"mercury\"]}");
+		sim::run(loop, 1000);
+		CHECK(sim::qth_is_registered("socket/mercury"));
+		
+		sim::log_pins = true;
+		sim::pin_log.clear();
+		sim::qth_set_property("socket/mercury", "true");
+		sim::run(loop, 1000);
+		sim::log_pins = false;
+		CHECK(!raw_tx.is_busy());
+		
+		// Durations between the writes to the TX pin (the final write returns
+		// the pin low after the last repeat's gap)
+		std::vector<uint64_t> durations;
+		int expected_value = HIGH;
+		for (size_t i = 0; i + 1 < sim::pin_log.size(); i++) {
+			CHECK_EQ(sim::pin_log[i].pin, tx_pin);
+			CHECK_EQ(sim::pin_log[i].value, expected_value);
+			expected_value = !expected_value;
+			durations.push_back((sim::pin_log[i + 1].ns - sim::pin_log[i].ns) / 1000ull);
+		}
+		CHECK_EQ(sim::pin_log.back().value, LOW);
+		
+		const pulse_template_t *mercury = find_pulse_template("mercury", 7);
+		CHECK(mercury);
+		std::vector<uint64_t> expected = expected_waveform(*mercury, 11053670, 25);
+		CHECK_EQ(durations.size(), expected.size());
+		for (size_t i = 0; i < std::min(durations.size(), expected.size()); i++) {
+			if (durations[i] != expected[i]) {
+				fprintf(stderr, "Pulse %zu:\n", i);
+				CHECK_EQ(durations[i], expected[i]);
+				break;
+			}
+		}
+		
+		// Every bit takes 770 us (as measured on the scope) and each of the 8
+		// repeats ends with the 8000 us gap
+		CHECK_EQ(mercury->zero_high_us + mercury->zero_low_us, 770);
+		CHECK_EQ(mercury->one_high_us + mercury->one_low_us, 770);
+		CHECK_EQ(sim::pin_log.back().ns - sim::pin_log.front().ns, 8 * (25 * 770 + 8000) * 1000ull);
+	}));
+}
+
+/**
+ * An rx_codes table of n remotes ("remote/<i>", code 1000 + i) which stay
+ * held for a minute after their last frame.
+ */
+std::string make_held_rx_codes(size_t n) {
+	std::string json = "{";
+	for (size_t i = 0; i < n; i++) {
+		json += (i ? ", \"remote/" : "\"remote/") + std::to_string(i) + "\": [" +
+		        std::to_string(1000 + i) + ", 24, 60000]";
+	}
+	return json + "}";
+}
+
+/**
+ * Receive a single frame of remote i's code.
+ */
+void press_remote(size_t i) {
+	sim::rx_queue.push_back({1000 + i, 24, sim::now_ns()});
+	sim::run(loop, 100);
+}
+
+size_t num_releases(size_t i) {
+	return sim::qth_sent(("remote/" + std::to_string(i) + "/release").c_str()).size();
+}
+
+TEST(oldest_held_button_is_released_first) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::qth_set_property(QTH_PATH_PREFIX"rx_codes",
+		                      make_held_rx_codes(RX_MAX_HELD + 2).c_str());
+		sim::run(loop, 1000);
+		
+		for (size_t i = 0; i < RX_MAX_HELD; i++) {
+			press_remote(i);
+		}
+		for (size_t i = 0; i < RX_MAX_HELD; i++) {
+			CHECK_EQ(num_releases(i), 0);
+		}
+		
+		// Each further press releases the oldest held button
+		press_remote(RX_MAX_HELD);
+		CHECK_EQ(num_releases(0), 1);
+		press_remote(RX_MAX_HELD + 1);
+		CHECK_EQ(num_releases(1), 1);
+		for (size_t i = 2; i < RX_MAX_HELD + 2; i++) {
+			CHECK_EQ(num_releases(i), 0);
+		}
+	}));
+}
+
+TEST(held_buttons_are_released_when_rx_codes_change) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::qth_set_property(QTH_PATH_PREFIX"rx_codes", make_held_rx_codes(2).c_str());
+		sim::run(loop, 1000);
+		
+		press_remote(0);
+		press_remote(1);
+		sim::qth_set_property(QTH_PATH_PREFIX"rx_codes", make_held_rx_codes(3).c_str());
+		sim::run(loop, 1000);
+		CHECK_EQ(num_releases(0), 1);
+		CHECK_EQ(num_releases(1), 1);
+		
+		// Still recognised (and pressed afresh) under the new table
+		press_remote(0);
+		CHECK_EQ(sim::qth_sent("remote/0").size(), 2);
+	}));
+}
@@ -0,0 +1,105 @@
+/**
+ * Replay a recorded sensor trace through a board's unmodified src/main.cpp as
+ * fast as possible, printing everything the board sends via Qth.
+ *
+ * Built once per board (as <board>_replay) with BOARD_MAIN naming the board's
+ * main.cpp. Usage:
+ *
+ *     ./utilities_board_replay trace.csv > messages.csv
+ *
+ * The trace is a CSV from common/trace_capture.py (time_ms,channel,value).
+ * Each sample is fed to the board at its recorded time (relative to the end
+ * of setup()) and held until the next sample on the same channel:
+ *
+ * * ADC channels (TRACE_CHANNEL_ADC onward) set the value returned by
+ *   analogRead(). (Every board has a single ADC consumer so only channel 0 is
+ *   used in practice.)
+ * * TRACE_CHANNEL_DIGITAL sets the utilities board's (active low) gas sensor
+ *   input.
+ *
+ * Each property set and event sent by the board is printed as
+ * time_ms,path,value on stdout (the value being the remainder of the line).
+ * A summary, including the speed relative to real time, goes to stderr.
+ */
+
+#include BOARD_MAIN
+
+#include "bench.h"
+
+// Time (ms) the board is run for after the final sample
+#define REPLAY_TAIL_MS 5000
+
+/**
+ * Run the board's loop until the given virtual time (ns).
+ */
+void run_until(uint64_t end_ns) {
+	if (sim::now_ns() < end_ns) {
+		sim::run(loop, (end_ns - sim::now_ns() + 999999ull) / 1000000ull);
+	}
+}
+
+/**
+ * Feed a trace sample to the board's inputs.
+ */
+void apply_sample(const TraceSample &sample) {
+	if (sample.channel < TRACE_CHANNEL_DIGITAL) {
+		sim::adc_value = sample.value;
+	} else if (sample.channel == TRACE_CHANNEL_DIGITAL) {
+#ifdef GAS_PIN
+		sim::digital_inputs[GAS_PIN] = !sample.value;
+#endif
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s trace.csv\n", argv[0]);
+		return 1;
+	}
+	std::vector<TraceSample> trace = load_trace(argv[1]);
+	if (trace.empty()) {
+		fprintf(stderr, "%s: no samples\n", argv[1]);
+		return 1;
+	}
+	std::stable_sort(trace.begin(), trace.end(), [](const TraceSample &a, const TraceSample &b) {
+		return a.time_ms < b.time_ms;
+	});
+	
+	// Start from the first value of every channel so the board doesn't see a
+	// spurious change at the start of the trace.
+	for (auto it = trace.rbegin(); it != trace.rend(); ++it) {
+		apply_sample(*it);
+	}
+	
+	sim::erase_all();
+	setup();
+	uint64_t start_ns = sim::now_ns();
+	
+	// NB: Messages sent during setup() have negative times
+	auto print_message = [&](const sim::QthMessage &message) {
+		printf("%lld,%s,%s\n",
+		       (long long)((int64_t)(message.ns - start_ns) / 1000000ll),
+		       message.path.c_str(), message.value.c_str());
+	};
+	for (const sim::QthMessage &message : sim::qth_log) {
+		print_message(message);
+	}
+	sim::qth_log.clear();
+	sim::qth_transport = print_message;
+	
+	typedef std::chrono::steady_clock clock;
+	clock::time_point wall_start = clock::now();
+	for (const TraceSample &sample : trace) {
+		run_until(start_ns + sample.time_ms * 1000000ull);
+		apply_sample(sample);
+	}
+	run_until(start_ns + (trace.back().time_ms + REPLAY_TAIL_MS) * 1000000ull);
+	double wall_s = std::chrono::duration<double>(clock::now() - wall_start).count();
+	
+	fflush(stdout);
+	double virtual_s = (sim::now_ns() - start_ns) / 1e9;
+	fprintf(stderr, "Replayed %zu samples (%.1f s of board time) in %.3f s (%.0fx real time).\n",
+	        trace.size(), virtual_s, wall_s, wall_s > 0 ? virtual_s / wall_s : 0.0);
+	
+	return 0;
+}
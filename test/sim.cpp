@@ -0,0 +1,945 @@
+/**
+ * Implementation of the simulated ESP8266 (see sim.h) and the stand-in
+ * Arduino, ESP8266WiFi, LittleFS, Servo, FourThreeThree and Qth APIs in
+ * stubs/.
+ */
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <LittleFS.h>
+#include <Servo.h>
+#include <FourThreeThree.h>
+#include <Qth.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "sim.h"
+
+int test_failures = 0;
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+FS LittleFS;
+
+// NB: The flash address of the storage sectors is derived from the address of
+// this symbol (see storage.h) so it must be sector aligned.
+extern "C" {
+	alignas(SPI_FLASH_SEC_SIZE) uint32_t _EEPROM_start;
+}
+
+// Sizes of the simulated persistent memories
+#define SIM_RTC_SIZE 512
+#define SIM_FLASH_SECTORS 8
+#define SIM_FS_MAX_FILES 96
+#define SIM_FS_MAX_FILE_SIZE 8192
+#define SIM_FS_PATH_LENGTH 64
+
+// Simulated heap size (bytes) used for ESP.getFreeHeap()
+#define SIM_HEAP_SIZE (80 * 1024)
+
+// Flags in a boot's exit status (the low bits hold the failure count)
+#define BOOT_MAX_FAILURES 31
+#define BOOT_RESTARTED 32
+#define BOOT_POWER_CUT 64
+
+namespace sim {
+
+uint64_t analog_read_us = 100;
+std::function<int()> adc_source;
+int adc_value = 0;
+int digital_inputs[32];
+int digital_outputs[32];
+bool log_pins = false;
+std::vector<PinChange> pin_log;
+std::function<void(int angle)> servo_hook;
+std::deque<RadioCode> rx_queue;
+std::vector<RadioCode> tx_log;
+uint64_t four_three_three_tx_us = 0;
+uint64_t unix_time_at_zero = 0;
+
+bool qth_connected = true;
+std::vector<QthMessage> qth_log;
+std::function<void(const QthMessage &message)> qth_transport;
+std::function<void()> qth_poll;
+
+uint64_t heap_allocations = 0;
+uint64_t heap_bytes = 0;
+
+int flash_erases = 0;
+int flash_writes = 0;
+bool flash_fail = false;
+uint32_t reset_reason = 0;
+
+namespace {
+
+uint64_t clock_ns = 0;
+
+bool pin_is_output[32];
+
+timercallback timer1_callback = NULL;
+bool timer1_enabled = false;
+bool timer1_armed = false;
+uint64_t timer1_tick_ps = 0;
+uint64_t timer1_due_ns = 0;
+
+uint64_t four_three_three_busy_until_ns = 0;
+
+int power_cut_countdown = -1;
+int num_fs_modifications = 0;
+
+struct FsEntry {
+	bool used;
+	char path[SIM_FS_PATH_LENGTH];
+	uint32_t size;
+	uint8_t data[SIM_FS_MAX_FILE_SIZE];
+};
+
+/**
+ * Everything which survives a reboot. Kept in memory shared with the child
+ * processes running each boot.
+ */
+struct Persistent {
+	uint8_t rtc[SIM_RTC_SIZE];
+	uint8_t flash[SIM_FLASH_SECTORS][SPI_FLASH_SEC_SIZE];
+	FsEntry files[SIM_FS_MAX_FILES];
+};
+
+Persistent *persistent = NULL;
+
+void randomise_rtc() {
+	// RTC memory contains garbage after a power cycle
+	uint32_t x = 0x12345678u;
+	for (size_t i = 0; i < SIM_RTC_SIZE; i++) {
+		x = x * 1103515245u + 12345u;
+		persistent->rtc[i] = x >> 24;
+	}
+}
+
+Persistent &get_persistent() {
+	if (!persistent) {
+		void *p = mmap(NULL, sizeof(Persistent), PROT_READ | PROT_WRITE,
+		               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			abort();
+		}
+		persistent = (Persistent *)p;
+		memset(persistent->flash, 0xFF, sizeof(persistent->flash));
+		memset(persistent->files, 0, sizeof(persistent->files));
+		randomise_rtc();
+	}
+	return *persistent;
+}
+
+bool in_boot = false;
+
+/**
+ * Only heap allocations made by the board (not the simulation's own
+ * bookkeeping) are counted.
+ */
+int heap_pause_depth = 0;
+struct HeapPause {
+	HeapPause() { heap_pause_depth++; }
+	~HeapPause() { heap_pause_depth--; }
+};
+
+[[noreturn]] void end_boot(int flags) {
+	if (flags & BOOT_POWER_CUT) {
+		randomise_rtc();
+	}
+	fflush(stdout);
+	fflush(stderr);
+	_exit(std::min(test_failures, BOOT_MAX_FAILURES) | flags);
+}
+
+/**
+ * Called before every filesystem modification and flash sector erase or write.
+ */
+void power_cut_point() {
+	if (power_cut_countdown == 0) {
+		end_boot(BOOT_POWER_CUT);
+	}
+	if (power_cut_countdown > 0) {
+		power_cut_countdown--;
+	}
+}
+
+/**
+ * Called before every filesystem modification.
+ */
+void fs_modify() {
+	power_cut_point();
+	num_fs_modifications++;
+}
+
+FsEntry *fs_find(const char *path) {
+	Persistent &p = get_persistent();
+	for (FsEntry &entry : p.files) {
+		if (entry.used && strcmp(entry.path, path) == 0) {
+			return &entry;
+		}
+	}
+	return NULL;
+}
+
+FsEntry *fs_create(const char *path) {
+	Persistent &p = get_persistent();
+	if (strlen(path) >= SIM_FS_PATH_LENGTH) {
+		fprintf(stderr, "sim: path too long: %s\n", path);
+		abort();
+	}
+	for (FsEntry &entry : p.files) {
+		if (!entry.used) {
+			entry.used = true;
+			strcpy(entry.path, path);
+			entry.size = 0;
+			return &entry;
+		}
+	}
+	fprintf(stderr, "sim: too many files\n");
+	abort();
+}
+
+/**
+ * Index of the simulated flash sector containing a flash address.
+ */
+int flash_sector_index(uint32_t address) {
+	uint32_t eeprom_sector = ((uint32_t)(uintptr_t)&_EEPROM_start - 0x40200000u) / SPI_FLASH_SEC_SIZE;
+	uint32_t index = eeprom_sector - address / SPI_FLASH_SEC_SIZE;
+	if (index >= SIM_FLASH_SECTORS) {
+		fprintf(stderr, "sim: flash address 0x%08x outside simulated flash\n", address);
+		abort();
+	}
+	return index;
+}
+
+}
+
+uint64_t now_ns() {
+	return clock_ns;
+}
+
+void advance_us(uint64_t us) {
+	uint64_t end_ns = clock_ns + us * 1000ull;
+	while (timer1_enabled && timer1_armed && timer1_due_ns <= end_ns) {
+		clock_ns = std::max(clock_ns, timer1_due_ns);
+		timer1_armed = false;
+		timer1_callback();
+	}
+	clock_ns = end_ns;
+}
+
+void advance_ms(uint64_t ms) {
+	advance_us(ms * 1000ull);
+}
+
+LoopStats run(void (*loop)(), uint64_t duration_ms, uint64_t step_us) {
+	LoopStats stats = {0, 0, 0};
+	uint64_t end_ns = clock_ns + duration_ms * 1000000ull;
+	while (clock_ns < end_ns) {
+		uint64_t start_ns = clock_ns;
+		loop();
+		uint64_t iteration_us = (clock_ns - start_ns) / 1000ull;
+		stats.iterations++;
+		stats.total_iteration_us += iteration_us;
+		stats.max_iteration_us = std::max(stats.max_iteration_us, iteration_us);
+		advance_us(step_us);
+	}
+	return stats;
+}
+
+namespace {
+
+std::vector<Qth::Property *> registered_properties;
+std::vector<Qth::Property *> watched_properties;
+std::vector<Qth::Event *> registered_events;
+std::vector<Qth::Event *> watched_events;
+std::deque<QthMessage> qth_inbox;
+
+template <typename T>
+void remove_from(std::vector<T *> &list, T *item) {
+	list.erase(std::remove(list.begin(), list.end(), item), list.end());
+}
+
+void qth_publish(bool is_event, const char *path, const char *value) {
+	HeapPause pause;
+	if (!qth_connected) {
+		return;
+	}
+	QthMessage message = {is_event, path, value, clock_ns};
+	if (qth_transport) {
+		qth_transport(message);
+	} else {
+		qth_log.push_back(message);
+	}
+}
+
+}
+
+void qth_set_property(const char *path, const char *value) {
+	HeapPause pause;
+	qth_inbox.push_back({false, path, value, clock_ns});
+}
+
+void qth_send_event(const char *path, const char *value) {
+	HeapPause pause;
+	qth_inbox.push_back({true, path, value, clock_ns});
+}
+
+bool qth_is_registered(const char *path) {
+	for (Qth::Property *property : registered_properties) {
+		if (strcmp(property->path, path) == 0) {
+			return true;
+		}
+	}
+	for (Qth::Event *event : registered_events) {
+		if (strcmp(event->path, path) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<QthMessage> qth_sent(const char *path) {
+	std::vector<QthMessage> messages;
+	for (const QthMessage &message : qth_log) {
+		if (message.path == path) {
+			messages.push_back(message);
+		}
+	}
+	return messages;
+}
+
+const char *qth_last(const char *path) {
+	for (auto it = qth_log.rbegin(); it != qth_log.rend(); ++it) {
+		if (it->path == path) {
+			return it->value.c_str();
+		}
+	}
+	return NULL;
+}
+
+BootResult boot(std::function<void()> fn) {
+	get_persistent();
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		abort();
+	}
+	if (pid == 0) {
+		in_boot = true;
+		test_failures = 0;
+		clock_ns = 0;
+		num_fs_modifications = 0;
+		flash_erases = 0;
+		flash_writes = 0;
+		fn();
+		end_boot(0);
+	}
+	
+	int status;
+	waitpid(pid, &status, 0);
+	BootResult result = {0, false, false, false};
+	if (WIFEXITED(status)) {
+		int code = WEXITSTATUS(status);
+		result.failures = code & BOOT_MAX_FAILURES;
+		result.restarted = code & BOOT_RESTARTED;
+		result.power_cut = code & BOOT_POWER_CUT;
+		result.crashed = code & ~(BOOT_MAX_FAILURES | BOOT_RESTARTED | BOOT_POWER_CUT);
+	} else {
+		result.crashed = true;
+	}
+	if (result.crashed) {
+		fprintf(stderr, "sim: boot ended abnormally (status 0x%x)\n", status);
+	}
+	
+	// Count failures in the boot towards the overall result too
+	test_failures += result.failures;
+	return result;
+}
+
+void power_off() {
+	get_persistent();
+	randomise_rtc();
+}
+
+void erase_all() {
+	Persistent &p = get_persistent();
+	memset(p.flash, 0xFF, sizeof(p.flash));
+	memset(p.files, 0, sizeof(p.files));
+	randomise_rtc();
+}
+
+void power_cut_after(int n) {
+	power_cut_countdown = n;
+}
+
+int fs_modifications() {
+	return num_fs_modifications;
+}
+
+}
+
+using namespace sim;
+
+////////////////////////////////////////////////////////////////////////////////
+// Arduino
+
+unsigned long millis() {
+	return clock_ns / 1000000ull;
+}
+
+unsigned long micros() {
+	return clock_ns / 1000ull;
+}
+
+uint64_t micros64() {
+	return clock_ns / 1000ull;
+}
+
+void delay(unsigned long ms) {
+	advance_ms(ms);
+}
+
+void yield() {
+}
+
+int analogRead(uint8_t pin) {
+	int value = adc_source ? adc_source() : adc_value;
+	advance_us(analog_read_us);
+	return value;
+}
+
+int digitalRead(uint8_t pin) {
+	return pin_is_output[pin] ? digital_outputs[pin] : digital_inputs[pin];
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+	digital_outputs[pin] = value;
+	if (log_pins) {
+		HeapPause pause;
+		pin_log.push_back({clock_ns, pin, value});
+	}
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	pin_is_output[pin] = mode == OUTPUT;
+	if (mode == INPUT_PULLUP) {
+		digital_inputs[pin] = HIGH;
+	}
+}
+
+void timer1_attachInterrupt(timercallback callback) {
+	timer1_callback = callback;
+}
+
+void timer1_enable(uint8_t divider, uint8_t int_type, uint8_t reload) {
+	// Picoseconds per tick of the 80 MHz clock after division
+	switch (divider) {
+		case TIM_DIV1: timer1_tick_ps = 12500; break;
+		case TIM_DIV16: timer1_tick_ps = 200000; break;
+		default: timer1_tick_ps = 3200000; break;
+	}
+	timer1_enabled = true;
+}
+
+void timer1_disable() {
+	timer1_enabled = false;
+	timer1_armed = false;
+}
+
+void timer1_write(uint32_t ticks) {
+	timer1_due_ns = clock_ns + (ticks * timer1_tick_ps) / 1000ull;
+	timer1_armed = true;
+}
+
+void configTime(int timezone_sec, int daylight_offset_sec, const char *server1,
+                const char *server2, const char *server3) {
+}
+
+/**
+ * Replaces the C library's gettimeofday() so that the board sees the virtual
+ * clock (and SNTP only appears to have set the time if unix_time_at_zero is
+ * set).
+ */
+extern "C" int gettimeofday(struct timeval *tv, void *tz) noexcept {
+	uint64_t us = clock_ns / 1000ull;
+	if (unix_time_at_zero) {
+		us += unix_time_at_zero * 1000000ull;
+	}
+	tv->tv_sec = us / 1000000ull;
+	tv->tv_usec = us % 1000000ull;
+	return 0;
+}
+
+void HardwareSerial::write(const char *str) {
+	static const bool enabled = getenv("SIM_SERIAL") != NULL;
+	if (enabled) {
+		fputs(str, stderr);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ESP
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+	if (offset * 4 + size > SIM_RTC_SIZE) {
+		return false;
+	}
+	memcpy(data, get_persistent().rtc + offset * 4, size);
+	return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+	if (offset * 4 + size > SIM_RTC_SIZE) {
+		return false;
+	}
+	memcpy(get_persistent().rtc + offset * 4, data, size);
+	return true;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector) {
+	power_cut_point();
+	if (flash_fail) {
+		return false;
+	}
+	int index = flash_sector_index(sector * SPI_FLASH_SEC_SIZE);
+	memset(get_persistent().flash[index], 0xFF, SPI_FLASH_SEC_SIZE);
+	flash_erases++;
+	return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, const uint32_t *data, size_t size) {
+	power_cut_point();
+	int index = flash_sector_index(address);
+	size_t offset = address % SPI_FLASH_SEC_SIZE;
+	if (offset + size > SPI_FLASH_SEC_SIZE || flash_fail) {
+		return false;
+	}
+	// NB: Writes can only clear bits
+	const uint8_t *bytes = (const uint8_t *)data;
+	for (size_t i = 0; i < size; i++) {
+		get_persistent().flash[index][offset + i] &= bytes[i];
+	}
+	flash_writes++;
+	return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t *data, size_t size) {
+	int index = flash_sector_index(address);
+	size_t offset = address % SPI_FLASH_SEC_SIZE;
+	if (offset + size > SPI_FLASH_SEC_SIZE) {
+		return false;
+	}
+	memcpy(data, get_persistent().flash[index] + offset, size);
+	return true;
+}
+
+uint32_t EspClass::getFreeHeap() {
+	return heap_bytes < SIM_HEAP_SIZE ? SIM_HEAP_SIZE - heap_bytes : 0;
+}
+
+rst_info *EspClass::getResetInfoPtr() {
+	static rst_info info;
+	info.reason = reset_reason;
+	return &info;
+}
+
+void EspClass::restart() {
+	if (!in_boot) {
+		fprintf(stderr, "sim: ESP.restart() called outside sim::boot()\n");
+		abort();
+	}
+	end_boot(BOOT_RESTARTED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Heap
+
+namespace {
+
+// Each allocation is preceded by a header recording its size
+const size_t HEAP_HEADER_SIZE = 16;
+
+void *heap_alloc(size_t size) {
+	uint8_t *p = (uint8_t *)malloc(size + HEAP_HEADER_SIZE);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	*(size_t *)p = heap_pause_depth ? 0 : size;
+	if (!heap_pause_depth) {
+		heap_allocations++;
+		heap_bytes += size;
+	}
+	return p + HEAP_HEADER_SIZE;
+}
+
+void heap_free(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+	uint8_t *p = (uint8_t *)ptr - HEAP_HEADER_SIZE;
+	size_t size = *(size_t *)p;
+	if (size) {
+		heap_allocations--;
+		heap_bytes -= size;
+	}
+	free(p);
+}
+
+}
+
+void *operator new(size_t size) { return heap_alloc(size); }
+void *operator new[](size_t size) { return heap_alloc(size); }
+void operator delete(void *ptr) noexcept { heap_free(ptr); }
+void operator delete[](void *ptr) noexcept { heap_free(ptr); }
+void operator delete(void *ptr, size_t size) noexcept { heap_free(ptr); }
+void operator delete[](void *ptr, size_t size) noexcept { heap_free(ptr); }
+
+////////////////////////////////////////////////////////////////////////////////
+// Servo
+
+void Servo::attach(int pin, int min_us, int max_us) {
+	this->pin = pin;
+}
+
+void Servo::write(int angle) {
+	if (attached() && servo_hook) {
+		servo_hook(angle);
+	}
+}
+
+void Servo::detach() {
+	pin = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FourThreeThree
+
+void FourThreeThree_rx_begin(int pin,
+                             unsigned long zero_min_us,
+                             unsigned long zero_max_us,
+                             unsigned long one_min_us,
+                             unsigned long one_max_us,
+                             unsigned long symbol_max_us) {
+}
+
+bool FourThreeThree_rx(unsigned long *code, unsigned int *code_length) {
+	if (rx_queue.empty() || rx_queue.front().ns > clock_ns) {
+		return false;
+	}
+	*code = rx_queue.front().code;
+	*code_length = rx_queue.front().code_length;
+	HeapPause pause;
+	rx_queue.pop_front();
+	return true;
+}
+
+void FourThreeThree_tx_begin(int pin) {
+}
+
+bool FourThreeThree_tx(unsigned long code, unsigned int code_length) {
+	if (clock_ns < four_three_three_busy_until_ns) {
+		return false;
+	}
+	HeapPause pause;
+	tx_log.push_back({code, code_length, clock_ns});
+	four_three_three_busy_until_ns = clock_ns + four_three_three_tx_us * 1000ull;
+	return true;
+}
+
+void FourThreeThree_tx_loop() {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Qth
+
+namespace Qth {
+
+void QthClient::loop() {
+	HeapPause pause;
+	if (qth_poll) {
+		qth_poll();
+	}
+	
+	// NB: Only messages already waiting are delivered (callbacks may queue
+	// more).
+	size_t num_messages = qth_inbox.size();
+	for (size_t i = 0; i < num_messages && qth_connected; i++) {
+		QthMessage message = qth_inbox.front();
+		qth_inbox.pop_front();
+		
+		heap_pause_depth--;
+		if (message.is_event) {
+			for (Event *event : std::vector<Event *>(watched_events)) {
+				if (event->callback && message.path == event->path) {
+					event->callback(message.path.c_str(), message.value.c_str());
+				}
+			}
+		} else {
+			for (Property *property : std::vector<Property *>(watched_properties)) {
+				if (property->callback && message.path == property->path) {
+					property->callback(message.path.c_str(), message.value.c_str());
+				}
+			}
+		}
+		heap_pause_depth++;
+	}
+}
+
+bool QthClient::connected() {
+	return qth_connected;
+}
+
+void QthClient::registerProperty(Property *property) {
+	HeapPause pause;
+	registered_properties.push_back(property);
+}
+
+void QthClient::unregisterProperty(Property *property) {
+	remove_from(registered_properties, property);
+}
+
+void QthClient::watchProperty(Property *property) {
+	HeapPause pause;
+	watched_properties.push_back(property);
+}
+
+void QthClient::unwatchProperty(Property *property) {
+	remove_from(watched_properties, property);
+}
+
+void QthClient::setProperty(Property *property, const char *value) {
+	qth_publish(false, property->path, value);
+}
+
+void QthClient::registerEvent(Event *event) {
+	HeapPause pause;
+	registered_events.push_back(event);
+}
+
+void QthClient::unregisterEvent(Event *event) {
+	remove_from(registered_events, event);
+}
+
+void QthClient::watchEvent(Event *event) {
+	HeapPause pause;
+	watched_events.push_back(event);
+}
+
+void QthClient::unwatchEvent(Event *event) {
+	remove_from(watched_events, event);
+}
+
+void QthClient::sendEvent(Event *event, const char *value) {
+	qth_publish(true, event->path, value);
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LittleFS
+
+struct File::Impl {
+	std::string path;
+	std::vector<uint8_t> data;
+	size_t pos;
+	bool writable;
+	bool append;
+	bool dirty;
+	bool open;
+	
+	~Impl() {
+		close();
+	}
+	
+	void close() {
+		if (open && writable && dirty) {
+			fs_modify();
+			FsEntry *entry = fs_find(path.c_str());
+			if (!entry) {
+				entry = fs_create(path.c_str());
+			}
+			if (data.size() > SIM_FS_MAX_FILE_SIZE) {
+				fprintf(stderr, "sim: file too large: %s\n", path.c_str());
+				abort();
+			}
+			memcpy(entry->data, data.data(), data.size());
+			entry->size = data.size();
+		}
+		open = false;
+	}
+};
+
+size_t File::read(uint8_t *buf, size_t size) {
+	if (!impl || !impl->open) {
+		return 0;
+	}
+	size_t n = std::min(size, impl->data.size() - impl->pos);
+	memcpy(buf, impl->data.data() + impl->pos, n);
+	impl->pos += n;
+	return n;
+}
+
+size_t File::write(const uint8_t *buf, size_t size) {
+	if (!impl || !impl->open || !impl->writable) {
+		return 0;
+	}
+	HeapPause pause;
+	if (impl->append) {
+		impl->pos = impl->data.size();
+	}
+	if (impl->pos + size > impl->data.size()) {
+		impl->data.resize(impl->pos + size);
+	}
+	memcpy(impl->data.data() + impl->pos, buf, size);
+	impl->pos += size;
+	impl->dirty = true;
+	return size;
+}
+
+bool File::seek(uint32_t pos) {
+	if (!impl || !impl->open || pos > impl->data.size()) {
+		return false;
+	}
+	impl->pos = pos;
+	return true;
+}
+
+size_t File::position() const {
+	return impl ? impl->pos : 0;
+}
+
+size_t File::size() const {
+	return impl ? impl->data.size() : 0;
+}
+
+void File::close() {
+	if (impl) {
+		impl->close();
+		impl.reset();
+	}
+}
+
+bool Dir::next() {
+	index++;
+	return index < (int)entries.size();
+}
+
+String Dir::fileName() const {
+	return String(entries[index].name);
+}
+
+size_t Dir::fileSize() const {
+	return entries[index].size;
+}
+
+bool FS::begin() {
+	get_persistent();
+	return true;
+}
+
+bool FS::format() {
+	fs_modify();
+	memset(get_persistent().files, 0, sizeof(get_persistent().files));
+	return true;
+}
+
+bool FS::info(FSInfo &info) {
+	info.totalBytes = SIM_FS_MAX_FILES * SIM_FS_MAX_FILE_SIZE;
+	info.usedBytes = 0;
+	for (const FsEntry &entry : get_persistent().files) {
+		if (entry.used) {
+			info.usedBytes += entry.size;
+		}
+	}
+	info.blockSize = 4096;
+	info.pageSize = 256;
+	info.maxOpenFiles = 5;
+	info.maxPathLength = SIM_FS_PATH_LENGTH;
+	return true;
+}
+
+File FS::open(const char *path, const char *mode) {
+	HeapPause pause;
+	FsEntry *entry = fs_find(path);
+	bool read_only = strcmp(mode, "r") == 0;
+	if (read_only && !entry) {
+		return File();
+	}
+	if (!read_only && !entry) {
+		// NB: LittleFS creates the (empty) file when it is opened
+		fs_modify();
+		entry = fs_create(path);
+	}
+	
+	std::shared_ptr<File::Impl> impl = std::make_shared<File::Impl>();
+	impl->path = path;
+	impl->writable = !read_only;
+	impl->append = mode[0] == 'a';
+	impl->dirty = mode[0] == 'w' && entry->size;
+	impl->open = true;
+	if (mode[0] != 'w') {
+		impl->data.assign(entry->data, entry->data + entry->size);
+	}
+	impl->pos = impl->append ? impl->data.size() : 0;
+	return File(impl);
+}
+
+bool FS::exists(const char *path) {
+	return fs_find(path) != NULL;
+}
+
+bool FS::remove(const char *path) {
+	FsEntry *entry = fs_find(path);
+	if (!entry) {
+		return false;
+	}
+	fs_modify();
+	entry->used = false;
+	return true;
+}
+
+bool FS::rename(const char *from, const char *to) {
+	FsEntry *entry = fs_find(from);
+	if (!entry) {
+		return false;
+	}
+	// NB: Atomically replaces any existing file
+	fs_modify();
+	FsEntry *existing = fs_find(to);
+	if (existing) {
+		existing->used = false;
+	}
+	strcpy(entry->path, to);
+	return true;
+}
+
+bool FS::mkdir(const char *path) {
+	return true;
+}
+
+Dir FS::openDir(const char *path) {
+	HeapPause pause;
+	Dir dir;
+	std::string prefix = std::string(path) + "/";
+	for (const FsEntry &entry : get_persistent().files) {
+		if (entry.used &&
+		    strncmp(entry.path, prefix.c_str(), prefix.size()) == 0 &&
+		    !strchr(entry.path + prefix.size(), '/')) {
+			dir.entries.push_back({entry.path + prefix.size(), entry.size});
+		}
+	}
+	std::sort(dir.entries.begin(), dir.entries.end(),
+	          [](const Dir::Entry &a, const Dir::Entry &b) { return a.name < b.name; });
+	return dir;
+}
@@ -0,0 +1,255 @@
+/**
+ * A simulated ESP8266 for running the boards' unmodified src/main.cpp on a
+ * Linux host.
+ *
+ * Time is virtual: it only advances when the board calls delay() (or reads the
+ * ADC) and when the test calls advance() or run(). Days of board time can
+ * therefore be simulated in milliseconds. NB: Unlike the real millis() and
+ * micros() the simulated ones do not wrap around (unsigned long is 64 bits on
+ * the host); code whose wraparound behaviour is under test should be driven
+ * from its own (injected) 32-bit clock.
+ *
+ * RTC memory, the flash and the filesystem are kept in memory shared between
+ * processes. Each boot of the board runs in a forked child process (see boot())
+ * so that the board's globals start afresh every time while anything persisted
+ * survives into the next boot, just as on the real board.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <Arduino.h>
+#include <Qth.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+////////////////////////////////////////////////////////////////////////////////
+// Clock
+
+/**
+ * Current virtual time (ns since the simulation started).
+ */
+uint64_t now_ns();
+
+/**
+ * Advance the virtual clock, running any timer1 interrupts which fall due.
+ */
+void advance_us(uint64_t us);
+void advance_ms(uint64_t ms);
+
+/**
+ * Time (us) each analogRead() takes.
+ */
+extern uint64_t analog_read_us;
+
+/**
+ * Statistics about the calls to the board's loop() made by run().
+ */
+struct LoopStats {
+	uint64_t iterations;
+	// Longest time (us) spent in a single call to loop()
+	uint64_t max_iteration_us;
+	// Total time (us) spent in loop() (excluding the idle step between calls)
+	uint64_t total_iteration_us;
+};
+
+/**
+ * Call loop() repeatedly for duration_ms of virtual time, advancing the
+ * clock by step_us between calls (in addition to any time the call itself
+ * takes).
+ */
+LoopStats run(void (*loop)(), uint64_t duration_ms, uint64_t step_us = 1000);
+
+////////////////////////////////////////////////////////////////////////////////
+// Peripherals
+
+/**
+ * Source of analogRead() values. Defaults to a constant adc_value.
+ */
+extern std::function<int()> adc_source;
+extern int adc_value;
+
+/**
+ * Level read by digitalRead() from each pin (when not an output).
+ */
+extern int digital_inputs[32];
+
+/**
+ * Current level written to each pin by digitalWrite().
+ */
+extern int digital_outputs[32];
+
+/**
+ * If set, every digitalWrite() is appended to pin_log.
+ */
+struct PinChange {
+	uint64_t ns;
+	int pin;
+	int value;
+};
+extern bool log_pins;
+extern std::vector<PinChange> pin_log;
+
+/**
+ * Called with every position written to a (attached) servo.
+ */
+extern std::function<void(int angle)> servo_hook;
+
+/**
+ * Codes to be returned by FourThreeThree_rx() and codes given to
+ * FourThreeThree_tx().
+ */
+struct RadioCode {
+	unsigned long code;
+	unsigned int code_length;
+	uint64_t ns;
+};
+extern std::deque<RadioCode> rx_queue;
+extern std::vector<RadioCode> tx_log;
+
+/**
+ * Time (us) FourThreeThree_tx() remains busy after accepting a code.
+ */
+extern uint64_t four_three_three_tx_us;
+
+/**
+ * Time (s since the UNIX epoch) returned by gettimeofday() at virtual time
+ * zero, or 0 if the time has not been set (e.g. by SNTP).
+ */
+extern uint64_t unix_time_at_zero;
+
+////////////////////////////////////////////////////////////////////////////////
+// Qth
+
+struct QthMessage {
+	bool is_event;
+	std::string path;
+	std::string value;
+	uint64_t ns;
+};
+
+/**
+ * Is the Qth client connected?
+ */
+extern bool qth_connected;
+
+/**
+ * Property sets and events sent by the board (unless qth_transport is set).
+ */
+extern std::vector<QthMessage> qth_log;
+
+/**
+ * If set, property sets and events sent by the board are passed here instead
+ * of being added to qth_log.
+ */
+extern std::function<void(const QthMessage &message)> qth_transport;
+
+/**
+ * If set, called by every QthClient::loop() (e.g. to receive messages from a
+ * transport and pass them to qth_set_property/qth_send_event).
+ */
+extern std::function<void()> qth_poll;
+
+/**
+ * Deliver a property value or event to the board during the next
+ * QthClient::loop(). Only delivered if the board watches the path.
+ */
+void qth_set_property(const char *path, const char *value);
+void qth_send_event(const char *path, const char *value);
+
+/**
+ * Is a property or event with the given path currently registered?
+ */
+bool qth_is_registered(const char *path);
+
+/**
+ * The messages in qth_log sent to a given path.
+ */
+std::vector<QthMessage> qth_sent(const char *path);
+
+/**
+ * The most recent value sent to a given path (or NULL if none).
+ */
+const char *qth_last(const char *path);
+
+////////////////////////////////////////////////////////////////////////////////
+// Heap
+
+/**
+ * Number and total size of heap allocations made (and not yet freed) since
+ * the process started.
+ */
+extern uint64_t heap_allocations;
+extern uint64_t heap_bytes;
+
+////////////////////////////////////////////////////////////////////////////////
+// Boots, resets and power loss
+
+/**
+ * The outcome of a boot.
+ */
+struct BootResult {
+	// Number of test failures during the boot
+	int failures;
+	// Did the boot end with ESP.restart()?
+	bool restarted;
+	// Did the boot end with an injected power cut?
+	bool power_cut;
+	// Did the boot end abnormally (e.g. a crash)?
+	bool crashed;
+};
+
+/**
+ * Run fn as a fresh boot of the board in a child process and wait for it to
+ * finish. RTC memory, flash and the filesystem persist from previous boots.
+ * Test failures within fn (see test.h) are reported in the result.
+ */
+BootResult boot(std::function<void()> fn);
+
+/**
+ * Simulate the power being removed: RTC memory is lost. (The flash and the
+ * filesystem keep whatever had been committed.)
+ */
+void power_off();
+
+/**
+ * Erase the flash, the filesystem and RTC memory.
+ */
+void erase_all();
+
+/**
+ * Cut the power (ending the current boot) immediately before the nth
+ * following filesystem modification or flash sector erase or write (0 being
+ * the next). Negative disables the power cut.
+ */
+void power_cut_after(int n);
+
+/**
+ * Number of filesystem modifications made during the current boot.
+ */
+int fs_modifications();
+
+/**
+ * Number of flash sector erases and writes made during the current boot.
+ */
+extern int flash_erases;
+extern int flash_writes;
+
+/**
+ * If set, flash sector erases and writes fail (leaving the flash unchanged).
+ */
+extern bool flash_fail;
+
+/**
+ * Reset reason reported by ESP.getResetInfoPtr() (0 = power on).
+ */
+extern uint32_t reset_reason;
+
+}
+
+#endif
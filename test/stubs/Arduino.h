@@ -0,0 +1,176 @@
+/**
+ * Host stand-in for the parts of the ESP8266 Arduino core used by the boards.
+ *
+ * Everything here is implemented by sim.cpp on top of a virtual clock (see
+ * sim.h) so that the boards' unmodified src/main.cpp can be built and driven
+ * on a Linux host.
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+#define PROGMEM
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+#define memcpy_P memcpy
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+// NodeMCU pin numbering
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define A0 17
+#define LED_BUILTIN 16
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+#define TIM_DIV1 0
+#define TIM_DIV16 1
+#define TIM_DIV256 3
+#define TIM_EDGE 0
+#define TIM_LEVEL 1
+#define TIM_SINGLE 0
+#define TIM_LOOP 1
+
+unsigned long millis();
+unsigned long micros();
+uint64_t micros64();
+void delay(unsigned long ms);
+void yield();
+
+int analogRead(uint8_t pin);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+void pinMode(uint8_t pin, uint8_t mode);
+
+typedef void (*timercallback)(void);
+void timer1_attachInterrupt(timercallback callback);
+void timer1_enable(uint8_t divider, uint8_t int_type, uint8_t reload);
+void timer1_disable();
+void timer1_write(uint32_t ticks);
+
+void configTime(int timezone_sec, int daylight_offset_sec, const char *server1,
+                const char *server2 = NULL, const char *server3 = NULL);
+
+class String {
+	public:
+		String(const char *str = "")
+			: str(str ? str : "")
+		{
+		}
+		
+		String(const std::string &str)
+			: str(str)
+		{
+		}
+		
+		explicit String(double value, unsigned char decimal_places = 2) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%.*f", decimal_places, value);
+			str = buf;
+		}
+		
+		const char *c_str() const {
+			return str.c_str();
+		}
+		
+		size_t length() const {
+			return str.size();
+		}
+	
+	private:
+		std::string str;
+};
+
+/**
+ * Serial output is discarded unless the SIM_SERIAL environment variable is
+ * set, in which case it is written to stderr.
+ */
+class HardwareSerial {
+	public:
+		void begin(unsigned long baud) {}
+		
+		void print(const char *str) { write(str); }
+		void print(const String &str) { write(str.c_str()); }
+		void print(char c) { char buf[2] = {c, '\0'}; write(buf); }
+		void print(int n) { printf_("%d", n); }
+		void print(unsigned int n) { printf_("%u", n); }
+		void print(long n) { printf_("%ld", n); }
+		void print(unsigned long n) { printf_("%lu", n); }
+		void print(long long n) { printf_("%lld", n); }
+		void print(unsigned long long n) { printf_("%llu", n); }
+		void print(double n) { printf_("%.2f", n); }
+		
+		template <typename T>
+		void println(const T &value) {
+			print(value);
+			println();
+		}
+		void println() { write("\r\n"); }
+	
+	private:
+		void write(const char *str);
+		
+		template <typename T>
+		void printf_(const char *format, T value) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), format, value);
+			write(buf);
+		}
+};
+
+extern HardwareSerial Serial;
+
+struct rst_info {
+	uint32_t reason;
+	uint32_t exccause;
+	uint32_t epc1;
+	uint32_t epc2;
+	uint32_t epc3;
+	uint32_t excvaddr;
+	uint32_t depc;
+};
+
+class EspClass {
+	public:
+		bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+		bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+		
+		bool flashEraseSector(uint32_t sector);
+		bool flashWrite(uint32_t address, const uint32_t *data, size_t size);
+		bool flashRead(uint32_t address, uint32_t *data, size_t size);
+		
+		uint32_t getFreeHeap();
+		rst_info *getResetInfoPtr();
+		
+		[[noreturn]] void restart();
+};
+
+extern EspClass ESP;
+
+#endif
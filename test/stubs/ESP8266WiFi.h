@@ -0,0 +1,30 @@
+/**
+ * Host stand-in for the ESP8266WiFi library (see Arduino.h). WiFi is always
+ * connected; the Qth connection state is controlled via sim.h.
+ */
+
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include <Arduino.h>
+
+#define WIFI_OFF 0
+#define WIFI_STA 1
+
+#define WL_IDLE_STATUS 0
+#define WL_CONNECTED 3
+
+class ESP8266WiFiClass {
+	public:
+		void mode(int mode) {}
+		void begin(const char *ssid, const char *password) {}
+		int status() { return WL_CONNECTED; }
+		const char *localIP() { return "127.0.0.1"; }
+};
+
+extern ESP8266WiFiClass WiFi;
+
+class WiFiClient {
+};
+
+#endif
@@ -0,0 +1,24 @@
+/**
+ * Host stand-in for the FourThreeThree 433 MHz library (see Arduino.h).
+ * Received codes are taken from sim::rx_queue and transmitted codes appended
+ * to sim::tx_log.
+ */
+
+#ifndef FOUR_THREE_THREE_H
+#define FOUR_THREE_THREE_H
+
+#include <Arduino.h>
+
+void FourThreeThree_rx_begin(int pin,
+                             unsigned long zero_min_us,
+                             unsigned long zero_max_us,
+                             unsigned long one_min_us,
+                             unsigned long one_max_us,
+                             unsigned long symbol_max_us);
+bool FourThreeThree_rx(unsigned long *code, unsigned int *code_length);
+
+void FourThreeThree_tx_begin(int pin);
+bool FourThreeThree_tx(unsigned long code, unsigned int code_length);
+void FourThreeThree_tx_loop();
+
+#endif
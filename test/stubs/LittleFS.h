@@ -0,0 +1,87 @@
+/**
+ * Host stand-in for the LittleFS filesystem (see Arduino.h).
+ *
+ * Files live in memory which survives simulated reboots (see sim::boot). As
+ * with LittleFS, the contents written to a file only become visible (and
+ * durable) when it is closed and rename() atomically replaces any existing
+ * destination. Every operation which modifies the filesystem is a point at
+ * which a power cut can be injected (see sim::power_cut_after).
+ */
+
+#ifndef LITTLEFS_H
+#define LITTLEFS_H
+
+#include <Arduino.h>
+
+#include <memory>
+#include <vector>
+
+class File {
+	public:
+		struct Impl;
+		
+		File() {}
+		File(std::shared_ptr<Impl> impl)
+			: impl(impl)
+		{
+		}
+		
+		operator bool() const {
+			return (bool)impl;
+		}
+		
+		size_t read(uint8_t *buf, size_t size);
+		size_t write(const uint8_t *buf, size_t size);
+		bool seek(uint32_t pos);
+		size_t position() const;
+		size_t size() const;
+		void close();
+	
+	private:
+		std::shared_ptr<Impl> impl;
+};
+
+class Dir {
+	public:
+		bool next();
+		String fileName() const;
+		size_t fileSize() const;
+	
+	private:
+		friend class FS;
+		
+		struct Entry {
+			std::string name;
+			size_t size;
+		};
+		std::vector<Entry> entries;
+		int index = -1;
+};
+
+struct FSInfo {
+	size_t totalBytes;
+	size_t usedBytes;
+	size_t blockSize;
+	size_t pageSize;
+	size_t maxOpenFiles;
+	size_t maxPathLength;
+};
+
+class FS {
+	public:
+		bool begin();
+		void end() {}
+		bool format();
+		bool info(FSInfo &info);
+		
+		File open(const char *path, const char *mode);
+		bool exists(const char *path);
+		bool remove(const char *path);
+		bool rename(const char *from, const char *to);
+		bool mkdir(const char *path);
+		Dir openDir(const char *path);
+};
+
+extern FS LittleFS;
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * Host stand-in for the Qth client library (see Arduino.h).
+ *
+ * Property sets and events sent by the board are recorded in sim::qth_log (or
+ * passed to sim::qth_transport if set) and values from other clients are
+ * delivered to watched properties and events by QthClient::loop() (see
+ * sim::qth_set_property and sim::qth_send_event).
+ */
+
+#ifndef QTH_H
+#define QTH_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+namespace Qth {
+
+typedef void (*callback_t)(const char *topic, const char *value);
+
+class Property {
+	public:
+		Property(const char *path, const char *description, bool one_to_many = false)
+			: path(path)
+			, callback(NULL)
+			, description(description)
+			, one_to_many(one_to_many)
+			, delete_on_unregister(NULL)
+		{
+		}
+		
+		Property(const char *path, callback_t callback, const char *description,
+		         bool one_to_many = false, const char *delete_on_unregister = NULL)
+			: path(path)
+			, callback(callback)
+			, description(description)
+			, one_to_many(one_to_many)
+			, delete_on_unregister(delete_on_unregister)
+		{
+		}
+		
+		const char *path;
+		callback_t callback;
+		const char *description;
+		bool one_to_many;
+		const char *delete_on_unregister;
+};
+
+class Event {
+	public:
+		Event(const char *path, const char *description, bool one_to_many = false)
+			: path(path)
+			, callback(NULL)
+			, description(description)
+			, one_to_many(one_to_many)
+		{
+		}
+		
+		Event(const char *path, callback_t callback, const char *description,
+		      bool one_to_many = false)
+			: path(path)
+			, callback(callback)
+			, description(description)
+			, one_to_many(one_to_many)
+		{
+		}
+		
+		const char *path;
+		callback_t callback;
+		const char *description;
+		bool one_to_many;
+};
+
+class QthClient {
+	public:
+		QthClient(const char *server, WiFiClient &client,
+		          const char *client_id, const char *description)
+			: client_id(client_id)
+		{
+		}
+		
+		void loop();
+		bool connected();
+		
+		void registerProperty(Property *property);
+		void unregisterProperty(Property *property);
+		void watchProperty(Property *property);
+		void unwatchProperty(Property *property);
+		void setProperty(Property *property, const char *value);
+		
+		void registerEvent(Event *event);
+		void unregisterEvent(Event *event);
+		void watchEvent(Event *event);
+		void unwatchEvent(Event *event);
+		void sendEvent(Event *event, const char *value);
+		
+		const char *const client_id;
+};
+
+}
+
+#endif
@@ -0,0 +1,30 @@
+/**
+ * Host stand-in for the Servo library (see Arduino.h). Positions written are
+ * passed to sim::servo_hook.
+ */
+
+#ifndef SERVO_H
+#define SERVO_H
+
+#include <Arduino.h>
+
+class Servo {
+	public:
+		Servo()
+			: pin(-1)
+		{
+		}
+		
+		void attach(int pin, int min_us = 544, int max_us = 2400);
+		void write(int angle);
+		void detach();
+		
+		bool attached() const {
+			return pin >= 0;
+		}
+	
+	private:
+		int pin;
+};
+
+#endif
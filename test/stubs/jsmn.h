@@ -0,0 +1,276 @@
+/**
+ * Host copy of the jsmn JSON tokeniser (https://github.com/zserge/jsmn, MIT
+ * licence) in its default (non-strict) configuration, as used by the radio
+ * board.
+ */
+
+#ifndef JSMN_H
+#define JSMN_H
+
+#include <stddef.h>
+
+typedef enum {
+	JSMN_UNDEFINED = 0,
+	JSMN_OBJECT = 1,
+	JSMN_ARRAY = 2,
+	JSMN_STRING = 3,
+	JSMN_PRIMITIVE = 4,
+} jsmntype_t;
+
+enum jsmnerr {
+	// Not enough tokens were provided
+	JSMN_ERROR_NOMEM = -1,
+	// Invalid character inside JSON string
+	JSMN_ERROR_INVAL = -2,
+	// The string is not a full JSON packet, more bytes expected
+	JSMN_ERROR_PART = -3,
+};
+
+typedef struct {
+	jsmntype_t type;
+	int start;
+	int end;
+	int size;
+} jsmntok_t;
+
+typedef struct {
+	unsigned int pos;
+	unsigned int toknext;
+	int toksuper;
+} jsmn_parser;
+
+static inline jsmntok_t *jsmn_alloc_token(jsmn_parser *parser, jsmntok_t *tokens,
+                                          size_t num_tokens) {
+	if (parser->toknext >= num_tokens) {
+		return NULL;
+	}
+	jsmntok_t *tok = &tokens[parser->toknext++];
+	tok->start = tok->end = -1;
+	tok->size = 0;
+	return tok;
+}
+
+static inline void jsmn_fill_token(jsmntok_t *token, jsmntype_t type, int start, int end) {
+	token->type = type;
+	token->start = start;
+	token->end = end;
+	token->size = 0;
+}
+
+static inline int jsmn_parse_primitive(jsmn_parser *parser, const char *js, size_t len,
+                                       jsmntok_t *tokens, size_t num_tokens) {
+	int start = parser->pos;
+	for (; parser->pos < len && js[parser->pos] != '\0'; parser->pos++) {
+		switch (js[parser->pos]) {
+			case ':':
+			case '\t':
+			case '\r':
+			case '\n':
+			case ' ':
+			case ',':
+			case ']':
+			case '}':
+				goto found;
+			default:
+				break;
+		}
+		if (js[parser->pos] < 32 || js[parser->pos] >= 127) {
+			parser->pos = start;
+			return JSMN_ERROR_INVAL;
+		}
+	}
+
+found:
+	if (tokens == NULL) {
+		parser->pos--;
+		return 0;
+	}
+	jsmntok_t *token = jsmn_alloc_token(parser, tokens, num_tokens);
+	if (token == NULL) {
+		parser->pos = start;
+		return JSMN_ERROR_NOMEM;
+	}
+	jsmn_fill_token(token, JSMN_PRIMITIVE, start, parser->pos);
+	parser->pos--;
+	return 0;
+}
+
+static inline int jsmn_parse_string(jsmn_parser *parser, const char *js, size_t len,
+                                    jsmntok_t *tokens, size_t num_tokens) {
+	int start = parser->pos;
+	parser->pos++;
+	for (; parser->pos < len && js[parser->pos] != '\0'; parser->pos++) {
+		char c = js[parser->pos];
+		if (c == '\"') {
+			if (tokens == NULL) {
+				return 0;
+			}
+			jsmntok_t *token = jsmn_alloc_token(parser, tokens, num_tokens);
+			if (token == NULL) {
+				parser->pos = start;
+				return JSMN_ERROR_NOMEM;
+			}
+			jsmn_fill_token(token, JSMN_STRING, start + 1, parser->pos);
+			return 0;
+		}
+		if (c == '\\' && parser->pos + 1 < len) {
+			parser->pos++;
+			switch (js[parser->pos]) {
+				case '\"':
+				case '/':
+				case '\\':
+				case 'b':
+				case 'f':
+				case 'r':
+				case 'n':
+				case 't':
+					break;
+				case 'u':
+					parser->pos++;
+					for (int i = 0; i < 4 && parser->pos < len && js[parser->pos] != '\0'; i++) {
+						char h = js[parser->pos];
+						if (!((h >= '0' && h <= '9') || (h >= 'A' && h <= 'F') || (h >= 'a' && h <= 'f'))) {
+							parser->pos = start;
+							return JSMN_ERROR_INVAL;
+						}
+						parser->pos++;
+					}
+					parser->pos--;
+					break;
+				default:
+					parser->pos = start;
+					return JSMN_ERROR_INVAL;
+			}
+		}
+	}
+	parser->pos = start;
+	return JSMN_ERROR_PART;
+}
+
+static inline void jsmn_init(jsmn_parser *parser) {
+	parser->pos = 0;
+	parser->toknext = 0;
+	parser->toksuper = -1;
+}
+
+static inline int jsmn_parse(jsmn_parser *parser, const char *js, size_t len,
+                             jsmntok_t *tokens, unsigned int num_tokens) {
+	int count = parser->toknext;
+	for (; parser->pos < len && js[parser->pos] != '\0'; parser->pos++) {
+		char c = js[parser->pos];
+		switch (c) {
+			case '{':
+			case '[': {
+				count++;
+				if (tokens == NULL) {
+					break;
+				}
+				jsmntok_t *token = jsmn_alloc_token(parser, tokens, num_tokens);
+				if (token == NULL) {
+					return JSMN_ERROR_NOMEM;
+				}
+				if (parser->toksuper != -1) {
+					tokens[parser->toksuper].size++;
+				}
+				token->type = (c == '{' ? JSMN_OBJECT : JSMN_ARRAY);
+				token->start = parser->pos;
+				parser->toksuper = parser->toknext - 1;
+				break;
+			}
+			
+			case '}':
+			case ']': {
+				if (tokens == NULL) {
+					break;
+				}
+				jsmntype_t type = (c == '}' ? JSMN_OBJECT : JSMN_ARRAY);
+				int i;
+				for (i = parser->toknext - 1; i >= 0; i--) {
+					jsmntok_t *token = &tokens[i];
+					if (token->start != -1 && token->end == -1) {
+						if (token->type != type) {
+							return JSMN_ERROR_INVAL;
+						}
+						parser->toksuper = -1;
+						token->end = parser->pos + 1;
+						break;
+					}
+				}
+				// Error if unmatched closing bracket
+				if (i == -1) {
+					return JSMN_ERROR_INVAL;
+				}
+				for (; i >= 0; i--) {
+					jsmntok_t *token = &tokens[i];
+					if (token->start != -1 && token->end == -1) {
+						parser->toksuper = i;
+						break;
+					}
+				}
+				break;
+			}
+			
+			case '\"': {
+				int r = jsmn_parse_string(parser, js, len, tokens, num_tokens);
+				if (r < 0) {
+					return r;
+				}
+				count++;
+				if (parser->toksuper != -1 && tokens != NULL) {
+					tokens[parser->toksuper].size++;
+				}
+				break;
+			}
+			
+			case '\t':
+			case '\r':
+			case '\n':
+			case ' ':
+				break;
+			
+			case ':':
+				parser->toksuper = parser->toknext - 1;
+				break;
+			
+			case ',':
+				if (tokens != NULL && parser->toksuper != -1 &&
+				    tokens[parser->toksuper].type != JSMN_ARRAY &&
+				    tokens[parser->toksuper].type != JSMN_OBJECT) {
+					for (int i = parser->toknext - 1; i >= 0; i--) {
+						if (tokens[i].type == JSMN_ARRAY || tokens[i].type == JSMN_OBJECT) {
+							if (tokens[i].start != -1 && tokens[i].end == -1) {
+								parser->toksuper = i;
+								break;
+							}
+						}
+					}
+				}
+				break;
+			
+			default: {
+				int r = jsmn_parse_primitive(parser, js, len, tokens, num_tokens);
+				if (r < 0) {
+					return r;
+				}
+				count++;
+				if (parser->toksuper != -1 && tokens != NULL) {
+					tokens[parser->toksuper].size++;
+				}
+				break;
+			}
+		}
+	}
+	
+	if (tokens != NULL) {
+		for (int i = parser->toknext - 1; i >= 0; i--) {
+			// Unmatched opened object or array
+			if (tokens[i].start != -1 && tokens[i].end == -1) {
+				return JSMN_ERROR_PART;
+			}
+		}
+	}
+	
+	return count;
+}
+
+#endif
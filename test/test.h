@@ -0,0 +1,74 @@
+/**
+ * A minimal test framework for the host-side tests.
+ *
+ * Tests are declared with TEST(name) { ... } and use CHECK() and friends,
+ * which report (and count) failures without stopping the test. Tests are
+ * normally written as a series of sim::boot() calls, each of which runs in a
+ * fresh process: failures within a boot are counted in its sim::BootResult.
+ *
+ * test_main.cpp runs every test (or those named on the command line) and exits
+ * non-zero if any failed.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+#include "sim.h"
+
+extern int test_failures;
+
+typedef void (*test_fn_t)();
+
+struct TestRegistration {
+	TestRegistration(const char *name, test_fn_t fn);
+};
+
+#define TEST(name) \
+	static void test_##name(); \
+	static TestRegistration test_registration_##name(#name, test_##name); \
+	static void test_##name()
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			test_failures++; \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+#define CHECK_EQ(a, b) \
+	do { \
+		long long check_a = (long long)(a); \
+		long long check_b = (long long)(b); \
+		if (check_a != check_b) { \
+			test_failures++; \
+			fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", \
+			        __FILE__, __LINE__, #a, #b, check_a, check_b); \
+		} \
+	} while (0)
+
+#define CHECK_STR_EQ(a, b) \
+	do { \
+		const char *check_a = (a); \
+		const char *check_b = (b); \
+		if (!check_a || !check_b || strcmp(check_a, check_b) != 0) { \
+			test_failures++; \
+			fprintf(stderr, "%s:%d: CHECK_STR_EQ(%s, %s) failed: \"%s\" != \"%s\"\n", \
+			        __FILE__, __LINE__, #a, #b, \
+			        check_a ? check_a : "(null)", check_b ? check_b : "(null)"); \
+		} \
+	} while (0)
+
+/**
+ * Check that a boot finished normally without any test failures.
+ */
+#define CHECK_BOOT(result) \
+	do { \
+		sim::BootResult check_result = (result); \
+		CHECK_EQ(check_result.failures, 0); \
+		CHECK(!check_result.crashed); \
+	} while (0)
+
+#endif
@@ -0,0 +1,54 @@
+/**
+ * Runs the tests registered with TEST() (see test.h). Usage:
+ *
+ *     ./<board>_test [test name ...]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "test.h"
+
+namespace {
+
+struct Test {
+	const char *name;
+	test_fn_t fn;
+};
+
+std::vector<Test> &get_tests() {
+	static std::vector<Test> tests;
+	return tests;
+}
+
+}
+
+TestRegistration::TestRegistration(const char *name, test_fn_t fn) {
+	get_tests().push_back({name, fn});
+}
+
+int main(int argc, char *argv[]) {
+	int num_failed = 0;
+	for (const Test &test : get_tests()) {
+		bool selected = argc <= 1;
+		for (int i = 1; i < argc; i++) {
+			selected = selected || strcmp(argv[i], test.name) == 0;
+		}
+		if (!selected) {
+			continue;
+		}
+		
+		int failures_before = test_failures;
+		test.fn();
+		bool passed = test_failures == failures_before;
+		printf("%s %s\n", passed ? "PASS" : "FAIL", test.name);
+		fflush(stdout);
+		if (!passed) {
+			num_failed++;
+		}
+	}
+	
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,234 @@
+/**
+ * Benchmarks for the utilities board's electricity meter pulse detector
+ * (on_electricity_sample):
+ *
+ * * "electricity_window": time per sample.
+ * * "electricity_pulses": missed and false pulses under varying ambient light
+ *   for the board's adaptive threshold and for the fixed threshold
+ *   (ELECTRICITY_PEAK_DELTA_THRESHOLD) it replaced.
+ *
+ * Usage:
+ *
+ *     ./utilities_board_bench [trace.csv ...]
+ *
+ * The electricity LDR readings (channel 0) of recorded traces are benchmarked
+ * too. Recorded traces carry no record of the true pulses so only the number
+ * of pulses each detector finds is reported for them.
+ */
+
+#include "../utilities_board/src/main.cpp"
+
+#include "bench.h"
+
+// Trace lengths (samples)
+const size_t trace_lengths[] = {1000, 10000, 100000};
+
+// Length (samples) of the synthetic pulse traces (one hour)
+#define PULSE_TRACE_LENGTH (60 * 60 * 1000 / SENSOR_SAMPLE_PERIOD)
+
+// Length (samples) of each LED flash
+#define PULSE_LENGTH 2
+
+/**
+ * Time feeding a sequence of LDR readings through the pulse detector.
+ */
+void bench_electricity(const char *input, const std::vector<int> &readings) {
+	if (readings.empty()) {
+		return;
+	}
+	bench("electricity_window", input, readings.size(), readings.size(), [&]() {
+		for (int reading : readings) {
+			sim::advance_ms(SENSOR_SAMPLE_PERIOD);
+			on_electricity_sample(reading, NULL);
+		}
+		sim::qth_log.clear();
+	});
+}
+
+/**
+ * The pulse detector used before the threshold was made adaptive: the same
+ * window but with a fixed threshold.
+ */
+class FixedThresholdDetector {
+	public:
+		FixedThresholdDetector(int threshold)
+			: threshold(threshold)
+			, next_reading_index(0)
+			, initialised(false)
+		{
+		}
+		
+		/**
+		 * Add a reading, returning true if a pulse was detected.
+		 */
+		bool add(int reading) {
+			if (!initialised) {
+				std::fill(readings, readings + ELECTRICITY_WINDOW, reading);
+				initialised = true;
+			}
+			readings[next_reading_index] = reading;
+			next_reading_index = (next_reading_index + 1) % ELECTRICITY_WINDOW;
+			
+			int oldest = readings[next_reading_index];
+			int peak = *std::max_element(readings, readings + ELECTRICITY_WINDOW);
+			if (peak - oldest > threshold && peak - reading > threshold) {
+				std::fill(readings, readings + ELECTRICITY_WINDOW, reading);
+				return true;
+			}
+			return false;
+		}
+	
+	private:
+		const int threshold;
+		int readings[ELECTRICITY_WINDOW];
+		int next_reading_index;
+		bool initialised;
+};
+
+/**
+ * A sequence of LDR readings and the sample indices at which the LED flashes
+ * start.
+ */
+struct PulseTrace {
+	const char *name;
+	std::vector<int> readings;
+	std::vector<size_t> pulses;
+};
+
+/**
+ * Generate an hour of readings with LED flashes at random intervals of 1-10
+ * seconds. ambient(i) gives the reading without the LED and height(i) the
+ * size of a flash at sample i.
+ */
+template <typename Ambient, typename Height>
+PulseTrace make_pulse_trace(const char *name, int noise, Ambient ambient, Height height) {
+	BenchRandom random;
+	PulseTrace trace = {name, {}, {}};
+	size_t next_pulse = 20;
+	for (size_t i = 0; i < PULSE_TRACE_LENGTH; i++) {
+		if (i == next_pulse) {
+			trace.pulses.push_back(i);
+			next_pulse += 20 + random.next(180);
+		}
+		bool lit = !trace.pulses.empty() && i - trace.pulses.back() < PULSE_LENGTH;
+		trace.readings.push_back(ambient(i) + (lit ? height(i) : 0) + random.noise(noise));
+	}
+	return trace;
+}
+
+std::vector<PulseTrace> make_pulse_traces() {
+	std::vector<PulseTrace> traces;
+	
+	traces.push_back(make_pulse_trace("steady", 4,
+		[](size_t i) { return 300; },
+		[](size_t i) { return 150; }));
+	
+	// A bright room washing out the LED
+	traces.push_back(make_pulse_trace("dim", 3,
+		[](size_t i) { return 600; },
+		[](size_t i) { return 60; }));
+	
+	// The room light being switched on and off every five minutes
+	traces.push_back(make_pulse_trace("light_switching", 4,
+		[](size_t i) { return (i / 6000) % 2 ? 550 : 300; },
+		[](size_t i) { return (i / 6000) % 2 ? 80 : 150; }));
+	
+	// Daylight rising and falling over the hour, reducing the LED's contrast
+	traces.push_back(make_pulse_trace("daylight", 4,
+		[](size_t i) { return 200 + (int)(400 * sin(M_PI * i / PULSE_TRACE_LENGTH)); },
+		[](size_t i) { return 160 - (int)(110 * sin(M_PI * i / PULSE_TRACE_LENGTH)); }));
+	
+	// A noisy LDR with large pulses
+	traces.push_back(make_pulse_trace("noisy", 60,
+		[](size_t i) { return 300; },
+		[](size_t i) { return 260; }));
+	
+	return traces;
+}
+
+/**
+ * Print the number of pulses found (and, if the true pulses are known, missed
+ * and falsely detected) given the indices of the detected pulses.
+ */
+void report_pulses(const char *input, const char *detector,
+                   const std::vector<size_t> &detected, const std::vector<size_t> *pulses) {
+	printf("{\"bench\": \"electricity_pulses\", \"input\": \"%s\", \"detector\": \"%s\", \"detected\": %zu",
+	       input, detector, detected.size());
+	if (pulses) {
+		// A pulse is found if detected before the window has moved past it
+		size_t found = 0;
+		size_t d = 0;
+		for (size_t pulse : *pulses) {
+			while (d < detected.size() && detected[d] < pulse) {
+				d++;
+			}
+			if (d < detected.size() && detected[d] <= pulse + ELECTRICITY_WINDOW) {
+				found++;
+				d++;
+			}
+		}
+		printf(", \"pulses\": %zu, \"missed\": %zu, \"false\": %zu",
+		       pulses->size(), pulses->size() - found, detected.size() - found);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/**
+ * Replay readings through both detectors.
+ */
+void replay_pulses(const char *input, const std::vector<int> &readings,
+                   const std::vector<size_t> *pulses) {
+	// NB: The board's detector is run in a fresh boot so it starts from its
+	// initial state.
+	sim::boot([&]() {
+		setup();
+		std::vector<size_t> detected;
+		for (size_t i = 0; i < readings.size(); i++) {
+			uint32_t watt_hours = odometer.get_totals().watt_hours;
+			sim::advance_ms(SENSOR_SAMPLE_PERIOD);
+			on_electricity_sample(readings[i], NULL);
+			if (odometer.get_totals().watt_hours != watt_hours) {
+				detected.push_back(i);
+			}
+		}
+		report_pulses(input, "adaptive", detected, pulses);
+	});
+	
+	FixedThresholdDetector fixed(ELECTRICITY_PEAK_DELTA_THRESHOLD);
+	std::vector<size_t> detected;
+	for (size_t i = 0; i < readings.size(); i++) {
+		if (fixed.add(readings[i])) {
+			detected.push_back(i);
+		}
+	}
+	report_pulses(input, "fixed", detected, pulses);
+}
+
+int main(int argc, char *argv[]) {
+	sim::erase_all();
+	for (const PulseTrace &trace : make_pulse_traces()) {
+		replay_pulses(trace.name, trace.readings, &trace.pulses);
+	}
+	for (int i = 1; i < argc; i++) {
+		replay_pulses(argv[i], trace_channel(load_trace(argv[i]), 0), NULL);
+	}
+	
+	setup();
+	
+	BenchRandom random;
+	for (size_t length : trace_lengths) {
+		// A noisy baseline with a two-sample LED flash every 20 samples
+		std::vector<int> readings;
+		for (size_t i = 0; i < length; i++) {
+			readings.push_back((i % 20 < 2 ? 450 : 300) + random.noise(4));
+		}
+		bench_electricity("synthetic", readings);
+	}
+	
+	for (int i = 1; i < argc; i++) {
+		bench_electricity(argv[i], trace_channel(load_trace(argv[i]), 0));
+	}
+	
+	return 0;
+}
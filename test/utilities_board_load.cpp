@@ -0,0 +1,29 @@
+/**
+ * The utilities board in the multi-board load test (see load.h): an
+ * electricity meter flashing once a second and a gas meter pulse every ten
+ * seconds.
+ */
+
+#define BOARD_LOAD
+
+#include "../utilities_board/src/main.cpp"
+
+#include "load.h"
+
+const char *load_board_name = "utilities_board";
+
+void load_traffic_begin() {
+	sim::adc_source = []() {
+		// Two samples of LED flash per second
+		return (sim::now_ns() / 1000000ull) % 1000 < 2 * SENSOR_SAMPLE_PERIOD ? 450 : 300;
+	};
+}
+
+void load_traffic_loop() {
+	// NB: The gas sensor is active low
+	sim::digital_inputs[GAS_PIN] = (sim::now_ns() / 1000000ull) % 10000 >= 500;
+}
+
+int main(int argc, char *argv[]) {
+	return load_board_main(argc, argv);
+}
@@ -0,0 +1,137 @@
+/**
+ * Tests for the utilities board, built from its unmodified src/main.cpp.
+ */
+
+#include "../utilities_board/src/main.cpp"
+
+#include "test.h"
+
+TEST(utilities_board_boots) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		sim::run(loop, 2 * METRICS_PUBLISH_PERIOD);
+		CHECK(sim::qth_is_registered(QTH_PATH_PREFIX"electricity/watt-hours-total"));
+		CHECK(sim::qth_last("sys/nodemcu_utilities_board/metrics"));
+	}));
+}
+
+/**
+ * Fill the odometer journal (up to the point where the next write compacts
+ * it), leaving ODOMETER_JOURNAL_MAX_RECORDS watt hours in its last record.
+ */
+void fill_odometer_journal() {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		for (int i = 0; i < ODOMETER_JOURNAL_MAX_RECORDS; i++) {
+			odometer.add_watt_hour();
+			sim::advance_ms(ODOMETER_JOURNAL_PERIOD);
+			odometer.loop();
+		}
+	}));
+	sim::power_off();
+}
+
+TEST(odometer_compaction_survives_power_loss) {
+	// Cut the power before each filesystem modification made by the compaction
+	// in turn until it completes.
+	for (int n = 0; ; n++) {
+		fill_odometer_journal();
+		sim::BootResult result = sim::boot([n]() {
+			setup();
+			CHECK_EQ(odometer.get_totals().watt_hours, ODOMETER_JOURNAL_MAX_RECORDS);
+			odometer.add_watt_hour();
+			sim::advance_ms(ODOMETER_JOURNAL_PERIOD);
+			sim::power_cut_after(n);
+			odometer.loop();
+		});
+		CHECK_BOOT(result);
+		
+		// Either the old or the new total survives
+		sim::power_off();
+		CHECK_BOOT(sim::boot([]() {
+			setup();
+			uint32_t watt_hours = odometer.get_totals().watt_hours;
+			CHECK(watt_hours == ODOMETER_JOURNAL_MAX_RECORDS ||
+			      watt_hours == ODOMETER_JOURNAL_MAX_RECORDS + 1);
+		}));
+		
+		if (!result.power_cut) {
+			CHECK(n > 0);
+			break;
+		}
+	}
+}
+
+TEST(odometer_power_loss_loses_fewer_than_journal_pulses) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		// Well within ODOMETER_JOURNAL_PERIOD
+		for (int i = 0; i < 2 * ODOMETER_JOURNAL_PULSES - 1; i++) {
+			odometer.add_watt_hour();
+			sim::advance_ms(100);
+			odometer.loop();
+		}
+	}));
+	sim::power_off();
+	
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		CHECK_EQ(odometer.get_totals().watt_hours, ODOMETER_JOURNAL_PULSES);
+	}));
+}
+
+TEST(pulse_log_request_rejects_malformed_input) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		setup();
+		const char *malformed[] = {
+			"", "[]", "[1]", "[1,]", "[,2]", "1,2", "[1,2", "[1,2]x", "[1;2]",
+			"[-1,2]", "[1,-2]", "[+1,2]", "[1.5,2]", "[a,2]", "[3,2]",
+			"[99999999999999999999999,1]",
+		};
+		for (const char *json : malformed) {
+			uint32_t json_errors = metrics.get(METRIC_JSON_ERRORS);
+			sim::qth_send_event(QTH_PATH_PREFIX"pulse-log/request", json);
+			sim::run(loop, 1000);
+			if (metrics.get(METRIC_JSON_ERRORS) != json_errors + 1) {
+				fprintf(stderr, "Accepted: %s\n", json);
+			}
+			CHECK_EQ(metrics.get(METRIC_JSON_ERRORS), json_errors + 1);
+		}
+		CHECK(sim::qth_sent(QTH_PATH_PREFIX"pulse-log/data").empty());
+		
+		sim::qth_send_event(QTH_PATH_PREFIX"pulse-log/request", " [ 0 , 2000000000 ] ");
+		sim::run(loop, 1000);
+		CHECK_STR_EQ(sim::qth_last(QTH_PATH_PREFIX"pulse-log/data"),
+		             "{\"start\":0.000,\"more\":false,\"data\":\"\"}");
+	}));
+}
+
+TEST(pulse_log_retrieval) {
+	sim::erase_all();
+	CHECK_BOOT(sim::boot([]() {
+		sim::unix_time_at_zero = 1600000000;
+		setup();
+		
+		// Enough pulses to need several chunks
+		for (int i = 0; i < 1000; i++) {
+			sim::advance_ms(1000);
+			pulse_log.record(PULSE_LOG_ELECTRICITY);
+		}
+		pulse_log.flush();
+		
+		sim::qth_send_event(QTH_PATH_PREFIX"pulse-log/request", "[1600000000,1700000000]");
+		sim::run(loop, 10 * 1000);
+		std::vector<sim::QthMessage> chunks = sim::qth_sent(QTH_PATH_PREFIX"pulse-log/data");
+		CHECK(chunks.size() > 1);
+		for (size_t i = 0; i < chunks.size(); i++) {
+			const std::string &chunk = chunks[i].value;
+			CHECK(chunk.size() < MQTT_MAX_PACKET_SIZE);
+			CHECK(chunk.find(i + 1 < chunks.size() ? "\"more\":true" : "\"more\":false") != std::string::npos);
+			CHECK(chunk.compare(chunk.size() - 2, 2, "\"}") == 0);
+		}
+	}));
+}
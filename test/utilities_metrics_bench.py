@@ -0,0 +1,189 @@
+"""
+Benchmark of the 24-hour usage counters in utilities_board/utilities_metrics.py.
+
+A synthetic week of electricity meter pulses (about 12,000 Wh per day) is
+replayed through bucketed_count() and through a model of the
+yarp.len(yarp.time_window(...)) it replaced. One JSON object is printed per
+counter in the same form as the C++ benchmarks (see bench.h) with the memory
+held by the counter at the end of the week ("bytes"), its final count and the
+exact number of pulses in the final 24 hours.
+
+Usage:
+
+    python3 utilities_metrics_bench.py
+
+The Qth and yarp libraries are replaced by minimal stand-ins so that
+utilities_metrics.py can be loaded without a Qth server. Only its definitions
+(the part before the first "####" separator) are run. Time is virtual:
+time.time() returns the time of the pulse being replayed and timers scheduled
+with call_later() run as the replay passes them.
+"""
+
+import os
+import sys
+import json
+import time
+import heapq
+import random
+import types
+import tracemalloc
+
+WINDOW = 60 * 60 * 24
+
+# Length of the replayed pulse stream (s) and the mean pulse rate (Hz)
+DURATION = 7 * WINDOW
+PULSE_RATE = 12000.0 / WINDOW
+
+START_TIME = 1.7e9
+
+METRICS_PY = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "..", "utilities_board", "utilities_metrics.py")
+
+
+class VirtualLoop(object):
+    """An asyncio event loop stand-in running call_later() timers on demand."""
+
+    def __init__(self):
+        self.now = START_TIME
+        self.timers = []
+        self.sequence = 0
+
+    def time(self):
+        return self.now
+
+    def call_later(self, delay, callback):
+        self.sequence += 1
+        heapq.heappush(self.timers, (self.now + delay, self.sequence, callback))
+
+    def run_until(self, t):
+        """Run every timer due by t, then advance the clock to t."""
+        while self.timers and self.timers[0][0] <= t:
+            due, _, callback = heapq.heappop(self.timers)
+            self.now = due
+            callback()
+        self.now = t
+
+
+class Value(object):
+    """A yarp.Value stand-in: calls its callbacks whenever it is set."""
+
+    def __init__(self, value=None):
+        self._value = value
+        self._callbacks = []
+
+    @property
+    def value(self):
+        return self._value
+
+    @value.setter
+    def value(self, value):
+        self._value = value
+        for callback in self._callbacks:
+            callback(value)
+
+    def on_value_changed(self, callback):
+        self._callbacks.append(callback)
+
+
+def load_metrics():
+    """Load the definitions from utilities_metrics.py against the stand-ins."""
+    yarp = types.ModuleType("yarp")
+    yarp.Value = Value
+    yarp.fn = lambda f: f
+    qth_yarp = types.ModuleType("qth_yarp")
+    qth_yarp.watch_event = lambda path: Value()
+    qth_yarp.set_property = lambda *args, **kwargs: None
+    qth_yarp.run_forever = lambda: None
+    sys.modules["yarp"] = yarp
+    sys.modules["qth_yarp"] = qth_yarp
+
+    with open(METRICS_PY) as f:
+        source = f.read().split("\n####")[0]
+    namespace = {}
+    exec(compile(source, METRICS_PY, "exec"), namespace)
+    return namespace
+
+
+def time_window_count(event, window=WINDOW, loop=None):
+    """
+    Model of yarp.len(yarp.time_window(event, window)): every event is kept
+    in a list, with a timer per event removing it once it leaves the window.
+    """
+    events = []
+    output = Value(0)
+
+    def expire():
+        events.pop(0)
+        output.value = len(events)
+
+    def on_event(value):
+        events.append(value)
+        output.value = len(events)
+        loop.call_later(window, expire)
+
+    event.on_value_changed(on_event)
+    return output
+
+
+def make_pulses():
+    r = random.Random(0)
+    pulses = []
+    t = START_TIME
+    while True:
+        t += r.expovariate(PULSE_RATE)
+        if t >= START_TIME + DURATION:
+            return pulses
+        pulses.append(t)
+
+
+def replay(make_counter, pulses, trace_memory):
+    """
+    Replay the pulses through a new counter, returning (seconds taken, bytes
+    allocated and still held, final count).
+    """
+    loop = VirtualLoop()
+    time.time = loop.time
+    event = Value()
+    if trace_memory:
+        tracemalloc.start()
+    counter = make_counter(event, loop=loop)
+    start = time.perf_counter()
+    for pulse_time in pulses:
+        loop.run_until(pulse_time)
+        event.value = [1000, round(pulse_time, 3)]
+    elapsed = time.perf_counter() - start
+    held = 0
+    if trace_memory:
+        held = tracemalloc.get_traced_memory()[0]
+        tracemalloc.stop()
+    return elapsed, held, counter.value
+
+
+def main():
+    pulses = make_pulses()
+    exact_count = sum(1 for t in pulses if t > pulses[-1] - WINDOW)
+
+    metrics = load_metrics()
+    counters = [
+        ("usage_24h_bucketed", metrics["bucketed_count"]),
+        ("usage_24h_time_window", time_window_count),
+    ]
+    for name, make_counter in counters:
+        # NB: Timed without tracemalloc, which slows allocation considerably
+        elapsed, _, count = replay(make_counter, pulses, False)
+        _, held, _ = replay(make_counter, pulses, True)
+        print(json.dumps({
+            "bench": name,
+            "input": "synthetic",
+            "size": len(pulses),
+            "ops": len(pulses),
+            "ns_per_op": round(elapsed / len(pulses) * 1e9, 1),
+            "bytes": held,
+            "count": count,
+            "exact_count": exact_count,
+        }))
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
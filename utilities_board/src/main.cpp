@@ -1,6 +1,14 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <Qth.h>
+#include <LittleFS.h>
+#include <time.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "rtc_memory.h"
 
 // Prefix for all Qth paths
 #define QTH_PATH_PREFIX "power/"
@@ -30,6 +38,8 @@
 //             |R|
 //             '|'
 //             Gnd
+//
+// NB: Must be A0 since the LDR is sampled via the ADC service.
 #define ELECTRICITY_PIN A0
 
 // Window size (in samples) for electricity LDR values (see explanation below).
@@ -55,36 +65,899 @@
 //
 // Instead, we capture a rolling window of the last ELECTRICITY_WINDOW
 // readings. A pulse is detected when the difference between the peak value and
-// the first and last values in the window exceed a suitable threshold
-// (ELECTRICITY_PEAK_DELTA_THRESHOLD). This ensures only transient pulses are
-// detected.
+// the first and last values in the window exceed a suitable threshold. This
+// ensures only transient pulses are detected. The threshold is adjusted
+// automatically based on the observed noise and pulse heights (see
+// AdaptiveThreshold).
 #define ELECTRICITY_WINDOW 10
 
-// Minimum analogue reading delta between the start/end and peak reading during
-// the window's interval to indicate a 'peak'
+// Initial analogue reading delta between the start/end and peak reading during
+// the window's interval to indicate a 'peak'. The threshold actually used
+// adapts over time (see AdaptiveThreshold below) but will never leave the
+// range ELECTRICITY_MIN_THRESHOLD to ELECTRICITY_MAX_THRESHOLD.
 #define ELECTRICITY_PEAK_DELTA_THRESHOLD 100
+#define ELECTRICITY_MIN_THRESHOLD 20
+#define ELECTRICITY_MAX_THRESHOLD 400
+
+// The threshold is kept at least this many times above the estimated LDR noise
+// level (mean absolute sample-to-sample difference).
+#define ELECTRICITY_NOISE_FACTOR 4
+
+// Weight (as a power of two reciprocal) of new samples in the running
+// baseline and noise estimates. With a 50 ms sample period, 6 (i.e. 1/64) gives
+// a time constant of roughly three seconds.
+#define ELECTRICITY_STATS_SHIFT 6
+
+// Weight (as a power of two reciprocal) of each detected pulse's height in the
+// running pulse height estimate.
+#define ELECTRICITY_PULSE_HEIGHT_SHIFT 3
+
+// The pulse height estimate decays by 1/2^ELECTRICITY_PULSE_HEIGHT_DECAY_SHIFT
+// every sample without a pulse. This allows the detector to recover if the
+// pulses shrink suddenly (e.g. due to a change in ambient light) to below the
+// current threshold. With a 50 ms sample period, 12 gives a time constant of
+// around three and a half minutes.
+#define ELECTRICITY_PULSE_HEIGHT_DECAY_SHIFT 12
+
+// Period (ms) at which the detector's state is published for diagnostic
+// purposes.
+#define ELECTRICITY_DIAGNOSTIC_PERIOD (60 * 1000)
+
+// Cumulative totals (odometers) of the number of watt-hours and cubic feet
+// consumed are maintained across resets and power cycles.
+//
+// Every pulse updates a copy of the totals held in RTC memory which survives
+// resets but not power loss. The totals are also appended to a journal file in
+// flash once ODOMETER_JOURNAL_PULSES pulses (of either kind) have accumulated
+// or ODOMETER_JOURNAL_PERIOD after the last record, whichever is sooner. On
+// startup the RTC copy is used if valid, otherwise the last record in the
+// journal is used. As a result a reset loses no pulses while a power loss loses
+// fewer than ODOMETER_JOURNAL_PULSES pulses (100 Wh or cubic feet) and no more
+// than ODOMETER_JOURNAL_PERIOD worth.
+//
+// Records are only appended to the journal when the totals have changed, so
+// the flash is written at most once per ODOMETER_JOURNAL_PULSES pulses (e.g.
+// every 36 s at a 10 kW load) and once per ODOMETER_JOURNAL_PERIOD when idle.
+// Once the journal contains ODOMETER_JOURNAL_MAX_RECORDS records it is
+// compacted down to just the latest record. Since each record is small and
+// appended, the filesystem spreads these writes across the flash.
+#define ODOMETER_JOURNAL_PATH "/odometer.jnl"
+#define ODOMETER_JOURNAL_PERIOD (60 * 60 * 1000)
+#define ODOMETER_JOURNAL_PULSES 100
+#define ODOMETER_JOURNAL_MAX_RECORDS 256
+
+// Minimum period (ms) between odometer property updates.
+#define ODOMETER_PUBLISH_PERIOD (10 * 1000)
+
+// A complete history of electricity and gas pulses is logged to flash and may
+// be retrieved using the power/pulse-log/request event.
+//
+// The log is a sequence of segment files in PULSE_LOG_DIR, named by an
+// increasing sequence number. Each segment starts with an 8 byte little-endian
+// timestamp (ms since the UNIX epoch) followed by a series of records. Each
+// record is a LEB128-encoded unsigned integer containing the number of ms since
+// the previous record (or the segment start), shifted left by one, with the
+// channel (PULSE_LOG_ELECTRICITY or PULSE_LOG_GAS) in the bottom bit. Most
+// records are therefore two or three bytes long.
+//
+// Records are accumulated in a RAM buffer of PULSE_LOG_BUFFER_SIZE bytes which
+// is appended to the current segment when full or after PULSE_LOG_FLUSH_PERIOD,
+// keeping the number of (small) flash writes bounded even at the maximum pulse
+// rate. Once a segment reaches PULSE_LOG_SEGMENT_SIZE a new one is started and
+// the oldest segments are deleted to keep the log within PULSE_LOG_MAX_SIZE.
+//
+// Timestamps are obtained using SNTP. Pulses which occur before the time is
+// known are held in the RAM buffer until it is (or dropped if it fills up).
+#define PULSE_LOG_DIR "/pulses"
+#define PULSE_LOG_SEGMENT_SIZE 4096
+#define PULSE_LOG_MAX_SIZE (256 * 1024)
+#define PULSE_LOG_BUFFER_SIZE 128
+#define PULSE_LOG_FLUSH_PERIOD (10 * 60 * 1000)
+#define PULSE_LOG_NTP_SERVER "pool.ntp.org"
+
+#define PULSE_LOG_ELECTRICITY 0
+#define PULSE_LOG_GAS 1
+
+// Retrieved log data is sent in chunks of at most this many (raw, pre-base64)
+// bytes which, once encoded, fit comfortably within MQTT_MAX_PACKET_SIZE along
+// with the topic and JSON wrapper.
+#define PULSE_LOG_CHUNK_SIZE (((MQTT_MAX_PACKET_SIZE - 128) / 4) * 3)
+
+// Maximum number of bytes of the log to scan per call to PulseLog::loop while
+// serving a retrieval request.
+#define PULSE_LOG_SCAN_BYTES 512
+
+// Period (ms) at which the log's space usage is published
+#define PULSE_LOG_USAGE_PERIOD (10 * 60 * 1000)
+
+// Time budget (ms) for the odometer and pulse log's (flash writing) loops
+// before a watchdog report is produced.
+#define STORAGE_LOOP_BUDGET 500
+
+// NB: The filesystem extends up to the storage sector so storage.h may not
+// take further sectors from below it. (This board keeps nothing in storage.h:
+// the odometers and pulse log live in the filesystem.)
+#define STORAGE_SECTORS 1
 
 const char *qth_client_id = "nodemcu_utilities_board";
 const char *qth_client_description = "Utilities usage monitoring.";
 #include "common.inc"
 
-Qth::Event *electricity_pulse_evt;
-Qth::Event *gas_pulse_evt;
+WatchdogSection storage_loop_section("storage", STORAGE_LOOP_BUDGET);
+
+
+/**
+ * Maintains running estimates of the electricity LDR's baseline reading, noise
+ * level and typical pulse height and derives a pulse detection threshold from
+ * these.
+ *
+ * The threshold is set to half of the typical pulse height but is kept
+ * ELECTRICITY_NOISE_FACTOR times above the noise level. This allows the
+ * detector to follow changes in ambient light and LDR ageing without
+ * reflashing.
+ *
+ * All values are kept internally in fixed point with FRAC_BITS fractional
+ * bits.
+ */
+class AdaptiveThreshold {
+	public:
+		AdaptiveThreshold(int initial_threshold)
+			: is_initialised(false)
+			, baseline(0)
+			, noise(0)
+			, pulse_height(initial_threshold << (FRAC_BITS + 1))
+			, last_reading(0)
+		{
+		}
+		
+		/**
+		 * Call with every new reading (before checking for a pulse).
+		 */
+		void update(int reading) {
+			if (!is_initialised) {
+				baseline = reading << FRAC_BITS;
+				last_reading = reading;
+				is_initialised = true;
+			}
+			
+			// NB: The baseline is updated even during pulses since these are short
+			// compared with the filter's time constant.
+			baseline += ((reading << FRAC_BITS) - baseline) >> ELECTRICITY_STATS_SHIFT;
+			
+			// Sample-to-sample differences large enough to count towards a pulse
+			// (i.e. pulse edges or sudden ambient light changes) are excluded from
+			// the noise estimate.
+			int delta = abs(reading - last_reading);
+			if (delta < get_threshold()) {
+				noise += ((delta << FRAC_BITS) - noise) >> ELECTRICITY_STATS_SHIFT;
+			}
+			last_reading = reading;
+			
+			pulse_height -= pulse_height >> ELECTRICITY_PULSE_HEIGHT_DECAY_SHIFT;
+		}
+		
+		/**
+		 * Call when a pulse is detected with the height of the pulse (in ADC
+		 * counts) above the surrounding readings.
+		 */
+		void pulse_detected(int height) {
+			pulse_height += ((height << FRAC_BITS) - pulse_height) >> ELECTRICITY_PULSE_HEIGHT_SHIFT;
+		}
+		
+		/**
+		 * Get the current pulse detection threshold (ADC counts).
+		 */
+		int get_threshold() const {
+			int threshold = pulse_height >> (FRAC_BITS + 1);
+			int noise_floor = (noise * ELECTRICITY_NOISE_FACTOR) >> FRAC_BITS;
+			if (threshold < noise_floor) {
+				threshold = noise_floor;
+			}
+			if (threshold < ELECTRICITY_MIN_THRESHOLD) {
+				threshold = ELECTRICITY_MIN_THRESHOLD;
+			} else if (threshold > ELECTRICITY_MAX_THRESHOLD) {
+				threshold = ELECTRICITY_MAX_THRESHOLD;
+			}
+			return threshold;
+		}
+		
+		/**
+		 * Get the current baseline reading (ADC counts).
+		 */
+		float get_baseline() const {
+			return baseline / (float)(1 << FRAC_BITS);
+		}
+		
+		/**
+		 * Get the current noise level (mean absolute sample-to-sample
+		 * difference, ADC counts).
+		 */
+		float get_noise() const {
+			return noise / (float)(1 << FRAC_BITS);
+		}
+	
+	private:
+		// NB: Enough that the slowest decay (pulse_height >>
+		// ELECTRICITY_PULSE_HEIGHT_DECAY_SHIFT) doesn't round to zero for small
+		// pulse heights while 1023 << (FRAC_BITS + 1) still fits in an int.
+		static const int FRAC_BITS = 16;
+		
+		// Has 'update' been called before? If not, the baseline is initialised
+		// from the first reading.
+		bool is_initialised;
+		
+		// Running estimates (fixed point)
+		int baseline;
+		int noise;
+		int pulse_height;
+		
+		// The previous reading (ADC counts)
+		int last_reading;
+};
+
+AdaptiveThreshold electricity_threshold(ELECTRICITY_PEAK_DELTA_THRESHOLD);
+
+
+/**
+ * Persistent cumulative electricity and gas consumption totals. See the
+ * comment above ODOMETER_JOURNAL_PATH for the mechanism used.
+ */
+class Odometer {
+	public:
+		struct Totals {
+			uint32_t watt_hours;
+			uint32_t cubic_feet;
+		};
+		
+		Odometer()
+			: journal_records(0)
+			, journal_dirty(false)
+			, num_unjournalled(0)
+			, last_journal_write(0)
+		{
+			totals.watt_hours = 0;
+			totals.cubic_feet = 0;
+		}
+		
+		/**
+		 * Restore the totals. Call once during startup.
+		 */
+		void begin() {
+			if (!LittleFS.begin()) {
+				Serial.println("Failed to mount filesystem.");
+			}
+			
+			Totals journal_totals = totals;
+			read_journal(journal_totals);
+			
+			Totals rtc_totals;
+			if (rtc_memory_load(RTC_MEMORY_BOARD_OFFSET, rtc_totals) &&
+			    rtc_totals.watt_hours >= journal_totals.watt_hours &&
+			    rtc_totals.cubic_feet >= journal_totals.cubic_feet) {
+				Serial.println("Odometer restored from RTC memory.");
+				totals = rtc_totals;
+				num_unjournalled = (rtc_totals.watt_hours - journal_totals.watt_hours) +
+				                   (rtc_totals.cubic_feet - journal_totals.cubic_feet);
+				journal_dirty = num_unjournalled != 0;
+			} else {
+				Serial.println("Odometer restored from journal.");
+				totals = journal_totals;
+				rtc_memory_store(RTC_MEMORY_BOARD_OFFSET, totals);
+			}
+			
+			last_journal_write = millis();
+		}
+		
+		/**
+		 * Call regularly to journal the totals to flash.
+		 */
+		void loop() {
+			unsigned long now = millis();
+			if (journal_dirty && (num_unjournalled >= ODOMETER_JOURNAL_PULSES ||
+			                      now - last_journal_write >= ODOMETER_JOURNAL_PERIOD)) {
+				write_journal();
+				last_journal_write = now;
+				// NB: Also reset if the write failed so that it is retried after
+				// further pulses rather than on every call
+				num_unjournalled = 0;
+			}
+		}
+		
+		void add_watt_hour() {
+			totals.watt_hours++;
+			changed();
+		}
+		
+		void add_cubic_foot() {
+			totals.cubic_feet++;
+			changed();
+		}
+		
+		const Totals &get_totals() const {
+			return totals;
+		}
+	
+	private:
+		struct JournalRecord {
+			Totals totals;
+			uint32_t crc;
+		};
+		
+		// The current totals
+		Totals totals;
+		
+		// Number of records in the journal file
+		int journal_records;
+		
+		// Have the totals changed since they were last journalled (and by how
+		// many pulses)?
+		bool journal_dirty;
+		uint32_t num_unjournalled;
+		unsigned long last_journal_write;
+		
+		void changed() {
+			rtc_memory_store(RTC_MEMORY_BOARD_OFFSET, totals);
+			journal_dirty = true;
+			num_unjournalled++;
+		}
+		
+		/**
+		 * Read the latest valid record from the journal into out. Any damaged
+		 * (e.g. partially written) records are skipped.
+		 */
+		void read_journal(Totals &out) {
+			journal_records = 0;
+			File f = LittleFS.open(ODOMETER_JOURNAL_PATH, "r");
+			if (!f) {
+				return;
+			}
+			
+			JournalRecord record;
+			while (f.read((uint8_t *)&record, sizeof(record)) == sizeof(record)) {
+				journal_records++;
+				if (rtc_crc32(&record.totals, sizeof(record.totals)) == record.crc) {
+					out = record.totals;
+				}
+			}
+			f.close();
+		}
+		
+		/**
+		 * Append the current totals to the journal, compacting it first if it has
+		 * grown too large.
+		 */
+		void write_journal() {
+			JournalRecord record;
+			record.totals = totals;
+			record.crc = rtc_crc32(&record.totals, sizeof(record.totals));
+			
+			if (journal_records >= ODOMETER_JOURNAL_MAX_RECORDS) {
+				// Compact: write a fresh journal containing just the latest record and
+				// then rename it over the old one. NB: The old journal must not be
+				// removed first: LittleFS's rename atomically replaces it so if power
+				// is lost at any point either the old or the new journal is intact.
+				File f = LittleFS.open(ODOMETER_JOURNAL_PATH ".new", "w");
+				if (!f) {
+					Serial.println("Failed to compact odometer journal.");
+					return;
+				}
+				f.write((const uint8_t *)&record, sizeof(record));
+				f.close();
+				if (!LittleFS.rename(ODOMETER_JOURNAL_PATH ".new", ODOMETER_JOURNAL_PATH)) {
+					Serial.println("Failed to replace odometer journal.");
+					return;
+				}
+				journal_records = 1;
+			} else {
+				File f = LittleFS.open(ODOMETER_JOURNAL_PATH, "a");
+				if (!f) {
+					Serial.println("Failed to append to odometer journal.");
+					return;
+				}
+				f.write((const uint8_t *)&record, sizeof(record));
+				f.close();
+				journal_records++;
+			}
+			
+			journal_dirty = false;
+		}
+};
+
+Odometer odometer;
+
+
+/**
+ * Get the current time in ms since the UNIX epoch or 0 if not yet known.
+ */
+uint64_t unix_time_ms() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec < 1500000000l) {
+		// Not yet set by SNTP, fall back on the Qth server's clock
+		return server_clock.now();
+	}
+	return ((uint64_t)tv.tv_sec * 1000ull) + (tv.tv_usec / 1000);
+}
+
+
+/**
+ * Flash-backed log of pulses. See the comment above PULSE_LOG_DIR for the
+ * format and mechanism used.
+ */
+class PulseLog {
+	public:
+		PulseLog()
+			: first_segment(0)
+			, next_segment(0)
+			, total_bytes(0)
+			, buffer_length(0)
+			, has_reference(false)
+			, need_header(true)
+			, header_ms(0)
+			, last_record_ms(0)
+			, last_flush(0)
+			, num_dropped(0)
+			, reading(false)
+			, read_chunk_length(0)
+		{
+		}
+		
+		/**
+		 * Find existing segments. Call once during startup after the filesystem
+		 * has been mounted.
+		 */
+		void begin() {
+			LittleFS.mkdir(PULSE_LOG_DIR);
+			
+			bool found = false;
+			Dir dir = LittleFS.openDir(PULSE_LOG_DIR);
+			while (dir.next()) {
+				uint32_t segment = strtoul(dir.fileName().c_str(), NULL, 10);
+				if (!found || segment < first_segment) {
+					first_segment = segment;
+				}
+				if (!found || segment >= next_segment) {
+					next_segment = segment + 1;
+				}
+				found = true;
+				total_bytes += dir.fileSize();
+			}
+			
+			last_flush = millis();
+		}
+		
+		/**
+		 * Log a pulse on the specified channel.
+		 */
+		void record(int channel) {
+			unsigned long now = millis();
+			if (!has_reference) {
+				header_ms = now;
+				last_record_ms = now;
+				has_reference = true;
+			}
+			
+			if (buffer_length + 10 > sizeof(buffer)) {
+				flush();
+			}
+			if (buffer_length + 10 > sizeof(buffer)) {
+				// Could not flush (time not yet known), drop the pulse.
+				num_dropped++;
+				return;
+			}
+			
+			uint64_t value = ((uint64_t)(now - last_record_ms) << 1) | channel;
+			buffer_length += leb128_encode(value, buffer + buffer_length);
+			last_record_ms = now;
+		}
+		
+		/**
+		 * Start retrieving all pulses between the two timestamps (ms since the
+		 * UNIX epoch). Any retrieval already in progress is abandoned.
+		 */
+		void start_read(uint64_t start_ms, uint64_t end_ms) {
+			flush();
+			
+			reading = true;
+			read_start_ms = start_ms;
+			read_end_ms = end_ms;
+			read_segment = first_segment;
+			read_offset = 0;
+			read_chunk_length = 0;
+			read_chunk_start_ms = 0;
+			read_chunk_last_ms = 0;
+			read_last_ms = 0;
+		}
+		
+		/**
+		 * Call regularly. Flushes the buffer periodically and sends the next chunk
+		 * of any retrieval in progress using the supplied event.
+		 */
+		void loop(Qth::Event *data_evt) {
+			unsigned long now = millis();
+			if (now - last_flush >= PULSE_LOG_FLUSH_PERIOD) {
+				flush();
+			}
+			
+			if (reading) {
+				read_next(data_evt);
+			}
+		}
+		
+		/**
+		 * Append the buffered records to flash. Does nothing if the current time
+		 * is not yet known.
+		 */
+		void flush() {
+			last_flush = millis();
+			if (buffer_length == 0) {
+				return;
+			}
+			
+			File f;
+			char path[32];
+			if (need_header) {
+				uint64_t unix_now = unix_time_ms();
+				if (!unix_now) {
+					return;
+				}
+				uint64_t header = unix_now - (millis() - header_ms);
+				
+				segment_path(next_segment, path);
+				f = LittleFS.open(path, "w");
+				if (!f) {
+					Serial.println("Failed to create pulse log segment.");
+					return;
+				}
+				uint8_t header_bytes[8];
+				for (int i = 0; i < 8; i++) {
+					header_bytes[i] = (header >> (8 * i)) & 0xFF;
+				}
+				f.write(header_bytes, sizeof(header_bytes));
+				total_bytes += sizeof(header_bytes);
+				next_segment++;
+				need_header = false;
+			} else {
+				segment_path(next_segment - 1, path);
+				f = LittleFS.open(path, "a");
+				if (!f) {
+					Serial.println("Failed to append to pulse log segment.");
+					return;
+				}
+			}
+			
+			f.write(buffer, buffer_length);
+			total_bytes += buffer_length;
+			buffer_length = 0;
+			
+			// Start a new segment (with the last record as its reference) when
+			// this one is full.
+			if (f.size() >= PULSE_LOG_SEGMENT_SIZE) {
+				need_header = true;
+				header_ms = last_record_ms;
+			}
+			f.close();
+			
+			// Delete the oldest segments once the log grows too large
+			while (total_bytes > PULSE_LOG_MAX_SIZE && first_segment + 1 < next_segment) {
+				segment_path(first_segment, path);
+				File old = LittleFS.open(path, "r");
+				if (old) {
+					total_bytes -= old.size();
+					old.close();
+				}
+				LittleFS.remove(path);
+				first_segment++;
+			}
+		}
+		
+		/**
+		 * Total bytes used by the log in flash.
+		 */
+		size_t get_total_bytes() const {
+			return total_bytes;
+		}
+		
+		/**
+		 * Number of segment files in the log.
+		 */
+		uint32_t get_num_segments() const {
+			return next_segment - first_segment;
+		}
+		
+		/**
+		 * Number of pulses which could not be logged.
+		 */
+		uint32_t get_num_dropped() const {
+			return num_dropped;
+		}
+	
+	private:
+		// Range of segment numbers currently on disk
+		uint32_t first_segment;
+		uint32_t next_segment;
+		
+		// Total size of all segments
+		size_t total_bytes;
+		
+		// Records not yet written to flash
+		uint8_t buffer[PULSE_LOG_BUFFER_SIZE];
+		size_t buffer_length;
+		
+		// Has a pulse been recorded since startup?
+		bool has_reference;
+		
+		// Does a new segment need to be started (with a header containing the
+		// time corresponding with header_ms) when next flushing?
+		bool need_header;
+		unsigned long header_ms;
+		
+		// millis() of the last record added to the buffer
+		unsigned long last_record_ms;
+		
+		unsigned long last_flush;
+		uint32_t num_dropped;
+		
+		// State of the retrieval request in progress (if reading is true).
+		bool reading;
+		uint64_t read_start_ms;
+		uint64_t read_end_ms;
+		uint32_t read_segment;
+		size_t read_offset;
+		uint64_t read_last_ms;
+		uint8_t read_chunk[PULSE_LOG_CHUNK_SIZE];
+		size_t read_chunk_length;
+		uint64_t read_chunk_start_ms;
+		uint64_t read_chunk_last_ms;
+		
+		static void segment_path(uint32_t segment, char *path) {
+			snprintf(path, 32, PULSE_LOG_DIR "/%08lu", (unsigned long)segment);
+		}
+		
+		/**
+		 * Scan up to PULSE_LOG_SCAN_BYTES of the log, sending a chunk if one is
+		 * filled or the end of the requested range is reached.
+		 */
+		void read_next(Qth::Event *data_evt) {
+			if (read_segment >= next_segment) {
+				send_chunk(data_evt, false);
+				return;
+			}
+			
+			char path[32];
+			segment_path(read_segment, path);
+			File f = LittleFS.open(path, "r");
+			if (!f) {
+				read_segment++;
+				read_offset = 0;
+				return;
+			}
+			
+			if (read_offset == 0) {
+				uint8_t header_bytes[8];
+				if (f.read(header_bytes, sizeof(header_bytes)) != sizeof(header_bytes)) {
+					f.close();
+					read_segment++;
+					return;
+				}
+				read_last_ms = 0;
+				for (int i = 0; i < 8; i++) {
+					read_last_ms |= (uint64_t)header_bytes[i] << (8 * i);
+				}
+				read_offset = sizeof(header_bytes);
+			} else {
+				f.seek(read_offset);
+			}
+			
+			uint8_t block[PULSE_LOG_SCAN_BYTES];
+			size_t block_length = f.read(block, sizeof(block));
+			bool at_end = f.position() >= f.size();
+			f.close();
+			
+			// Decode all complete records in the block
+			size_t consumed = 0;
+			uint64_t value = 0;
+			int shift = 0;
+			for (size_t i = 0; i < block_length; i++) {
+				value |= (uint64_t)(block[i] & 0x7F) << shift;
+				shift += 7;
+				if (block[i] & 0x80) {
+					continue;
+				}
+				
+				uint64_t time_ms = read_last_ms + (value >> 1);
+				int channel = value & 1;
+				value = 0;
+				shift = 0;
+				
+				if (time_ms > read_end_ms) {
+					send_chunk(data_evt, false);
+					return;
+				}
+				if (time_ms >= read_start_ms) {
+					if (read_chunk_length + 10 > sizeof(read_chunk)) {
+						// Chunk full, send it and resume from this record next time.
+						read_offset += consumed;
+						send_chunk(data_evt, true);
+						return;
+					}
+					add_to_chunk(time_ms, channel);
+				}
+				read_last_ms = time_ms;
+				consumed = i + 1;
+			}
+			read_offset += consumed;
+			
+			// NB: Any incomplete record at the end of a segment (e.g. due to power
+			// loss during a write) is skipped.
+			if (at_end) {
+				read_segment++;
+				read_offset = 0;
+			}
+		}
+		
+		void add_to_chunk(uint64_t time_ms, int channel) {
+			if (read_chunk_length == 0) {
+				read_chunk_start_ms = time_ms;
+				read_chunk_last_ms = time_ms;
+			}
+			uint64_t value = ((time_ms - read_chunk_last_ms) << 1) | channel;
+			read_chunk_length += leb128_encode(value, read_chunk + read_chunk_length);
+			read_chunk_last_ms = time_ms;
+		}
+		
+		/**
+		 * Send the current chunk. If more is false, the retrieval is complete.
+		 */
+		void send_chunk(Qth::Event *data_evt, bool more) {
+			// NB: Static to avoid a heap allocation (and fragmentation) for every
+			// chunk sent.
+			static_assert(((PULSE_LOG_CHUNK_SIZE + 2) / 3) * 4 + 80 <= MQTT_MAX_PACKET_SIZE,
+			              "A base64 encoded chunk and its JSON wrapper must fit in MQTT_MAX_PACKET_SIZE.");
+			static char buf[MQTT_MAX_PACKET_SIZE];
+			int header_length = snprintf(
+				buf, sizeof(buf), "{\"start\":%lu.%03u,\"more\":%s,\"data\":\"",
+				(unsigned long)(read_chunk_start_ms / 1000),
+				(unsigned)(read_chunk_start_ms % 1000),
+				more ? "true" : "false");
+			base64_encode(read_chunk, read_chunk_length, buf + header_length);
+			strcat(buf, "\"}");
+			qth_send_event(data_evt, buf);
+			
+			read_chunk_length = 0;
+			if (!more) {
+				reading = false;
+			}
+		}
+};
+
+PulseLog pulse_log;
+
+
+/**
+ * Skip any whitespace and then the expected character c. Returns false if c
+ * is not next.
+ */
+bool parse_char(const char **str, char c) {
+	while (isspace(**str)) {
+		(*str)++;
+	}
+	if (**str != c) {
+		return false;
+	}
+	(*str)++;
+	return true;
+}
+
+/**
+ * Parse an unsigned decimal integer (after any whitespace), advancing *str
+ * past it. Returns false if there is no number (NB: including if it has a
+ * sign) or it is out of range.
+ */
+bool parse_unsigned(const char **str, unsigned long *value) {
+	while (isspace(**str)) {
+		(*str)++;
+	}
+	if (!isdigit(**str)) {
+		return false;
+	}
+	char *end;
+	errno = 0;
+	*value = strtoul(*str, &end, 10);
+	*str = end;
+	return errno != ERANGE;
+}
+
+void on_pulse_log_request(const char *topic, const char *json) {
+	// Expect [start, end] in whole seconds since the UNIX epoch
+	const char *str = json;
+	unsigned long start;
+	unsigned long end;
+	if (!(parse_char(&str, '[') &&
+	      parse_unsigned(&str, &start) &&
+	      parse_char(&str, ',') &&
+	      parse_unsigned(&str, &end) &&
+	      parse_char(&str, ']') &&
+	      parse_char(&str, '\0')) ||
+	    start > end) {
+		Serial.println("Expected [start, end] in pulse log request.");
+		metrics.increment(METRIC_JSON_ERRORS);
+		return;
+	}
+	pulse_log.start_read((uint64_t)start * 1000ull, (uint64_t)end * 1000ull);
+}
+
+Qth::Event electricity_pulse_evt(
+	QTH_PATH_PREFIX"electricity/watt-hour-consumed",
+	"Fires once per watt-hour consumed with [ms since the last pulse, server time of the pulse (s since the UNIX epoch) or null if unknown]. (Formerly just the ms since the last pulse.)");
+
+Qth::Event gas_pulse_evt(
+	QTH_PATH_PREFIX"gas/cubic-foot-consumed",
+	"Fires once per cubic-foot consumed with [ms since the last pulse, server time of the pulse (s since the UNIX epoch) or null if unknown]. (Formerly just the ms since the last pulse.)");
+
+Qth::Property electricity_detector_prop(
+	QTH_PATH_PREFIX"electricity/detector",
+	"Diagnostics for the electricity pulse detector: {\\\"baseline\\\": adc, \\\"noise\\\": adc, \\\"threshold\\\": adc}.",
+	true); // true == 1:N
+
+Qth::Property electricity_total_prop(
+	QTH_PATH_PREFIX"electricity/watt-hours-total",
+	"Total number of watt-hours consumed (odometer).",
+	true); // true == 1:N
+
+Qth::Property gas_total_prop(
+	QTH_PATH_PREFIX"gas/cubic-feet-total",
+	"Total number of cubic feet of gas consumed (odometer).",
+	true); // true == 1:N
+
+Qth::Event pulse_log_request_evt(
+	QTH_PATH_PREFIX"pulse-log/request",
+	on_pulse_log_request,
+	"Request logged pulses between [start, end] (whole seconds since the UNIX epoch). Sent in chunks to power/pulse-log/data.",
+	false); // false == N:1
+
+Qth::Event pulse_log_data_evt(
+	QTH_PATH_PREFIX"pulse-log/data",
+	"Chunks of logged pulses: {\\\"start\\\": seconds since UNIX epoch, \\\"more\\\": bool, \\\"data\\\": base64}. Data is a series of LEB128 (delta_ms << 1 | is_gas) values, the first relative to start.",
+	true); // true == 1:N
+
+Qth::Property pulse_log_usage_prop(
+	QTH_PATH_PREFIX"pulse-log/usage",
+	"Pulse log space usage: {\\\"bytes\\\": n, \\\"segments\\\": n, \\\"dropped\\\": n, \\\"fs_used\\\": n, \\\"fs_total\\\": n}.",
+	true); // true == 1:N
+
+const QthPropertyEntry properties[] PROGMEM = {
+	// property, watch, initial value
+	{&electricity_detector_prop, false, NULL},
+	{&electricity_total_prop, false, NULL},
+	{&gas_total_prop, false, NULL},
+	{&pulse_log_usage_prop, false, NULL},
+};
+
+const QthEventEntry events[] PROGMEM = {
+	// event, watch
+	{&electricity_pulse_evt, false},
+	{&gas_pulse_evt, false},
+	{&pulse_log_request_evt, true},
+	{&pulse_log_data_evt, false},
+};
+
+void on_electricity_sample(int reading, void *data);
 
 void setup() {
 	setup_common();
 	
 	pinMode(GAS_PIN, INPUT_PULLUP);
 	
-	electricity_pulse_evt = new Qth::Event(
-		QTH_PATH_PREFIX"electricity/watt-hour-consumed",
-		"Fires once per watt-hour consumed, with the number of milliseconds since the last pulse.");
-	qth.registerEvent(electricity_pulse_evt);
+	qth_register(qth, properties);
+	qth_register(qth, events);
 	
-	gas_pulse_evt = new Qth::Event(
-		QTH_PATH_PREFIX"gas/cubic-foot-consumed",
-		"Fires once per cubic-foot consumed, with the number of milliseconds since the last pulse.");
-	qth.registerEvent(gas_pulse_evt);
+	configTime(0, 0, PULSE_LOG_NTP_SERVER);
+	
+	odometer.begin();
+	pulse_log.begin();
+	
+	adc_service.add_consumer(SENSOR_SAMPLE_PERIOD, on_electricity_sample);
 }
 
 
@@ -94,15 +967,20 @@ void setup() {
 void loop_gas() {
 	// NB: Inverted to get an active-high boolean
 	bool this_state = !digitalRead(GAS_PIN);
+	trace_capture.add(TRACE_CHANNEL_DIGITAL, this_state);
 	static bool last_state = false;
 	
-	static unsigned long last_pulse_ms = -1;
+	static unsigned long last_pulse_ms = ULONG_MAX;
 	
 	// Positive-edge only
 	if (this_state && !last_state) {
+		odometer.add_cubic_foot();
+		metrics.increment(METRIC_PULSES);
+		pulse_log.record(PULSE_LOG_GAS);
+		
 		unsigned long ms_since_last_pulse = 0;
 		unsigned long now = millis();
-		if (last_pulse_ms != -1) {
+		if (last_pulse_ms != ULONG_MAX) {
 			ms_since_last_pulse = now - last_pulse_ms;
 		}
 		last_pulse_ms = now;
@@ -110,9 +988,11 @@ void loop_gas() {
 		// NB: Don't send first zero-containing reading since it will confuse
 		// things taking a reciprocal.
 		if (ms_since_last_pulse) {
+			char timestamp[SERVER_CLOCK_FORMAT_LENGTH];
+			server_clock.format(now, timestamp);
 			char buf[50];
-			snprintf(buf, sizeof(buf), "%lu", ms_since_last_pulse);
-			qth.sendEvent(gas_pulse_evt, buf);
+			snprintf(buf, sizeof(buf), "[%lu,%s]", ms_since_last_pulse, timestamp);
+			qth_send_event(&gas_pulse_evt, buf);
 		}
 	}
 	
@@ -121,19 +1001,21 @@ void loop_gas() {
 
 
 /**
- * Call at SENSOR_SAMPLE_PERIOD to monitor the electricity sensor.
+ * Called by the ADC service with a new electricity sensor reading every
+ * SENSOR_SAMPLE_PERIOD.
  *
  * See comment above 'ELECTRICITY_WINDOW' for explanation of the mechanism
  * used.
  */
-void loop_electricity() {
+void on_electricity_sample(int reading, void *data) {
 	// A circular buffer containing the window. The intial value of '-1' is used
 	// as a sentinel below to trigger initialisation on the first call to this
 	// function.
 	static int readings[ELECTRICITY_WINDOW] = {-1}; 
 	static int next_reading_index = 0;
 	
-	int reading = analogRead(ELECTRICITY_PIN);
+	electricity_threshold.update(reading);
+	int threshold = electricity_threshold.get_threshold();
 	
 	// Initialise window on startup
 	if (readings[0] == -1) {
@@ -158,17 +1040,24 @@ void loop_electricity() {
 		}
 	}
 	
-	if (window_max_reading - window_oldest_reading > ELECTRICITY_PEAK_DELTA_THRESHOLD &&
-	    window_max_reading - window_newest_reading > ELECTRICITY_PEAK_DELTA_THRESHOLD) {
+	if (window_max_reading - window_oldest_reading > threshold &&
+	    window_max_reading - window_newest_reading > threshold) {
+		electricity_threshold.pulse_detected(
+			window_max_reading - max(window_oldest_reading, window_newest_reading));
+		
 		// Reset the window to prevent this pulse being reported several times
 		for (int i = 0; i < ELECTRICITY_WINDOW; i++) {
 			readings[i] = reading;
 		}
 		
-		static unsigned long last_pulse_ms = -1;
+		odometer.add_watt_hour();
+		metrics.increment(METRIC_PULSES);
+		pulse_log.record(PULSE_LOG_ELECTRICITY);
+		
+		static unsigned long last_pulse_ms = ULONG_MAX;
 		unsigned long now = millis();
 		unsigned long ms_since_last_pulse = 0;
-		if (last_pulse_ms != -1) {
+		if (last_pulse_ms != ULONG_MAX) {
 			ms_since_last_pulse = now - last_pulse_ms;
 		}
 		last_pulse_ms = now;
@@ -176,22 +1065,106 @@ void loop_electricity() {
 		// NB: Don't send first zero-containing reading since it will confuse
 		// things taking a reciprocal.
 		if (ms_since_last_pulse) {
+			char timestamp[SERVER_CLOCK_FORMAT_LENGTH];
+			server_clock.format(now, timestamp);
 			char buf[50];
-			snprintf(buf, sizeof(buf), "%lu", ms_since_last_pulse);
-			qth.sendEvent(electricity_pulse_evt, buf);
+			snprintf(buf, sizeof(buf), "[%lu,%s]", ms_since_last_pulse, timestamp);
+			qth_send_event(&electricity_pulse_evt, buf);
 		}
 	}
 }
 
 
+/**
+ * Call regularly to publish the electricity detector's diagnostic values.
+ */
+void loop_electricity_diagnostics() {
+	static unsigned long last_publish = 0;
+	unsigned long now = millis();
+	if (now - last_publish >= ELECTRICITY_DIAGNOSTIC_PERIOD) {
+		char buf[80];
+		snprintf(buf, sizeof(buf),
+		         "{\"baseline\":%.1f,\"noise\":%.2f,\"threshold\":%d}",
+		         electricity_threshold.get_baseline(),
+		         electricity_threshold.get_noise(),
+		         electricity_threshold.get_threshold());
+		qth.setProperty(&electricity_detector_prop, buf);
+		last_publish = now;
+	}
+}
+
+
+/**
+ * Call regularly to publish the odometer totals when they change.
+ */
+void loop_odometer() {
+	odometer.loop();
+	
+	static bool published = false;
+	static Odometer::Totals last_totals;
+	static unsigned long last_publish = 0;
+	unsigned long now = millis();
+	const Odometer::Totals &totals = odometer.get_totals();
+	if (now - last_publish >= ODOMETER_PUBLISH_PERIOD || !published) {
+		char buf[20];
+		if (!published || totals.watt_hours != last_totals.watt_hours) {
+			snprintf(buf, sizeof(buf), "%lu", (unsigned long)totals.watt_hours);
+			qth.setProperty(&electricity_total_prop, buf);
+		}
+		if (!published || totals.cubic_feet != last_totals.cubic_feet) {
+			snprintf(buf, sizeof(buf), "%lu", (unsigned long)totals.cubic_feet);
+			qth.setProperty(&gas_total_prop, buf);
+		}
+		last_totals = totals;
+		last_publish = now;
+		published = true;
+	}
+}
+
+
+/**
+ * Call regularly to maintain the pulse log and publish its usage.
+ */
+void loop_pulse_log() {
+	pulse_log.loop(&pulse_log_data_evt);
+	
+	static bool published = false;
+	static unsigned long last_publish = 0;
+	unsigned long now = millis();
+	if (now - last_publish >= PULSE_LOG_USAGE_PERIOD || !published) {
+		FSInfo info;
+		if (!LittleFS.info(info)) {
+			info.usedBytes = 0;
+			info.totalBytes = 0;
+		}
+		char buf[120];
+		snprintf(buf, sizeof(buf),
+		         "{\"bytes\":%lu,\"segments\":%lu,\"dropped\":%lu,\"fs_used\":%lu,\"fs_total\":%lu}",
+		         (unsigned long)pulse_log.get_total_bytes(),
+		         (unsigned long)pulse_log.get_num_segments(),
+		         (unsigned long)pulse_log.get_num_dropped(),
+		         (unsigned long)info.usedBytes,
+		         (unsigned long)info.totalBytes);
+		qth.setProperty(&pulse_log_usage_prop, buf);
+		last_publish = now;
+		published = true;
+	}
+}
+
+
 void loop() {
 	loop_common();
+	loop_electricity_diagnostics();
+	{
+		WatchdogScope scope(storage_loop_section);
+		loop_odometer();
+		loop_pulse_log();
+	}
 	
 	static unsigned long last_sample = 0;
 	unsigned long now = millis();
 	if (now - last_sample > SENSOR_SAMPLE_PERIOD) {
 		loop_gas();
-		loop_electricity();
 		last_sample = now;
 	}
 }
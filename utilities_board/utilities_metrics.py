@@ -3,16 +3,79 @@ Quick Qth client which produces more useful metrics from the measurements from
 this NodeMCU device.
 """
 
+import time
+import asyncio
+
 from qth_yarp import watch_event, set_property, run_forever
 import yarp
 
+
+@yarp.fn
+def pulse_interval_ms(value):
+    """
+    Extract the interval from a pulse event's [interval_ms, time] value.
+    """
+    return value[0]
+
+
+def bucketed_count(event, window=60*60*24, bucket=5*60, loop=None):
+    """
+    Produce a Value counting the pulse events which occurred in the last
+    `window` seconds, to a resolution of `bucket` seconds.
+
+    Unlike yarp.len(yarp.time_window(...)), which keeps every event in the
+    window, this keeps a fixed-size ring of per-bucket counts which is updated
+    incrementally. Events are counted by the time of the pulse they report (or
+    their arrival time if the board didn't know the time) so late events land
+    in the right bucket; events older than the window are ignored.
+    """
+    loop = loop or asyncio.get_event_loop()
+
+    num_buckets = int(window // bucket)
+    counts = [0] * num_buckets
+    state = {"latest": int(time.time() // bucket), "total": 0}
+
+    output = yarp.Value(0)
+
+    def advance(now_bucket):
+        """Move the ring forward, clearing buckets which leave the window."""
+        for b in range(max(state["latest"] + 1, now_bucket - num_buckets + 1),
+                       now_bucket + 1):
+            state["total"] -= counts[b % num_buckets]
+            counts[b % num_buckets] = 0
+        state["latest"] = max(state["latest"], now_bucket)
+
+    def on_event(value):
+        now = time.time()
+        if now // bucket > state["latest"]:
+            advance(int(now // bucket))
+
+        pulse_time = value[1] if value[1] is not None else now
+        b = min(int(pulse_time // bucket), state["latest"])
+        if b > state["latest"] - num_buckets:
+            counts[b % num_buckets] += 1
+            state["total"] += 1
+            output.value = state["total"]
+
+    def on_bucket_boundary():
+        now = time.time()
+        advance(int(now // bucket))
+        output.value = state["total"]
+        loop.call_later(bucket - (now % bucket), on_bucket_boundary)
+
+    event.on_value_changed(on_event)
+    loop.call_later(bucket - (time.time() % bucket), on_bucket_boundary)
+
+    return output
+
 ################################################################################
 # Convert electricity events into more sensible units
 ################################################################################
 
 watt_hour_consumed = watch_event("power/electricity/watt-hour-consumed")
 
-ms_per_watt_hour = yarp.make_persistent(watt_hour_consumed, float("inf"))
+ms_per_watt_hour = yarp.make_persistent(pulse_interval_ms(watt_hour_consumed),
+                                        float("inf"))
 s_per_watt_hour = ms_per_watt_hour / 1000.0
 watts = round((60 * 60) / s_per_watt_hour)
 
@@ -22,7 +85,7 @@ set_property("power/electricity/power-consumption",
              description="Current rate of electricity consumption in kilowatts",
              delete_on_unregister=True)
 
-electricity_watt_hours_in_last_24_hours = yarp.len(yarp.time_window(watt_hour_consumed, 60*60*24))
+electricity_watt_hours_in_last_24_hours = bucketed_count(watt_hour_consumed)
 
 set_property("power/electricity/24-hour-usage",
              electricity_watt_hours_in_last_24_hours / 1000.0,
@@ -51,7 +114,7 @@ megajoules_per_kwh = 3.6
 kwh_per_cubic_meter = (calorific_value / megajoules_per_kwh) * conversion_factor
 kwh_per_cubic_foot = kwh_per_cubic_meter * cubic_meters_per_cubic_foot
 
-gas_kwh_in_last_24_hours = yarp.len(yarp.time_window(cubic_foot_consumed, 60*60*24)) * kwh_per_cubic_foot
+gas_kwh_in_last_24_hours = bucketed_count(cubic_foot_consumed) * kwh_per_cubic_foot
 
 set_property("power/gas/24-hour-usage",
              gas_kwh_in_last_24_hours,